@@ -46,12 +46,13 @@ Item {
             property int key
             property string value
         }
+    }
 
-        SqlModel {
-            id: select
-            query: "SELECT COUNT(key) as keys FROM Chat WHERE value LIKE ?"
-            params: ['%Qt%']
-        }
+    AggregateModel {
+        id: aggregate
+        model: table
+        column: 'key'
+        filter: function(row) { return row.value.toLowerCase().indexOf('qt') > -1 }
     }
 
     Rectangle {
@@ -73,10 +74,8 @@ Item {
 
 
             Keys.onReturnPressed: {
-                select.select = false
                 table.insert({'value': field.text})
                 field.text = ''
-                select.select = true
             }
         }
     }
@@ -114,22 +113,23 @@ Item {
                     text: model.value
                     MouseArea {
                         anchors.fill: parent
-                        onClicked: {
-                            select.select = false
-                            table.remove({'key': model.key})
-                            select.select = true
-                        }
+                        onClicked: table.remove({'key': model.key})
                     }
                 }
             }
         }
     }
-    Text {
+    Column {
         id: footer
         anchors.bottom: parent.bottom
         anchors.left: parent.left
         anchors.right: parent.right
-        text: 'the number of values that contains "Qt" is %1.'.arg(select.count > 0 ? select.get(0).keys : '0')
+        Repeater {
+            model: aggregate
+            Text {
+                text: 'the number of values that contains "Qt" is %1.'.arg(model.count)
+            }
+        }
     }
 
 }
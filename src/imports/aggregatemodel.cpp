@@ -0,0 +1,375 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "aggregatemodel.h"
+#include "tablemodel.h"
+#include "tracing.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QMap>
+#include <QtQml/QQmlEngine>
+
+// NULL and '' are different groups, as in SQL
+static QString groupId(const QVariant &value)
+{
+    return value.isNull() ? QString() : QLatin1Char('=') + value.toString();
+}
+
+class AggregateModel::Private : public QObject
+{
+    Q_OBJECT
+public:
+    Private(AggregateModel *parent);
+
+    // what a single row of the source model contributed
+    struct Entry {
+        Entry() : passed(false) {}
+        bool passed;
+        QString group;
+        QVariant groupValue;
+        QVariant value;
+    };
+
+    struct Group {
+        Group() : rows(0), count(0), sum(0) {}
+        QVariant value;
+        int rows;
+        int count;
+        double sum;
+        // multiset of values for min/max, O(log n) instead of a rescan on remove
+        QMap<double, int> values;
+    };
+
+    Entry entry(int row) const;
+    void add(const Entry &entry);
+    void subtract(const Entry &entry);
+    void groupChanged(int index);
+    void reindex();
+
+public slots:
+    void reset();
+
+private slots:
+    void modelChanged(TableModel *model);
+    void rowsInserted(const QModelIndex &parent, int first, int last);
+    void rowsAboutToBeRemoved(const QModelIndex &parent, int first, int last);
+    void dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
+
+private:
+    AggregateModel *q;
+    TableModel *source;
+
+public:
+    bool completed;
+    QList<Entry> entries;
+    QList<Group> groups;
+    QHash<QString, int> groupIndex;
+    QHash<int, QByteArray> roleNames;
+};
+
+AggregateModel::Private::Private(AggregateModel *parent)
+    : QObject(parent)
+    , q(parent)
+    , source(0)
+    , completed(false)
+{
+    roleNames.insert(Qt::UserRole + 0, "group");
+    roleNames.insert(Qt::UserRole + 1, "count");
+    roleNames.insert(Qt::UserRole + 2, "sum");
+    roleNames.insert(Qt::UserRole + 3, "min");
+    roleNames.insert(Qt::UserRole + 4, "max");
+    roleNames.insert(Qt::UserRole + 5, "avg");
+
+    connect(q, SIGNAL(modelChanged(TableModel*)), this, SLOT(modelChanged(TableModel*)));
+    connect(q, SIGNAL(columnChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(groupByChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(filterChanged(QJSValue)), this, SLOT(reset()));
+}
+
+void AggregateModel::Private::modelChanged(TableModel *model)
+{
+    if (source) {
+        disconnect(source, 0, this, 0);
+    }
+    source = model;
+    if (model) {
+        connect(model, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(rowsInserted(QModelIndex,int,int)));
+        connect(model, SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)), this, SLOT(rowsAboutToBeRemoved(QModelIndex,int,int)));
+        connect(model, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(dataChanged(QModelIndex,QModelIndex)));
+        connect(model, SIGNAL(modelReset()), this, SLOT(reset()));
+    }
+    reset();
+}
+
+AggregateModel::Private::Entry AggregateModel::Private::entry(int row) const
+{
+    Entry ret;
+    // through data() role by role, get() would fetch the lazy columns too
+    QModelIndex index = q->m_model->index(row, 0);
+    QHash<int, QByteArray> roles = q->m_model->roleNames();
+
+    ret.passed = true;
+    if (q->m_filter.isCallable()) {
+        QQmlEngine *engine = qmlEngine(q);
+        if (engine) {
+            QVariantMap values;
+            QStringList lazy = q->m_model->lazy();
+            foreach (int role, roles.keys()) {
+                QString name = QString::fromUtf8(roles.value(role));
+                if (!lazy.contains(name))
+                    values.insert(name, q->m_model->data(index, role));
+            }
+            QJSValue result = q->m_filter.call(QJSValueList() << engine->toScriptValue(values));
+            if (result.isError()) {
+                qCWarning(lcDatabase) << result.toString();
+            }
+            ret.passed = result.toBool();
+        }
+    }
+    if (!ret.passed) return ret;
+
+    if (!q->m_groupBy.isEmpty()) {
+        ret.groupValue = q->m_model->data(index, roles.key(q->m_groupBy.toUtf8(), -1));
+        ret.group = groupId(ret.groupValue);
+    }
+    if (!q->m_column.isEmpty()) {
+        ret.value = q->m_model->data(index, roles.key(q->m_column.toUtf8(), -1));
+    }
+    return ret;
+}
+
+void AggregateModel::Private::add(const Entry &entry)
+{
+    if (!entry.passed) return;
+
+    int index = groupIndex.value(entry.group, -1);
+    if (index < 0) {
+        Group group;
+        group.value = entry.groupValue;
+        index = groups.count();
+        q->beginInsertRows(QModelIndex(), index, index);
+        groups.append(group);
+        groupIndex.insert(entry.group, index);
+        q->endInsertRows();
+        emit q->countChanged(groups.count());
+    }
+
+    Group &group = groups[index];
+    group.rows++;
+    if (q->m_column.isEmpty()) {
+        group.count++;
+    } else if (!entry.value.isNull()) {
+        double value = entry.value.toDouble();
+        group.count++;
+        group.sum += value;
+        group.values[value]++;
+    }
+    groupChanged(index);
+}
+
+void AggregateModel::Private::subtract(const Entry &entry)
+{
+    if (!entry.passed) return;
+
+    int index = groupIndex.value(entry.group, -1);
+    if (index < 0) return;
+
+    Group &group = groups[index];
+    group.rows--;
+    if (q->m_column.isEmpty()) {
+        group.count--;
+    } else if (!entry.value.isNull()) {
+        double value = entry.value.toDouble();
+        group.count--;
+        group.sum -= value;
+        if (--group.values[value] == 0)
+            group.values.remove(value);
+    }
+
+    // without groupBy there is always exactly one row, as in SQL
+    if (group.rows == 0 && !q->m_groupBy.isEmpty()) {
+        q->beginRemoveRows(QModelIndex(), index, index);
+        groups.removeAt(index);
+        reindex();
+        q->endRemoveRows();
+        emit q->countChanged(groups.count());
+    } else {
+        groupChanged(index);
+    }
+}
+
+void AggregateModel::Private::groupChanged(int index)
+{
+    QModelIndex i = q->index(index);
+    emit q->dataChanged(i, i);
+}
+
+void AggregateModel::Private::reindex()
+{
+    groupIndex.clear();
+    for (int i = 0; i < groups.count(); i++) {
+        groupIndex.insert(groupId(groups.at(i).value), i);
+    }
+}
+
+void AggregateModel::Private::reset()
+{
+    if (!completed) return;
+
+    q->beginResetModel();
+    entries.clear();
+    groups.clear();
+    groupIndex.clear();
+    if (q->m_groupBy.isEmpty()) {
+        groups.append(Group());
+        groupIndex.insert(QString(), 0);
+    }
+    q->endResetModel();
+
+    if (q->m_model) {
+        rowsInserted(QModelIndex(), 0, q->m_model->rowCount() - 1);
+    }
+    emit q->countChanged(groups.count());
+}
+
+void AggregateModel::Private::rowsInserted(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent)
+    if (last < first) return;
+    // the rows behind move once per batch, not once per row
+    QList<Entry> tail = entries.mid(first);
+    entries.erase(entries.begin() + qMin(first, entries.count()), entries.end());
+    entries.reserve(entries.count() + last - first + 1 + tail.count());
+    for (int i = first; i <= last; i++) {
+        Entry e = entry(i);
+        entries.append(e);
+        add(e);
+    }
+    entries.append(tail);
+}
+
+void AggregateModel::Private::rowsAboutToBeRemoved(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent)
+    last = qMin(last, entries.count() - 1);
+    if (last < first) return;
+    for (int i = last; i >= first; i--) {
+        subtract(entries.at(i));
+    }
+    entries.erase(entries.begin() + first, entries.begin() + last + 1);
+}
+
+void AggregateModel::Private::dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight)
+{
+    for (int i = topLeft.row(); i <= bottomRight.row() && i < entries.count(); i++) {
+        Entry e = entry(i);
+        subtract(entries.at(i));
+        entries[i] = e;
+        add(e);
+    }
+}
+
+AggregateModel::AggregateModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , d(new Private(this))
+    , m_model(0)
+{
+}
+
+QJSValue AggregateModel::filter() const
+{
+    return m_filter;
+}
+
+void AggregateModel::filter(const QJSValue &filter)
+{
+    if (m_filter.strictlyEquals(filter)) return;
+    m_filter = filter;
+    emit filterChanged(filter);
+}
+
+void AggregateModel::classBegin()
+{
+}
+
+void AggregateModel::componentComplete()
+{
+    d->completed = true;
+    d->reset();
+}
+
+QHash<int, QByteArray> AggregateModel::roleNames() const
+{
+    return d->roleNames;
+}
+
+int AggregateModel::rowCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent)
+    return d->groups.count();
+}
+
+QVariant AggregateModel::data(const QModelIndex &index, int role) const
+{
+    if (index.row() < 0 || index.row() >= d->groups.count()) return QVariant();
+
+    const Private::Group &group = d->groups.at(index.row());
+    bool empty = m_column.isEmpty() || group.values.isEmpty();
+    switch (role - Qt::UserRole) {
+    case 0:
+        return group.value;
+    case 1:
+        return group.count;
+    case 2:
+        return m_column.isEmpty() ? QVariant() : QVariant(group.sum);
+    case 3:
+        return empty ? QVariant() : QVariant(group.values.firstKey());
+    case 4:
+        return empty ? QVariant() : QVariant(group.values.lastKey());
+    case 5:
+        return empty ? QVariant() : QVariant(group.sum / group.count);
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+int AggregateModel::count() const
+{
+    return rowCount();
+}
+
+QVariantMap AggregateModel::get(int index) const
+{
+    QVariantMap ret;
+    if (index < 0 || index >= d->groups.count()) return ret;
+    foreach (int role, d->roleNames.keys()) {
+        ret.insert(QString::fromUtf8(d->roleNames.value(role)), data(this->index(index), role));
+    }
+    return ret;
+}
+
+#include "aggregatemodel.moc"
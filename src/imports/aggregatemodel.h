@@ -0,0 +1,95 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AGGREGATEMODEL_H
+#define AGGREGATEMODEL_H
+
+#include <QtCore/QAbstractListModel>
+
+#include <QtQml/QJSValue>
+#include <QtQml/QQmlParserStatus>
+
+class TableModel;
+
+class AggregateModel : public QAbstractListModel, public QQmlParserStatus
+{
+    Q_OBJECT
+
+    Q_PROPERTY(TableModel *model READ model WRITE model NOTIFY modelChanged)
+    Q_PROPERTY(QString column READ column WRITE column NOTIFY columnChanged)
+    Q_PROPERTY(QString groupBy READ groupBy WRITE groupBy NOTIFY groupByChanged)
+    // function(row) { return ... }, row holds every column except the lazy ones
+    Q_PROPERTY(QJSValue filter READ filter WRITE filter NOTIFY filterChanged)
+    Q_PROPERTY(int count READ count NOTIFY countChanged)
+
+    Q_INTERFACES(QQmlParserStatus)
+public:
+    explicit AggregateModel(QObject *parent = 0);
+
+    QJSValue filter() const;
+    void filter(const QJSValue &filter);
+
+    int count() const;
+    Q_INVOKABLE QVariantMap get(int index) const;
+
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    virtual QHash<int, QByteArray> roleNames() const;
+
+    virtual void classBegin();
+    virtual void componentComplete();
+
+signals:
+    void modelChanged(TableModel *model);
+    void columnChanged(const QString &column);
+    void groupByChanged(const QString &groupBy);
+    void filterChanged(const QJSValue &filter);
+    void countChanged(int count);
+
+private:
+    class Private;
+    Private *d;
+    QJSValue m_filter;
+
+#define ADD_PROPERTY(type, name, type2) \
+public: \
+    type name() const { return m_##name; } \
+    void name(type name) { \
+        if (m_##name == name) return; \
+        m_##name = name; \
+        emit name##Changed(name); \
+    } \
+private: \
+    type2 m_##name;
+
+    ADD_PROPERTY(TableModel *, model, TableModel *)
+    ADD_PROPERTY(const QString &, column, QString)
+    ADD_PROPERTY(const QString &, groupBy, QString)
+
+#undef ADD_PROPERTY
+};
+
+#endif // AGGREGATEMODEL_H
@@ -0,0 +1,345 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "blob.h"
+#include "sqlitehandle.h"
+#include "tracing.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QThreadStorage>
+#include <QtCore/QUrl>
+
+#ifdef DATABASE_QUICK
+#include <QtGui/QImageReader>
+#endif
+
+#include <QtSql/QSqlDriver>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+// bytes copied at once between a blob and a file
+static const int chunkSize = 64 * 1024;
+
+static bool isIncremental(const QSqlDatabase &db)
+{
+    return SqliteApi::get(db) != 0;
+}
+
+class BlobDevice::Private
+{
+public:
+    Private();
+    bool lookup();
+
+    QSqlDatabase db;
+    QString tableName;
+    QString column;
+    QString primaryKey;
+    QVariant key;
+    qint64 rowid;
+    const SqliteApi *api;
+    sqlite3_blob *blob;
+    // drivers without incremental blob I/O
+    QByteArray buffer;
+    qint64 size;
+};
+
+BlobDevice::Private::Private()
+    : rowid(-1)
+    , api(0)
+    , blob(0)
+    , size(0)
+{
+}
+
+// sqlite3_blob_open() takes a rowid, not the primary key
+bool BlobDevice::Private::lookup()
+{
+    if (rowid >= 0) return true;
+    QSqlQuery query(db);
+    query.prepare(QString("SELECT rowid FROM %1 WHERE %2=?").arg(tableName).arg(primaryKey));
+    query.addBindValue(key);
+    if (!query.exec() || !query.next()) {
+        qCWarning(lcDatabase) << tableName << key << query.lastError().text();
+        return false;
+    }
+    rowid = query.value(0).toLongLong();
+    return true;
+}
+
+BlobDevice::BlobDevice(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, QObject *parent)
+    : QIODevice(parent)
+    , d(new Private)
+{
+    d->db = db;
+    d->tableName = tableName;
+    d->column = column;
+    d->primaryKey = primaryKey;
+    d->key = key;
+}
+
+BlobDevice::~BlobDevice()
+{
+    close();
+    delete d;
+}
+
+bool BlobDevice::resize(qint64 size)
+{
+    if (isOpen()) return false;
+    if (!isIncremental(d->db)) {
+        // the data will be written in one piece at close()
+        d->size = size;
+        return true;
+    }
+    QSqlQuery query(d->db);
+    query.prepare(QString("UPDATE %1 SET %2=zeroblob(?) WHERE %3=?").arg(d->tableName).arg(d->column).arg(d->primaryKey));
+    query.addBindValue(size);
+    query.addBindValue(d->key);
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool BlobDevice::open(OpenMode mode)
+{
+    if ((mode & ReadWrite) == ReadWrite) return false;
+    if ((d->api = SqliteApi::get(d->db))) {
+        if (!d->lookup()) return false;
+        sqlite3 *handle = sqliteHandle(d->db);
+        int rc = d->api->blob_open(handle, "main", d->tableName.toUtf8().constData(), d->column.toUtf8().constData(), d->rowid, mode & WriteOnly ? 1 : 0, &d->blob);
+        if (rc != SqliteApi::Ok) {
+            qCWarning(lcDatabase) << d->tableName << d->column << d->api->errmsg(handle);
+            d->blob = 0;
+            return false;
+        }
+        d->size = d->api->blob_bytes(d->blob);
+        return QIODevice::open(mode | Unbuffered);
+    }
+    if (mode & ReadOnly) {
+        QSqlQuery query(d->db);
+        query.prepare(QString("SELECT %2 FROM %1 WHERE %3=?").arg(d->tableName).arg(d->column).arg(d->primaryKey));
+        query.addBindValue(d->key);
+        if (!query.exec() || !query.next()) {
+            qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+            return false;
+        }
+        d->buffer = query.value(0).toByteArray();
+        d->size = d->buffer.size();
+    } else {
+        d->buffer.clear();
+        d->buffer.reserve(d->size);
+    }
+    return QIODevice::open(mode | Unbuffered);
+}
+
+void BlobDevice::close()
+{
+    if (!isOpen()) return;
+    if (d->blob) {
+        d->api->blob_close(d->blob);
+        d->blob = 0;
+    }
+    if (!isIncremental(d->db) && openMode() & WriteOnly) {
+        QSqlQuery query(d->db);
+        query.prepare(QString("UPDATE %1 SET %2=? WHERE %3=?").arg(d->tableName).arg(d->column).arg(d->primaryKey));
+        query.addBindValue(d->buffer);
+        query.addBindValue(d->key);
+        if (!query.exec())
+            qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+    }
+    d->buffer.clear();
+    QIODevice::close();
+}
+
+bool BlobDevice::isSequential() const
+{
+    return false;
+}
+
+qint64 BlobDevice::size() const
+{
+    return d->size;
+}
+
+bool BlobDevice::seek(qint64 pos)
+{
+    if (pos < 0 || pos > d->size) return false;
+    return QIODevice::seek(pos);
+}
+
+qint64 BlobDevice::readData(char *data, qint64 maxSize)
+{
+    qint64 length = qMin(maxSize, d->size - pos());
+    if (length <= 0) return 0;
+    if (d->blob) {
+        if (d->api->blob_read(d->blob, data, int(length), int(pos())) != SqliteApi::Ok) return -1;
+        return length;
+    }
+    memcpy(data, d->buffer.constData() + pos(), length);
+    return length;
+}
+
+qint64 BlobDevice::writeData(const char *data, qint64 maxSize)
+{
+    qint64 length = qMin(maxSize, d->size - pos());
+    if (length <= 0) return maxSize > 0 ? -1 : 0;
+    if (d->blob) {
+        if (d->api->blob_write(d->blob, data, int(length), int(pos())) != SqliteApi::Ok) return -1;
+        return length;
+    }
+    d->buffer.append(data, length);
+    return length;
+}
+
+bool BlobDevice::store(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, const QString &fileName)
+{
+    TraceScope trace("sql", "BlobDevice::store");
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly)) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+        return false;
+    }
+
+    BlobDevice blob(db, tableName, column, primaryKey, key);
+    if (!blob.resize(file.size()) || !blob.open(WriteOnly)) return false;
+    QByteArray chunk;
+    while (!(chunk = file.read(chunkSize)).isEmpty()) {
+        if (blob.write(chunk) != chunk.size()) return false;
+    }
+    return true;
+}
+
+bool BlobDevice::fetch(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, const QString &fileName)
+{
+    TraceScope trace("sql", "BlobDevice::fetch");
+    BlobDevice blob(db, tableName, column, primaryKey, key);
+    if (!blob.open(ReadOnly)) return false;
+
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+        return false;
+    }
+    QByteArray chunk;
+    while (!(chunk = blob.read(chunkSize)).isEmpty()) {
+        if (file.write(chunk) != chunk.size()) return false;
+    }
+    return true;
+}
+
+QUrl BlobDevice::url(const QString &connectionName, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key)
+{
+    QStringList parts;
+    parts << connectionName << tableName << column << primaryKey << key.toString();
+    QStringList encoded;
+    foreach (const QString &part, parts) {
+        encoded.append(QString::fromLatin1(QUrl::toPercentEncoding(part)));
+    }
+    return QUrl(QString("image://database/%1").arg(encoded.join(QLatin1String("/"))));
+}
+
+#ifdef DATABASE_QUICK
+// clones opened by an image loader thread, removed when it finishes
+class ThreadConnections
+{
+public:
+    ~ThreadConnections()
+    {
+        foreach (const QString &name, names) {
+            {
+                QSqlDatabase db = QSqlDatabase::database(name, false);
+                db.close();
+            }
+            QSqlDatabase::removeDatabase(name);
+        }
+    }
+    // connection name -> clone name
+    QHash<QString, QString> names;
+};
+
+static QThreadStorage<ThreadConnections *> threadConnections;
+static QAtomicInt threadSerial;
+
+// connections are bound to their thread, images may be loaded in another one;
+// like the workers of the pool every loader thread gets a clone of its own
+static QSqlDatabase threadDatabase(const QString &connectionName)
+{
+    if (QThread::currentThread() == QCoreApplication::instance()->thread())
+        return QSqlDatabase::database(connectionName, false);
+
+    if (!threadConnections.hasLocalData())
+        threadConnections.setLocalData(new ThreadConnections);
+    ThreadConnections *connections = threadConnections.localData();
+    QString name = connections->names.value(connectionName);
+    if (!name.isEmpty())
+        return QSqlDatabase::database(name);
+
+    name = QString("%1/image%2").arg(connectionName).arg(threadSerial.fetchAndAddRelaxed(1));
+    // the QString overload does not touch the original from this thread
+    QSqlDatabase ret = QSqlDatabase::cloneDatabase(connectionName, name);
+    connections->names.insert(connectionName, name);
+    if (!ret.open())
+        qCWarning(lcDatabase) << name << ret.lastError().text();
+    return ret;
+}
+
+BlobImageProvider::BlobImageProvider()
+    : QQuickImageProvider(QQuickImageProvider::Image)
+{
+}
+
+QImage BlobImageProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
+{
+    TraceScope trace("model", "BlobImageProvider::requestImage");
+    QStringList parts = id.split(QLatin1Char('/'));
+    if (parts.count() != 5) return QImage();
+    for (int i = 0; i < parts.count(); i++) {
+        parts[i] = QUrl::fromPercentEncoding(parts.at(i).toLatin1());
+    }
+
+    BlobDevice blob(threadDatabase(parts.at(0)), parts.at(1), parts.at(2), parts.at(3), parts.at(4));
+    if (!blob.open(QIODevice::ReadOnly)) return QImage();
+
+    // decoded straight from the blob, scaled while reading if asked to
+    QImageReader reader(&blob);
+    if (size)
+        *size = reader.size();
+    if (requestedSize.isValid()) {
+        QSize scaled = reader.size();
+        scaled.scale(requestedSize, Qt::KeepAspectRatio);
+        reader.setScaledSize(scaled);
+    }
+    return reader.read();
+}
+#endif
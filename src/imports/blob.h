@@ -0,0 +1,84 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <QtCore/QIODevice>
+#include <QtCore/QVariant>
+
+#include <QtSql/QSqlDatabase>
+
+#ifdef DATABASE_QUICK
+#include <QtQuick/QQuickImageProvider>
+#endif
+
+// sequential access to one BLOB value, in chunks through sqlite3_blob_*() for
+// QSQLITE (see SqliteApi); other drivers have no such API, the value is read
+// in one piece
+class BlobDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    BlobDevice(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, QObject *parent = 0);
+    ~BlobDevice();
+
+    // WriteOnly needs resize() first, a blob can not grow while it is open
+    bool resize(qint64 size);
+
+    virtual bool open(OpenMode mode);
+    virtual void close();
+    virtual bool isSequential() const;
+    virtual qint64 size() const;
+    virtual bool seek(qint64 pos);
+
+    // streams between a blob and a file
+    static bool store(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, const QString &fileName);
+    static bool fetch(const QSqlDatabase &db, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key, const QString &fileName);
+
+    // image://database/<connection>/<table>/<column>/<primary key>/<key>
+    static QUrl url(const QString &connectionName, const QString &tableName, const QString &column, const QString &primaryKey, const QVariant &key);
+
+protected:
+    virtual qint64 readData(char *data, qint64 maxSize);
+    virtual qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    class Private;
+    Private *d;
+};
+
+#ifdef DATABASE_QUICK
+class BlobImageProvider : public QQuickImageProvider
+{
+public:
+    BlobImageProvider();
+
+    virtual QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize);
+};
+#endif
+
+#endif // BLOB_H
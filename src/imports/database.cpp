@@ -25,42 +25,343 @@
  */
 
 #include "database.h"
+#include "sqliteengine.h"
+#include "sqlitehandle.h"
+#include "tracing.h"
+#include "workerpool.h"
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDataStream>
 #include <QtCore/QDebug>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QPair>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSet>
+#include <QtCore/QTime>
 #include <QtCore/QTimer>
+#include <QtCore/QUrl>
+#include <QtCore/QWaitCondition>
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+#include <QtSql/QSqlRecord>
 #include <QtQml/qqml.h>
 #include <QtQml/QQmlContext>
 
+namespace {
+
+struct SharedEntry {
+    SharedEntry() : ref(0), running(true) {}
+    QString connectionName;
+    QByteArray key;
+    QStringList tables;
+    int ref;
+    bool running;
+    Database::Result result;
+    // callers that did not wait for it, see sharedResult()
+    QList<QPair<quint64, Database::Joined> > joined;
+};
+
+// guarded by sharedMutex
+QMutex sharedMutex;
+QWaitCondition sharedDone;
+quint64 sharedSerial = 0;
+QHash<quint64, SharedEntry *> sharedEntries;
+QHash<QByteArray, quint64> sharedIndex;
+
+}
+
 class Database::Private : public QObject
 {
     Q_OBJECT
 public:
     Private(Database *parent);
 
+    void configure(QSqlDatabase db) const;
+    // counts the writes to the observed tables in __database_changes, other processes included
+    void watch(QSqlDatabase db);
+    void installTriggers(QSqlDatabase db);
+    // once nobody observes the table anymore
+    void dropTriggers(QSqlDatabase db, const QString &tableName);
+    QHash<QString, qint64> readCounters(QSqlDatabase db, const QString &tableName = QString()) const;
+    // takes the counter of tableName after a write of ours, coalesced per event loop pass
+    void snapshot(const QString &tableName);
+
+private slots:
+    void tableChanged(const QString &tableName);
+    void takeSnapshots();
+    void poll();
+    void writeEnded(const QString &tableName);
+    // from the advisor on the pool
+    void suggest(const QVariantList &suggestions);
+    void indexCreated(int index);
+
 private:
     Database *q;
 
 public:
     QList<QObject *> contents;
+    WorkerPool *pool;
     bool open;
+    // queries the advisor has looked at already
+    QSet<QString> advised;
+    QVariantList suggestions;
+    QTimer *pollTimer;
+    qint64 dataVersion;
+    qint64 schemaVersion;
+    // __database_changes as of the last poll or write of ours
+    QHash<QString, qint64> counters;
+    // lower case names of the tables snapshot() was asked for since the last read
+    QSet<QString> snapshots;
+    QTimer *snapshotTimer;
+    // lower case table names by the number of models reading them
+    QHash<QString, int> observed;
+    // writes of pool workers in progress
+    QAtomicInt writes;
 };
 
 Database::Private::Private(Database *parent)
     : QObject(parent)
     , q(parent)
+    , pool(0)
     , open(false)
+    , pollTimer(0)
+    , snapshotTimer(0)
+    , dataVersion(0)
+    , schemaVersion(0)
+{
+    connect(q, SIGNAL(tableChanged(QString)), this, SLOT(tableChanged(QString)));
+}
+
+void Database::Private::tableChanged(const QString &tableName)
+{
+    Database::invalidateResults(q->connectionName(), tableName);
+    snapshot(tableName);
+}
+
+void Database::Private::writeEnded(const QString &tableName)
+{
+    // the counter first, a poll may run right after the decrement
+    snapshot(tableName);
+    writes.deref();
+}
+
+void Database::Private::snapshot(const QString &tableName)
+{
+    // our own write, the next poll must not report it
+    if (!pollTimer) return;
+    snapshots.insert(tableName.toLower());
+    if (!snapshotTimer) {
+        snapshotTimer = new QTimer(this);
+        snapshotTimer->setSingleShot(true);
+        snapshotTimer->setInterval(0);
+        connect(snapshotTimer, SIGNAL(timeout()), this, SLOT(takeSnapshots()));
+    }
+    if (!snapshotTimer->isActive())
+        snapshotTimer->start();
+}
+
+// one read for a burst of writes
+void Database::Private::takeSnapshots()
+{
+    if (snapshots.isEmpty()) return;
+    QHash<QString, qint64> current = readCounters(QSqlDatabase::database(q->m_connectionName));
+    foreach (const QString &table, current.keys()) {
+        if (snapshots.contains(table.toLower()))
+            counters.insert(table, current.value(table));
+    }
+    snapshots.clear();
+}
+
+static qint64 pragma(QSqlDatabase db, const QString &name)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QString("PRAGMA %1").arg(name)) || !query.next()) {
+        qCWarning(lcDatabase) << name << query.lastError().text();
+        return -1;
+    }
+    return query.value(0).toLongLong();
+}
+
+static QString identifier(const QString &name)
+{
+    return QString("\"%1\"").arg(QString(name).replace(QLatin1Char('"'), QLatin1String("\"\"")));
+}
+
+static QString literal(const QString &value)
+{
+    return QString("'%1'").arg(QString(value).replace(QLatin1Char('\''), QLatin1String("''")));
+}
+
+static QString triggerName(const QString &tableName, const QString &event)
+{
+    return identifier(QString("__changes_%1_%2").arg(tableName, event));
+}
+
+void Database::Private::watch(QSqlDatabase db)
+{
+    if (db.driverName() != QLatin1String("QSQLITE")) {
+        qCWarning(lcDatabase) << "pollInterval is ignored for" << db.driverName();
+        return;
+    }
+    installTriggers(db);
+    schemaVersion = pragma(db, QStringLiteral("schema_version"));
+    dataVersion = pragma(db, QStringLiteral("data_version"));
+    counters = readCounters(db);
+
+    pollTimer = new QTimer(this);
+    connect(pollTimer, SIGNAL(timeout()), this, SLOT(poll()));
+    pollTimer->start(q->m_pollInterval);
+}
+
+void Database::Private::installTriggers(QSqlDatabase db)
+{
+    QSqlQuery query(db);
+    QString sql = QStringLiteral("CREATE TABLE IF NOT EXISTS __database_changes (tableName TEXT PRIMARY KEY, counter INTEGER NOT NULL)");
+    if (!query.exec(sql)) {
+        qCWarning(lcDatabase) << sql << query.lastError().text();
+        return;
+    }
+    bool all = observed.contains(QStringLiteral("*"));
+    foreach (const QString &table, db.tables()) {
+        // internal tables are written along with the ones they belong to
+        if (table.startsWith(QLatin1String("sqlite_")) || table.contains(QLatin1String("__"))) continue;
+        if (!all && !observed.contains(table.toLower())) continue;
+        foreach (const QString &event, QStringList() << "INSERT" << "UPDATE" << "DELETE") {
+            sql = QString("CREATE TRIGGER IF NOT EXISTS %1 AFTER %2 ON %3 BEGIN "
+                          "INSERT OR REPLACE INTO __database_changes (tableName, counter) "
+                          "VALUES (%4, COALESCE((SELECT counter FROM __database_changes WHERE tableName = %4), 0) + 1); "
+                          "END").arg(triggerName(table, event), event, identifier(table), literal(table));
+            if (!query.exec(sql))
+                qCWarning(lcDatabase) << sql << query.lastError().text();
+        }
+    }
+}
+
+void Database::Private::dropTriggers(QSqlDatabase db, const QString &tableName)
+{
+    QSqlQuery query(db);
+    foreach (const QString &event, QStringList() << "INSERT" << "UPDATE" << "DELETE") {
+        QString sql = QString("DROP TRIGGER IF EXISTS %1").arg(triggerName(tableName, event));
+        if (!query.exec(sql))
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+    }
+    counters.remove(tableName);
+}
+
+QHash<QString, qint64> Database::Private::readCounters(QSqlDatabase db, const QString &tableName) const
+{
+    QHash<QString, qint64> ret;
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    QString sql = QStringLiteral("SELECT tableName, counter FROM __database_changes");
+    if (!tableName.isEmpty())
+        sql += QStringLiteral(" WHERE tableName = ?");
+    query.prepare(sql);
+    if (!tableName.isEmpty())
+        query.addBindValue(tableName);
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << sql << query.lastError().text();
+        return ret;
+    }
+    while (query.next()) {
+        ret.insert(query.value(0).toString(), query.value(1).toLongLong());
+    }
+    return ret;
+}
+
+// two pragmas while nothing happens, the counters are read after a commit only
+void Database::Private::poll()
 {
+    // the writes of ours since the last pass are not news
+    takeSnapshots();
+
+    QSqlDatabase db = QSqlDatabase::database(q->m_connectionName);
+    qint64 schema = pragma(db, QStringLiteral("schema_version"));
+    if (schema != schemaVersion) {
+        // a table was created, here or elsewhere
+        installTriggers(db);
+        schemaVersion = pragma(db, QStringLiteral("schema_version"));
+    }
+
+    // a worker of ours commits, look again once it is done
+    if (writes.load() > 0) return;
+
+    // changes only for commits of other connections
+    qint64 version = pragma(db, QStringLiteral("data_version"));
+    if (version == dataVersion) return;
+    dataVersion = version;
+
+    QStringList changed;
+    QHash<QString, qint64> current = readCounters(db);
+    foreach (const QString &table, current.keys()) {
+        if (current.value(table) != counters.value(table, 0))
+            changed.append(table);
+    }
+    counters = current;
+    if (changed.isEmpty()) return;
+
+    foreach (const QString &table, changed) {
+        Database::invalidateResults(q->connectionName(), table);
+    }
+    emit q->externalChanged(changed);
+}
+
+void Database::Private::configure(QSqlDatabase db) const
+{
+    QStringList pragmas;
+    if (!q->m_journalMode.isEmpty())
+        pragmas.append(QString("journal_mode = %1").arg(q->m_journalMode));
+    if (!q->m_synchronous.isEmpty())
+        pragmas.append(QString("synchronous = %1").arg(q->m_synchronous));
+    if (q->m_cacheSize != 0)
+        pragmas.append(QString("cache_size = %1").arg(q->m_cacheSize));
+    if (q->m_mmapSize > 0)
+        pragmas.append(QString("mmap_size = %1").arg(q->m_mmapSize));
+    if (!q->m_tempStore.isEmpty())
+        pragmas.append(QString("temp_store = %1").arg(q->m_tempStore));
+    if (q->m_busyTimeout > 0)
+        pragmas.append(QString("busy_timeout = %1").arg(q->m_busyTimeout));
+    if (pragmas.isEmpty()) return;
+
+    if (db.driverName() != QLatin1String("QSQLITE")) {
+        qCWarning(lcDatabase) << "SQLite settings are ignored for" << db.driverName();
+        return;
+    }
+
+    QSqlQuery query(db);
+    foreach (const QString &pragma, pragmas) {
+        if (!query.exec(QString("PRAGMA %1").arg(pragma))) {
+            qCWarning(lcDatabase) << pragma << query.lastError().text();
+        }
+    }
 }
 
 Database::Database(QObject *parent)
     : QObject(parent)
     , m_hostName("localhost")
+    , m_cacheSize(0)
+    , m_mmapSize(0)
+    , m_busyTimeout(0)
+    , m_native(false)
+    , m_advisor(false)
+    , m_autoIndex(false)
+    , m_pollInterval(0)
     , d(new Private(this))
 {
 }
 
+Database::~Database()
+{
+    // workers read our properties, stop them while those are still alive
+    delete d->pool;
+    d->pool = 0;
+}
+
 QQmlListProperty<QObject> Database::contents()
 {
     return QQmlListProperty<QObject>(this, d->contents);
@@ -84,9 +385,15 @@ bool Database::open()
             db.setPassword(m_password);
             db.setConnectOptions(m_connectOptions);
             if (db.open()) {
+                d->configure(db);
+                for (int i = 0; i < m_shards.count(); i++) {
+                    shard(db, i);
+                }
+                if (m_pollInterval > 0)
+                    d->watch(db);
                 open(true);
             } else {
-                qDebug() << Q_FUNC_INFO << __LINE__ << db.lastError().text();
+                qCWarning(lcDatabase) << db.lastError().text();
             }
         } else {
             open(QSqlDatabase::database(m_connectionName).isOpen());
@@ -125,4 +432,557 @@ bool Database::rollback()
     return db.rollback();
 }
 
+int Database::slowQueryThreshold() const
+{
+    return Tracing::slowQueryThreshold();
+}
+
+void Database::slowQueryThreshold(int slowQueryThreshold)
+{
+    // process-wide, like the logging categories it reports to
+    if (Tracing::slowQueryThreshold() == slowQueryThreshold) return;
+    Tracing::setSlowQueryThreshold(slowQueryThreshold);
+    emit slowQueryThresholdChanged(slowQueryThreshold);
+}
+
+bool Database::dumpTrace(const QString &path) const
+{
+    QUrl url(path);
+    return Tracing::dump(url.isLocalFile() ? url.toLocalFile() : path);
+}
+
+QSqlDatabase Database::clone(const QString &connectionName) const
+{
+    if (QSqlDatabase::contains(connectionName))
+        return QSqlDatabase::database(connectionName);
+
+    // set up from our properties, the original connection belongs to another thread
+    QSqlDatabase db = QSqlDatabase::addDatabase(m_type, connectionName);
+    db.setHostName(m_hostName);
+    db.setDatabaseName(m_databaseName);
+    db.setUserName(m_userName);
+    db.setPassword(m_password);
+    db.setConnectOptions(m_connectOptions);
+    if (db.open()) {
+        d->configure(db);
+    } else {
+        qCWarning(lcDatabase) << db.lastError().text();
+    }
+    return db;
+}
+
+Database::Result Database::execute(QSqlDatabase db, const QString &sql, const QVariantList &params, bool native)
+{
+    Result ret;
+
+    if (native && SqliteEngine::isAvailable(db)) {
+        QTime time;
+        time.start();
+        QStringList columns;
+        if (!SqliteEngine::select(db, sql, params, QHash<int, QVariant::Type>(), &columns, &ret.rows, &ret.error))
+            return ret;
+        for (int i = 0; i < columns.count(); i++) {
+            ret.roleNames.insert(Qt::UserRole + i, columns.at(i).toUtf8());
+        }
+        ret.timer = time.elapsed();
+        ret.ok = true;
+        return ret;
+    }
+
+    qint64 start = Tracing::now();
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    query.prepare(sql);
+    foreach (const QVariant &param, params) {
+        query.addBindValue(param);
+    }
+    qint64 prepared = Tracing::now();
+    if (Tracing::isEnabled())
+        Tracing::record("sql", "prepare", start, prepared, sql);
+
+    QTime time;
+    time.start();
+    if (!query.exec()) {
+        ret.error = query.lastError().text();
+        return ret;
+    }
+    qint64 executed = Tracing::now();
+    if (Tracing::isEnabled())
+        Tracing::record("sql", "exec", prepared, executed, sql);
+
+    QSqlRecord record = query.record();
+    for (int i = 0; i < record.count(); i++) {
+        ret.roleNames.insert(Qt::UserRole + i, record.fieldName(i).toUtf8());
+    }
+
+    while (query.next()) {
+        QVariantList row;
+        for (int i = 0; i < record.count(); i++) {
+            row.append(query.value(i));
+        }
+        ret.rows.append(row);
+    }
+    query.finish();
+    qint64 fetched = Tracing::now();
+    if (Tracing::isEnabled())
+        Tracing::record("sql", "fetch", executed, fetched, QString("%1 rows").arg(ret.rows.count()));
+    Tracing::query(sql, params, prepared - start, executed - prepared, fetched - executed);
+
+    ret.timer = time.elapsed();
+    ret.ok = true;
+    return ret;
+}
+
+QSqlDatabase Database::shard(const QSqlDatabase &base, int index) const
+{
+    QString connectionName = QString("%1/shard%2").arg(base.connectionName()).arg(index);
+    if (QSqlDatabase::contains(connectionName))
+        return QSqlDatabase::database(connectionName);
+
+    QSqlDatabase db = QSqlDatabase::addDatabase(m_type, connectionName);
+    db.setDatabaseName(m_shards.at(index));
+    db.setConnectOptions(m_connectOptions);
+    if (db.open()) {
+        d->configure(db);
+    } else {
+        qCWarning(lcDatabase) << m_shards.at(index) << db.lastError().text();
+    }
+    return db;
+}
+
+QList<Database::Result> Database::fanOut(const QSqlDatabase &base, const QString &sql, const QVariantList &params) const
+{
+    TraceScope trace("sql", "Database::fanOut");
+    int count = m_shards.count();
+    QVector<Result> results(count);
+    Result *out = results.data();
+    bool native = m_native;
+
+    // the caller runs one shard itself and takes back the tasks no worker has
+    // started yet, so waiting from inside a worker can not starve the pool
+    WorkerPool *pool = this->pool();
+    QSemaphore done;
+    QList<quint64> tasks;
+    // the shards run here: the first one, all of them when the pool runs tasks
+    // inline and the ones the pool no longer accepts
+    QList<int> own;
+    own.append(0);
+    for (int i = 1; i < count; i++) {
+        quint64 id = 0;
+        if (pool->maxThreadCount() > 0) {
+            id = pool->submit([this, i, out, &done, sql, params, native](QSqlDatabase db) {
+                out[i] = execute(shard(db, i), sql, params, native);
+                done.release();
+            }, 0, [i, out, &done]() {
+                out[i].error = QStringLiteral("cancelled");
+                done.release();
+            });
+        }
+        if (id > 0)
+            tasks.append(id);
+        else
+            own.append(i);
+    }
+    foreach (int i, own) {
+        out[i] = execute(shard(base, i), sql, params, native);
+    }
+    foreach (quint64 id, tasks) {
+        WorkerPool::Task task;
+        if (pool->take(id, &task))
+            task(base);
+    }
+    // every submitted task releases once, run, taken back or dropped
+    done.acquire(tasks.count());
+    return results.toList();
+}
+
+WorkerPool *Database::pool() const
+{
+    if (!d->pool)
+        d->pool = new WorkerPool(const_cast<Database *>(this));
+    return d->pool;
+}
+
+bool Database::canClone() const
+{
+    if (m_type != QLatin1String("QSQLITE")) return true;
+    if (m_databaseName.isEmpty() || m_databaseName == QLatin1String(":memory:")) return false;
+    if (m_databaseName.startsWith(QLatin1String("file::memory:"))) return false;
+    return true;
+}
+
+// on any connection, the advisor explains on a worker
+static QVariantList explainQuery(QSqlDatabase db, const QString &query, const QVariantList &params, bool analyze)
+{
+    QVariantList ret;
+    QString type = db.driverName();
+    QString sql;
+    if (type == QLatin1String("QSQLITE"))
+        sql = QString("EXPLAIN QUERY PLAN %1").arg(query);
+    else if (type == QLatin1String("QPSQL"))
+        sql = QString(analyze ? "EXPLAIN (ANALYZE, FORMAT JSON) %1" : "EXPLAIN (FORMAT JSON) %1").arg(query);
+    else
+        sql = QString(analyze ? "EXPLAIN ANALYZE %1" : "EXPLAIN %1").arg(query);
+
+    QSqlQuery q(db);
+    q.prepare(sql);
+    foreach (const QVariant &param, params) {
+        q.addBindValue(param);
+    }
+    if (!q.exec()) {
+        qCWarning(lcDatabase) << sql << q.lastError().text();
+        return ret;
+    }
+
+    if (type == QLatin1String("QPSQL")) {
+        // a single row with the plan tree as json
+        if (q.next())
+            ret = QJsonDocument::fromJson(q.value(0).toByteArray()).toVariant().toList();
+        return ret;
+    }
+
+    static const QRegularExpression scan(QStringLiteral("^SCAN (?:TABLE )?([A-Za-z_][A-Za-z0-9_]*)"));
+    QSqlRecord record = q.record();
+    while (q.next()) {
+        QVariantMap row;
+        for (int i = 0; i < record.count(); i++) {
+            row.insert(record.fieldName(i), q.value(i));
+        }
+        if (type == QLatin1String("QSQLITE")) {
+            QString detail = row.value(QStringLiteral("detail")).toString();
+            QRegularExpressionMatch match = scan.match(detail);
+            // a full table scan, not one of a covering index
+            bool fullScan = match.hasMatch() && !detail.contains(QLatin1String(" USING "));
+            row.insert(QStringLiteral("fullScan"), fullScan);
+            if (fullScan)
+                row.insert(QStringLiteral("table"), match.captured(1));
+            row.insert(QStringLiteral("tempBTree"), detail.contains(QLatin1String("TEMP B-TREE")));
+        }
+        ret.append(row);
+    }
+    return ret;
+}
+
+QVariantList Database::explain(const QString &query, const QVariantList &params, bool analyze) const
+{
+    if (!d->open) return QVariantList();
+    return explainQuery(QSqlDatabase::database(m_connectionName, false), query, params, analyze);
+}
+
+QVariantList Database::suggestions() const
+{
+    return d->suggestions;
+}
+
+// columns compared in WHERE, then those of ORDER BY, as far as they belong to table
+static QStringList indexColumns(const QString &query, const QSqlRecord &table)
+{
+    static const QRegularExpression where(QStringLiteral("\\bWHERE\\b(.*?)(?:\\bGROUP\\s+BY\\b|\\bORDER\\s+BY\\b|\\bLIMIT\\b|$)"), QRegularExpression::CaseInsensitiveOption | QRegularExpression::DotMatchesEverythingOption);
+    static const QRegularExpression order(QStringLiteral("\\bORDER\\s+BY\\b(.*?)(?:\\bLIMIT\\b|$)"), QRegularExpression::CaseInsensitiveOption | QRegularExpression::DotMatchesEverythingOption);
+    static const QRegularExpression compared(QStringLiteral("([A-Za-z_][A-Za-z0-9_.]*)\\s*(?:=|<|>|!=|\\bIN\\b|\\bLIKE\\b|\\bIS\\b|\\bBETWEEN\\b)"), QRegularExpression::CaseInsensitiveOption);
+
+    QStringList ret;
+    QRegularExpressionMatchIterator i = compared.globalMatch(where.match(query).captured(1));
+    while (i.hasNext()) {
+        QString column = i.next().captured(1).section(QLatin1Char('.'), -1);
+        if (table.contains(column) && !ret.contains(column))
+            ret.append(column);
+    }
+    foreach (const QString &term, order.match(query).captured(1).split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        QString column = term.simplified().section(QLatin1Char(' '), 0, 0).section(QLatin1Char('.'), -1);
+        if (table.contains(column) && !ret.contains(column))
+            ret.append(column);
+    }
+    return ret;
+}
+
+void Database::observe(const QStringList &tableNames)
+{
+    QStringList added;
+    foreach (const QString &tableName, tableNames) {
+        if (tableName.isEmpty()) continue;
+        if (d->observed[tableName.toLower()]++ == 0)
+            added.append(tableName.toLower());
+    }
+    if (added.isEmpty() || !d->pollTimer) return;
+
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName);
+    d->installTriggers(db);
+    // another process may have counted them already
+    foreach (const QString &table, db.tables()) {
+        if (added.contains(table.toLower()))
+            d->snapshot(table);
+    }
+}
+
+void Database::unobserve(const QStringList &tableNames)
+{
+    QStringList removed;
+    foreach (const QString &tableName, tableNames) {
+        if (tableName.isEmpty()) continue;
+        QString name = tableName.toLower();
+        if (--d->observed[name] <= 0) {
+            d->observed.remove(name);
+            removed.append(name);
+        }
+    }
+    if (removed.isEmpty() || !d->pollTimer) return;
+
+    // another process observing them puts them back on its next poll, see installTriggers()
+    if (d->observed.contains(QStringLiteral("*"))) return;
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName);
+    bool all = removed.contains(QStringLiteral("*"));
+    foreach (const QString &table, db.tables()) {
+        if (table.startsWith(QLatin1String("sqlite_")) || table.contains(QLatin1String("__"))) continue;
+        QString name = table.toLower();
+        if (d->observed.contains(name)) continue;
+        if (all || removed.contains(name))
+            d->dropTriggers(db, table);
+    }
+}
+
+void Database::beginWrite() const
+{
+    d->writes.ref();
+}
+
+void Database::endWrite(const QString &tableName) const
+{
+    QMetaObject::invokeMethod(d, "writeEnded", Qt::QueuedConnection, Q_ARG(QString, tableName));
+}
+
+void Database::advise(const QString &query, const QVariantList &params)
+{
+    if (!m_advisor || !d->open) return;
+    if (d->advised.contains(query)) return;
+    d->advised.insert(query);
+
+    // EXPLAIN waits for locks and plans like the query itself, not on the GUI thread
+    Private *self = d;
+    pool()->submit([self, query, params](QSqlDatabase db) {
+        TraceScope trace("sql", "Database::advise");
+        QStringList tables = tablesIn(query);
+        QVariantList suggestions;
+        foreach (const QVariant &step, explainQuery(db, query, params, false)) {
+            QVariantMap row = step.toMap();
+            QString table = row.value(QStringLiteral("table")).toString();
+            bool tempBTree = row.value(QStringLiteral("tempBTree")).toBool();
+            if (table.isEmpty() && tempBTree && tables.count() == 1)
+                table = tables.first();
+            if (table.isEmpty()) continue;
+
+            QStringList columns = indexColumns(query, db.record(table));
+            if (columns.isEmpty()) continue;
+
+            QString name = QString("idx_%1_%2").arg(table).arg(columns.join(QLatin1String("_")));
+            QVariantMap suggestion;
+            suggestion.insert(QStringLiteral("query"), query);
+            suggestion.insert(QStringLiteral("table"), table);
+            suggestion.insert(QStringLiteral("columns"), columns);
+            suggestion.insert(QStringLiteral("reason"), row.value(QStringLiteral("detail")));
+            suggestion.insert(QStringLiteral("sql"), QString("CREATE INDEX IF NOT EXISTS %1 ON %2(%3)").arg(name).arg(table).arg(columns.join(QLatin1String(", "))));
+            suggestions.append(suggestion);
+        }
+        if (suggestions.isEmpty()) return;
+        QMetaObject::invokeMethod(self, "suggest", Qt::QueuedConnection, Q_ARG(QVariantList, suggestions));
+    }, -1);
+}
+
+void Database::Private::suggest(const QVariantList &list)
+{
+    bool changed = false;
+    foreach (const QVariant &item, list) {
+        QVariantMap suggestion = item.toMap();
+        QString sql = suggestion.value(QStringLiteral("sql")).toString();
+        bool known = false;
+        foreach (const QVariant &v, suggestions) {
+            known = known || v.toMap().value(QStringLiteral("sql")) == sql;
+        }
+        if (known) continue;
+
+        qCWarning(lcDatabase) << "index suggested:" << sql << "for" << suggestion.value(QStringLiteral("query")).toString();
+        suggestion.insert(QStringLiteral("created"), false);
+        suggestions.append(suggestion);
+        changed = true;
+        if (q->m_autoIndex) {
+            // built on the pool like those of TableModel::indexes
+            int index = suggestions.count() - 1;
+            // the pool is stopped before we are deleted
+            Private *self = this;
+            q->pool()->submit([self, sql, index](QSqlDatabase db) {
+                QSqlQuery create(db);
+                if (create.exec(sql))
+                    QMetaObject::invokeMethod(self, "indexCreated", Qt::QueuedConnection, Q_ARG(int, index));
+                else
+                    qCWarning(lcDatabase) << sql << create.lastError().text();
+            }, -1);
+        }
+    }
+    if (changed)
+        emit q->suggestionsChanged();
+}
+
+void Database::Private::indexCreated(int index)
+{
+    QVariantMap suggestion = suggestions.value(index).toMap();
+    suggestion.insert(QStringLiteral("created"), true);
+    suggestions[index] = suggestion;
+    emit q->suggestionsChanged();
+}
+
+QVariantMap Database::statistics() const
+{
+    QVariantMap ret;
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    if (!d->open || db.driverName() != QLatin1String("QSQLITE")) return ret;
+
+    if (const SqliteApi *api = SqliteApi::get(db)) {
+        sqlite3 *handle = sqliteHandle(db);
+        int current = 0;
+        int highwater = 0;
+        if (api->db_status(handle, SqliteApi::CacheHit, &current, &highwater, 0) == SqliteApi::Ok)
+            ret.insert(QStringLiteral("cacheHit"), current);
+        if (api->db_status(handle, SqliteApi::CacheMiss, &current, &highwater, 0) == SqliteApi::Ok)
+            ret.insert(QStringLiteral("cacheMiss"), current);
+        if (api->db_status(handle, SqliteApi::CacheUsed, &current, &highwater, 0) == SqliteApi::Ok)
+            ret.insert(QStringLiteral("cacheUsed"), current);
+    }
+
+    QSqlQuery query(db);
+    if (query.exec(QStringLiteral("PRAGMA journal_mode")) && query.next())
+        ret.insert(QStringLiteral("journalMode"), query.value(0));
+    if (query.exec(QStringLiteral("PRAGMA page_count")) && query.next())
+        ret.insert(QStringLiteral("pageCount"), query.value(0));
+    if (query.exec(QStringLiteral("PRAGMA page_size")) && query.next())
+        ret.insert(QStringLiteral("pageSize"), query.value(0));
+
+    QFileInfo wal(m_databaseName + QStringLiteral("-wal"));
+    ret.insert(QStringLiteral("walSize"), wal.exists() ? wal.size() : 0);
+    return ret;
+}
+
+Database::Result Database::sharedResult(const QString &connectionName, const QString &query, const QVariantList &params, const std::function<Result()> &exec, quint64 *ticket,
+                                        const Joined &joined, bool *pending)
+{
+    if (pending)
+        *pending = false;
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << connectionName << query.simplified() << params;
+
+    QMutexLocker locker(&sharedMutex);
+    SharedEntry *entry = sharedEntries.value(sharedIndex.value(key));
+    if (entry && !entry->running && !entry->result.ok) {
+        // do not share failures, let this caller try again
+        sharedIndex.remove(key);
+        entry = 0;
+    }
+
+    if (entry) {
+        entry->ref++;
+        *ticket = sharedIndex.value(key);
+        if (entry->running && joined && pending) {
+            entry->joined.append(qMakePair(*ticket, joined));
+            *pending = true;
+            return Result();
+        }
+        // an identical query is in flight, wait for it instead of running it twice
+        while (entry->running) {
+            sharedDone.wait(&sharedMutex);
+        }
+        return entry->result;
+    }
+
+    entry = new SharedEntry;
+    entry->connectionName = connectionName;
+    entry->key = key;
+    entry->tables = tablesIn(query);
+    entry->ref = 1;
+    *ticket = ++sharedSerial;
+    sharedEntries.insert(*ticket, entry);
+    sharedIndex.insert(key, *ticket);
+
+    locker.unlock();
+    Result result = exec();
+    locker.relock();
+
+    entry->result = result;
+    entry->running = false;
+    QList<QPair<quint64, Joined> > callbacks = entry->joined;
+    entry->joined.clear();
+    sharedDone.wakeAll();
+    locker.unlock();
+
+    typedef QPair<quint64, Joined> Callback;
+    foreach (const Callback &callback, callbacks) {
+        callback.second(callback.first, result);
+    }
+    return result;
+}
+
+void Database::releaseResult(quint64 ticket)
+{
+    QMutexLocker locker(&sharedMutex);
+    SharedEntry *entry = sharedEntries.value(ticket);
+    if (!entry) return;
+    if (--entry->ref > 0) return;
+
+    sharedEntries.remove(ticket);
+    if (sharedIndex.value(entry->key) == ticket)
+        sharedIndex.remove(entry->key);
+    delete entry;
+}
+
+bool Database::abandonResult(quint64 ticket)
+{
+    QMutexLocker locker(&sharedMutex);
+    SharedEntry *entry = sharedEntries.value(ticket);
+    if (!entry || !entry->running) return true;
+    if (entry->ref > 1) return false;
+    if (sharedIndex.value(entry->key) == ticket)
+        sharedIndex.remove(entry->key);
+    return true;
+}
+
+void Database::invalidateResults(const QString &connectionName, const QString &tableName)
+{
+    QMutexLocker locker(&sharedMutex);
+    QString table = tableName.toLower();
+    foreach (quint64 ticket, sharedIndex.values()) {
+        SharedEntry *entry = sharedEntries.value(ticket);
+        if (entry->connectionName != connectionName) continue;
+        // entries we could not parse read "any" table
+        if (entry->tables.isEmpty() || entry->tables.contains(table)) {
+            // holders keep their copy until they select again
+            sharedIndex.remove(entry->key);
+        }
+    }
+}
+
+QStringList Database::tablesIn(const QString &query)
+{
+    static const QRegularExpression re(QStringLiteral("\\b(?:FROM|JOIN)\\s+([A-Za-z_][A-Za-z0-9_.]*)((?:\\s*,\\s*[A-Za-z_][A-Za-z0-9_.]*(?:\\s+[A-Za-z_][A-Za-z0-9_]*)?)*)"), QRegularExpression::CaseInsensitiveOption);
+    static const QRegularExpression name(QStringLiteral("[A-Za-z_][A-Za-z0-9_.]*"));
+
+    QSet<QString> ret;
+    QRegularExpressionMatchIterator i = re.globalMatch(query);
+    while (i.hasNext()) {
+        QRegularExpressionMatch match = i.next();
+        QStringList names;
+        names.append(match.captured(1));
+        // "FROM a, b x, c" - the first word of each comma separated item
+        foreach (const QString &item, match.captured(2).split(QLatin1Char(','), QString::SkipEmptyParts)) {
+            QRegularExpressionMatch m = name.match(item);
+            if (m.hasMatch())
+                names.append(m.captured(0));
+        }
+        foreach (QString table, names) {
+            table = table.section(QLatin1Char('.'), -1).toLower();
+            ret.insert(table);
+        }
+    }
+    return ret.toList();
+}
+
 #include "database.moc"
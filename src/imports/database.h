@@ -29,9 +29,17 @@
 
 #include <QtCore/QObject>
 #include <QtCore/QDebug>
+#include <QtCore/QStringList>
+#include <QtCore/QVariant>
+
+#include <functional>
 
 #include <QtQml/QQmlListProperty>
 
+#include <QtSql/QSqlDatabase>
+
+class WorkerPool;
+
 class Database : public QObject
 {
     Q_OBJECT
@@ -47,19 +55,98 @@ class Database : public QObject
     Q_PROPERTY(QString password READ password WRITE password NOTIFY passwordChanged)
     Q_PROPERTY(QString connectOptions READ connectOptions WRITE connectOptions NOTIFY connectOptionsChanged)
 
+    // applied with PRAGMA on every connection opened for QSQLITE, empty or 0 keeps the driver default
+    Q_PROPERTY(QString journalMode READ journalMode WRITE journalMode NOTIFY journalModeChanged)
+    Q_PROPERTY(QString synchronous READ synchronous WRITE synchronous NOTIFY synchronousChanged)
+    Q_PROPERTY(int cacheSize READ cacheSize WRITE cacheSize NOTIFY cacheSizeChanged)
+    Q_PROPERTY(qint64 mmapSize READ mmapSize WRITE mmapSize NOTIFY mmapSizeChanged)
+    Q_PROPERTY(QString tempStore READ tempStore WRITE tempStore NOTIFY tempStoreChanged)
+    Q_PROPERTY(int busyTimeout READ busyTimeout WRITE busyTimeout NOTIFY busyTimeoutChanged)
+    // SELECTs of the models step sqlite3_stmt directly instead of going through QSqlQuery
+    Q_PROPERTY(bool native READ native WRITE native NOTIFY nativeChanged)
+    // SQLite files with the same schema, the models read from all of them
+    Q_PROPERTY(QStringList shards READ shards WRITE shards NOTIFY shardsChanged)
+    // checks the plan of every new query the models run and suggests indexes
+    Q_PROPERTY(bool advisor READ advisor WRITE advisor NOTIFY advisorChanged)
+    // creates the suggested indexes right away
+    Q_PROPERTY(bool autoIndex READ autoIndex WRITE autoIndex NOTIFY autoIndexChanged)
+    // msecs between checks for commits of other processes to the SQLite file, 0 for none.
+    // installs triggers counting the writes to the observed tables, see observe()
+    Q_PROPERTY(int pollInterval READ pollInterval WRITE pollInterval NOTIFY pollIntervalChanged)
+
     Q_PROPERTY(bool open READ isOpen NOTIFY openChanged)
+    Q_PROPERTY(int slowQueryThreshold READ slowQueryThreshold WRITE slowQueryThreshold NOTIFY slowQueryThresholdChanged)
 public:
     explicit Database(QObject *parent = 0);
+    ~Database();
 
     QQmlListProperty<QObject> contents();
 
     Q_INVOKABLE bool transaction();
     Q_INVOKABLE bool commit();
     Q_INVOKABLE bool rollback();
+    Q_INVOKABLE QVariantMap statistics() const;
+    Q_INVOKABLE bool dumpTrace(const QString &path) const;
+    // EXPLAIN QUERY PLAN (QSQLITE), EXPLAIN (FORMAT JSON) (QPSQL) or EXPLAIN rows as maps;
+    // analyze runs the query to report real costs where the server supports it
+    Q_INVOKABLE QVariantList explain(const QString &query, const QVariantList &params = QVariantList(), bool analyze = false) const;
+    Q_INVOKABLE QVariantList suggestions() const;
+
+    // called by the models with the queries they run when advisor is set,
+    // the plan is looked at on the pool
+    void advise(const QString &query, const QVariantList &params);
+    // tables the models read, pollInterval counts the writes to these only,
+    // "*" for every table. the triggers counting them stay in the file, other
+    // processes watching it rely on them as well
+    void observe(const QStringList &tableNames);
+    void unobserve(const QStringList &tableNames);
+    // bracket writes on pool connections from any thread, polls wait for them
+    // to end and do not take them for commits of other processes
+    void beginWrite() const;
+    void endWrite(const QString &tableName) const;
+
+    int slowQueryThreshold() const;
+    void slowQueryThreshold(int slowQueryThreshold);
 
     bool open();
     bool isOpen() const;
 
+    struct Result {
+        Result() : ok(false), timer(0) {}
+        bool ok;
+        int timer;
+        QString error;
+        QHash<int, QByteArray> roleNames;
+        QList<QVariantList> rows;
+    };
+
+    // called on the thread that finished the shared query a caller joined
+    typedef std::function<void(quint64 ticket, const Result &result)> Joined;
+    // process-wide cache of query results shared by identical SqlModels. with
+    // joined, a caller that must not block gets *pending instead of waiting
+    // for an identical query in flight, joined gets the result later
+    static Result sharedResult(const QString &connectionName, const QString &query, const QVariantList &params, const std::function<Result()> &exec, quint64 *ticket,
+                               const Joined &joined = Joined(), bool *pending = 0);
+    static void releaseResult(quint64 ticket);
+    // before interrupting the running query of ticket: false while other callers
+    // wait for it too, otherwise no new caller joins and it may be interrupted
+    static bool abandonResult(quint64 ticket);
+    static void invalidateResults(const QString &connectionName, const QString &tableName);
+    static QStringList tablesIn(const QString &query);
+    // runs a SELECT, through SqliteEngine when native is set and possible
+    static Result execute(QSqlDatabase db, const QString &sql, const QVariantList &params, bool native = false);
+
+    // opens a configured copy of this connection for the calling thread
+    QSqlDatabase clone(const QString &connectionName) const;
+    // false when a copy would not see the same data, e.g. SQLite :memory:
+    bool canClone() const;
+    // worker threads with pooled connections shared by the async models
+    WorkerPool *pool() const;
+    // the connection to shards[index] for the thread and connection of base
+    QSqlDatabase shard(const QSqlDatabase &base, int index) const;
+    // runs sql on every shard in parallel, the results are in shards order
+    QList<Result> fanOut(const QSqlDatabase &base, const QString &sql, const QVariantList &params) const;
+
 public slots:
     void open(bool open);
 
@@ -71,8 +158,26 @@ signals:
     void userNameChanged(const QString &userName);
     void passwordChanged(const QString &password);
     void connectOptionsChanged(const QString &connectOptions);
+    void journalModeChanged(const QString &journalMode);
+    void synchronousChanged(const QString &synchronous);
+    void cacheSizeChanged(int cacheSize);
+    void mmapSizeChanged(qint64 mmapSize);
+    void tempStoreChanged(const QString &tempStore);
+    void busyTimeoutChanged(int busyTimeout);
+    void nativeChanged(bool native);
+    void shardsChanged(const QStringList &shards);
+    void advisorChanged(bool advisor);
+    void autoIndexChanged(bool autoIndex);
+    void pollIntervalChanged(int pollInterval);
+    void suggestionsChanged();
+    void indexReady(const QString &tableName, const QString &name, int msecs);
+    void backfillFinished(const QString &tableName, const QString &column, int rows);
     void openChanged(bool open);
     void transactionChanged(bool transaction);
+    void tableChanged(const QString &tableName);
+    // tables written by another process or connection, see pollInterval
+    void externalChanged(const QStringList &tableNames);
+    void slowQueryThresholdChanged(int slowQueryThreshold);
 
 private:
 #define ADD_PROPERTY(type, name, type2) \
@@ -97,6 +202,17 @@ private: \
     ADD_PROPERTY(const QString &, userName, QString)
     ADD_PROPERTY(const QString &, password, QString)
     ADD_PROPERTY(const QString &, connectOptions, QString)
+    ADD_PROPERTY(const QString &, journalMode, QString)
+    ADD_PROPERTY(const QString &, synchronous, QString)
+    ADD_PROPERTY(int, cacheSize, int)
+    ADD_PROPERTY(qint64, mmapSize, qint64)
+    ADD_PROPERTY(const QString &, tempStore, QString)
+    ADD_PROPERTY(int, busyTimeout, int)
+    ADD_PROPERTY(bool, native, bool)
+    ADD_PROPERTY(const QStringList &, shards, QStringList)
+    ADD_PROPERTY(bool, advisor, bool)
+    ADD_PROPERTY(bool, autoIndex, bool)
+    ADD_PROPERTY(int, pollInterval, int)
 #undef ADD_PROPERTY
 
     class Private;
@@ -10,12 +10,35 @@ HEADERS += \
     database.h \
     tablemodel.h \
     sqlmodel.h \
+    aggregatemodel.h \
+    treemodel.h \
+    blob.h \
+    sqlitehandle.h \
+    sqliteengine.h \
+    tracing.h \
+    workerpool.h \
     plugin.h
 
 SOURCES += \
     database.cpp \
     tablemodel.cpp \
-    sqlmodel.cpp
+    sqlmodel.cpp \
+    aggregatemodel.cpp \
+    treemodel.cpp \
+    blob.cpp \
+    sqlitehandle.cpp \
+    sqliteengine.cpp \
+    tracing.cpp \
+    workerpool.cpp
+
+# the sqlite3 functions of the QSQLITE driver are looked up at run time
+unix: LIBS += $$QMAKE_LIBS_DYNLOAD
+
+# image provider for blob columns
+qtHaveModule(quick) {
+    QT += quick
+    DEFINES += DATABASE_QUICK
+}
 
 target.path = $$[QT_INSTALL_QML]/$$TARGETPATH
 
@@ -33,6 +33,13 @@
 #include "database.h"
 #include "tablemodel.h"
 #include "sqlmodel.h"
+#include "aggregatemodel.h"
+#include "treemodel.h"
+#include "blob.h"
+
+#ifdef DATABASE_QUICK
+#include <QtQml/QQmlEngine>
+#endif
 
 class Plugin : public QQmlExtensionPlugin
 {
@@ -45,7 +52,17 @@ public:
         qmlRegisterType<Database>(uri, 0, 1, "Database");
         qmlRegisterType<TableModel>(uri, 0, 1, "TableModel");
         qmlRegisterType<SqlModel>(uri, 0, 1, "SqlModel");
+        qmlRegisterType<AggregateModel>(uri, 0, 1, "AggregateModel");
+        qmlRegisterType<TreeModel>(uri, 0, 1, "TreeModel");
+    }
+
+#ifdef DATABASE_QUICK
+    void initializeEngine(QQmlEngine *engine, const char *uri) {
+        Q_UNUSED(uri)
+        // image://database/... urls of blob columns
+        engine->addImageProvider(QLatin1String("database"), new BlobImageProvider);
     }
+#endif
 };
 
 #endif // PLUGIN_H
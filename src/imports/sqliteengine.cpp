@@ -0,0 +1,190 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sqliteengine.h"
+#include "sqlitehandle.h"
+#include "tracing.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QVector>
+
+bool SqliteEngine::isAvailable(const QSqlDatabase &db)
+{
+    return SqliteApi::get(db) != 0;
+}
+
+static int bind(const SqliteApi *api, sqlite3_stmt *stmt, int index, const QVariant &value)
+{
+    if (value.isNull())
+        return api->bind_null(stmt, index);
+
+    switch (value.type()) {
+    case QVariant::Bool:
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+        return api->bind_int64(stmt, index, value.toLongLong());
+    case QVariant::Double:
+        return api->bind_double(stmt, index, value.toDouble());
+    case QVariant::ByteArray: {
+        QByteArray data = value.toByteArray();
+        return api->bind_blob(stmt, index, data.constData(), data.size(), SqliteApi::transient());
+    }
+    case QVariant::DateTime: {
+        // the same text QSQLITE stores
+        QString text = value.toDateTime().toString(Qt::ISODate);
+        return api->bind_text16(stmt, index, text.utf16(), text.size() * sizeof(QChar), SqliteApi::transient());
+    }
+    default: {
+        QString text = value.toString();
+        return api->bind_text16(stmt, index, text.utf16(), text.size() * sizeof(QChar), SqliteApi::transient());
+    }
+    }
+}
+
+static inline QString text(const SqliteApi *api, sqlite3_stmt *stmt, int column)
+{
+    const void *data = api->column_text16(stmt, column);
+    int bytes = api->column_bytes16(stmt, column);
+    return QString(static_cast<const QChar *>(data), bytes / sizeof(QChar));
+}
+
+static QVariant value(const SqliteApi *api, sqlite3_stmt *stmt, int column, QVariant::Type type)
+{
+    int storage = api->column_type(stmt, column);
+    if (storage == SqliteApi::Null)
+        return type == QVariant::Invalid ? QVariant() : QVariant(type);
+
+    // straight to the type of the property where there is a direct way
+    switch (type) {
+    case QVariant::Int:
+    case QVariant::LongLong:
+        if (storage == SqliteApi::Integer)
+            return api->column_int64(stmt, column);
+        break;
+    case QVariant::Bool:
+        if (storage == SqliteApi::Integer)
+            return api->column_int64(stmt, column) != 0;
+        break;
+    case QVariant::Double:
+        if (storage == SqliteApi::Integer || storage == SqliteApi::Float)
+            return api->column_double(stmt, column);
+        break;
+    case QVariant::String:
+        return text(api, stmt, column);
+    default:
+        break;
+    }
+
+    QVariant ret;
+    switch (storage) {
+    case SqliteApi::Integer:
+        ret = api->column_int64(stmt, column);
+        break;
+    case SqliteApi::Float:
+        ret = api->column_double(stmt, column);
+        break;
+    case SqliteApi::Blob:
+        ret = QByteArray(static_cast<const char *>(api->column_blob(stmt, column)), api->column_bytes(stmt, column));
+        break;
+    default:
+        ret = text(api, stmt, column);
+        break;
+    }
+    if (type != QVariant::Invalid && ret.type() != type)
+        ret.convert(type);
+    return ret;
+}
+
+bool SqliteEngine::select(const QSqlDatabase &db, const QString &sql, const QVariantList &params, const QHash<int, QVariant::Type> &types, QStringList *columns, QList<QVariantList> *rows, QString *error)
+{
+    const SqliteApi *api = SqliteApi::get(db);
+    sqlite3 *handle = sqliteHandle(db);
+    if (!api) {
+        *error = handle ? QLatin1String("the QSQLITE driver does not export the sqlite3 API") : QLatin1String("not a QSQLITE connection");
+        return false;
+    }
+
+    qint64 start = Tracing::now();
+    sqlite3_stmt *stmt = 0;
+    int rc = api->prepare16_v2(handle, sql.utf16(), (sql.size() + 1) * sizeof(QChar), &stmt, 0);
+    if (rc != SqliteApi::Ok) {
+        *error = QString::fromUtf8(api->errmsg(handle));
+        api->finalize(stmt);
+        return false;
+    }
+    for (int i = 0; i < params.count() && rc == SqliteApi::Ok; i++) {
+        rc = bind(api, stmt, i + 1, params.at(i));
+    }
+    if (rc != SqliteApi::Ok) {
+        *error = QString::fromUtf8(api->errmsg(handle));
+        api->finalize(stmt);
+        return false;
+    }
+    qint64 prepared = Tracing::now();
+
+    int count = api->column_count(stmt);
+    columns->clear();
+    for (int i = 0; i < count; i++) {
+        columns->append(QString::fromUtf16(static_cast<const ushort *>(api->column_name16(stmt, i))));
+    }
+    QVector<QVariant::Type> columnTypes(count, QVariant::Invalid);
+    foreach (int i, types.keys()) {
+        if (i >= 0 && i < count)
+            columnTypes[i] = types.value(i);
+    }
+
+    // the first step runs the statement, the rest fetch
+    qint64 executed = 0;
+    int fetched = 0;
+    while ((rc = api->step(stmt)) == SqliteApi::Row) {
+        if (executed == 0)
+            executed = Tracing::now();
+        QVariantList row;
+        row.reserve(count);
+        for (int i = 0; i < count; i++) {
+            row.append(value(api, stmt, i, columnTypes.at(i)));
+        }
+        rows->append(row);
+        fetched++;
+    }
+    qint64 end = Tracing::now();
+    if (executed == 0)
+        executed = end;
+
+    bool ret = rc == SqliteApi::Done;
+    if (!ret)
+        *error = QString::fromUtf8(api->errmsg(handle));
+    api->finalize(stmt);
+
+    if (Tracing::isEnabled()) {
+        Tracing::record("sql", "prepare", start, prepared, sql);
+        Tracing::record("sql", "exec", prepared, executed, sql);
+        Tracing::record("sql", "fetch", executed, end, QString("%1 rows").arg(fetched));
+    }
+    Tracing::query(sql, params, prepared - start, executed - prepared, end - executed);
+    return ret;
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "sqlitehandle.h"
+
+#ifdef Q_OS_UNIX
+#include <dlfcn.h>
+#endif
+
+template<typename T>
+static bool resolve(void *library, const char *name, T *function)
+{
+#ifdef Q_OS_UNIX
+    *function = reinterpret_cast<T>(dlsym(library, name));
+#else
+    Q_UNUSED(library)
+    Q_UNUSED(name)
+    *function = 0;
+#endif
+    return *function != 0;
+}
+
+// every QSQLITE connection is served by the same plugin
+static SqliteApi *load(const QSqlDriver *driver)
+{
+#ifdef Q_OS_UNIX
+    // the meta object lives in the plugin (or the binary it is built into),
+    // dlsym() looks at its dependencies as well, e.g. the system libsqlite3
+    Dl_info info;
+    if (!dladdr(driver->metaObject(), &info) || !info.dli_fname) return 0;
+    void *library = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+    if (!library) return 0;
+#else
+    Q_UNUSED(driver)
+    void *library = 0;
+#endif
+    static SqliteApi api;
+    bool ok = resolve(library, "sqlite3_errmsg", &api.errmsg)
+            && resolve(library, "sqlite3_blob_open", &api.blob_open)
+            && resolve(library, "sqlite3_blob_bytes", &api.blob_bytes)
+            && resolve(library, "sqlite3_blob_read", &api.blob_read)
+            && resolve(library, "sqlite3_blob_write", &api.blob_write)
+            && resolve(library, "sqlite3_blob_close", &api.blob_close)
+            && resolve(library, "sqlite3_interrupt", &api.interrupt)
+            && resolve(library, "sqlite3_db_status", &api.db_status)
+            && resolve(library, "sqlite3_prepare16_v2", &api.prepare16_v2)
+            && resolve(library, "sqlite3_finalize", &api.finalize)
+            && resolve(library, "sqlite3_step", &api.step)
+            && resolve(library, "sqlite3_bind_null", &api.bind_null)
+            && resolve(library, "sqlite3_bind_int64", &api.bind_int64)
+            && resolve(library, "sqlite3_bind_double", &api.bind_double)
+            && resolve(library, "sqlite3_bind_blob", &api.bind_blob)
+            && resolve(library, "sqlite3_bind_text16", &api.bind_text16)
+            && resolve(library, "sqlite3_column_count", &api.column_count)
+            && resolve(library, "sqlite3_column_name16", &api.column_name16)
+            && resolve(library, "sqlite3_column_type", &api.column_type)
+            && resolve(library, "sqlite3_column_int64", &api.column_int64)
+            && resolve(library, "sqlite3_column_double", &api.column_double)
+            && resolve(library, "sqlite3_column_blob", &api.column_blob)
+            && resolve(library, "sqlite3_column_bytes", &api.column_bytes)
+            && resolve(library, "sqlite3_column_text16", &api.column_text16)
+            && resolve(library, "sqlite3_column_bytes16", &api.column_bytes16);
+    // the plugin stays loaded anyway, library is not closed
+    return ok ? &api : 0;
+}
+
+const SqliteApi *SqliteApi::get(const QSqlDatabase &db)
+{
+    if (!sqliteHandle(db)) return 0;
+    static const SqliteApi *api = load(db.driver());
+    return api;
+}
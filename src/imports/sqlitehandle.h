@@ -0,0 +1,92 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SQLITEHANDLE_H
+#define SQLITEHANDLE_H
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlDriver>
+
+struct sqlite3;
+struct sqlite3_blob;
+struct sqlite3_stmt;
+
+// the native handle behind a QSQLITE connection, or 0 for other drivers
+inline sqlite3 *sqliteHandle(const QSqlDatabase &db)
+{
+    if (!db.isValid() || !db.driver()) return 0;
+    QVariant v = db.driver()->handle();
+    if (v.isValid() && qstrcmp(v.typeName(), "sqlite3*") == 0)
+        return *static_cast<sqlite3 **>(v.data());
+    return 0;
+}
+
+// the sqlite3 functions of the library the QSQLITE driver runs on, looked up
+// in the driver at run time: linking another sqlite3 into the process would
+// not share its file locks. a driver with the bundled SQLite built hidden
+// exports none of them
+struct SqliteApi
+{
+    // the values of SQLITE_* used here, they are part of the stable ABI
+    enum { Ok = 0, Row = 100, Done = 101 };
+    enum { Integer = 1, Float = 2, Text = 3, Blob = 4, Null = 5 };
+    enum { CacheUsed = 1, CacheHit = 7, CacheMiss = 8 };
+    typedef void (*Destructor)(void *);
+    // SQLITE_TRANSIENT, the value is copied before the call returns
+    static Destructor transient() { return reinterpret_cast<Destructor>(-1); }
+
+    // 0 for other drivers or when the driver does not export the functions
+    static const SqliteApi *get(const QSqlDatabase &db);
+
+    const char *(*errmsg)(sqlite3 *);
+    int (*blob_open)(sqlite3 *, const char *, const char *, const char *, qint64, int, sqlite3_blob **);
+    int (*blob_bytes)(sqlite3_blob *);
+    int (*blob_read)(sqlite3_blob *, void *, int, int);
+    int (*blob_write)(sqlite3_blob *, const void *, int, int);
+    int (*blob_close)(sqlite3_blob *);
+    void (*interrupt)(sqlite3 *);
+    int (*db_status)(sqlite3 *, int, int *, int *, int);
+    int (*prepare16_v2)(sqlite3 *, const void *, int, sqlite3_stmt **, const void **);
+    int (*finalize)(sqlite3_stmt *);
+    int (*step)(sqlite3_stmt *);
+    int (*bind_null)(sqlite3_stmt *, int);
+    int (*bind_int64)(sqlite3_stmt *, int, qint64);
+    int (*bind_double)(sqlite3_stmt *, int, double);
+    int (*bind_blob)(sqlite3_stmt *, int, const void *, int, Destructor);
+    int (*bind_text16)(sqlite3_stmt *, int, const void *, int, Destructor);
+    int (*column_count)(sqlite3_stmt *);
+    const void *(*column_name16)(sqlite3_stmt *, int);
+    int (*column_type)(sqlite3_stmt *, int);
+    qint64 (*column_int64)(sqlite3_stmt *, int);
+    double (*column_double)(sqlite3_stmt *, int);
+    const void *(*column_blob)(sqlite3_stmt *, int);
+    int (*column_bytes)(sqlite3_stmt *, int);
+    const void *(*column_text16)(sqlite3_stmt *, int);
+    int (*column_bytes16)(sqlite3_stmt *, int);
+};
+
+#endif // SQLITEHANDLE_H
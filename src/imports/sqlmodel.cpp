@@ -26,16 +26,27 @@
 
 #include "sqlmodel.h"
 #include "database.h"
+#include "tracing.h"
+#include "workerpool.h"
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
 #include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QMetaObject>
 #include <QtCore/QMetaProperty>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QPointer>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QStandardPaths>
 #include <QtCore/QStringList>
-#include <QtCore/QTime>
-#include <QtCore/QThread>
-#include <QtCore/QReadWriteLock>
-#include <QtCore/QReadLocker>
-#include <QtCore/QWriteLocker>
+#include <QtCore/QTimer>
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlDriver>
@@ -43,7 +54,402 @@
 #include <QtSql/QSqlRecord>
 #include <QtSql/QSqlQuery>
 
-#define DEBUG() qDebug() << Q_FUNC_INFO << __LINE__
+// on-disk result cache: magic, format, column names and rows in QDataStream
+static const quint32 cacheMagic = 0x534d4343; // "SMCC"
+static const quint32 cacheFormat = 1;
+
+static QByteArray serializeResult(const QHash<int, QByteArray> &roleNames, const QList<QVariantList> &rows)
+{
+    QList<QByteArray> columns;
+    for (int i = 0; i < roleNames.count(); i++) {
+        columns.append(roleNames.value(Qt::UserRole + i));
+    }
+
+    QByteArray ret;
+    QDataStream out(&ret, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << cacheMagic << cacheFormat << columns << rows;
+    return ret;
+}
+
+static bool deserializeResult(const QByteArray &data, QHash<int, QByteArray> *roleNames, QList<QVariantList> *rows)
+{
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic = 0;
+    quint32 format = 0;
+    in >> magic >> format;
+    if (magic != cacheMagic || format != cacheFormat) return false;
+
+    QList<QByteArray> columns;
+    in >> columns >> *rows;
+    if (in.status() != QDataStream::Ok) return false;
+
+    for (int i = 0; i < columns.count(); i++) {
+        roleNames->insert(Qt::UserRole + i, columns.at(i));
+    }
+    return true;
+}
+
+static void saveCache(const QString &fileName, const QByteArray &data)
+{
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+
+    QSaveFile file(fileName);
+    if (!file.open(QFile::WriteOnly)) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+        return;
+    }
+    file.write(data);
+    if (!file.commit()) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+    }
+}
+
+namespace {
+
+// everything a select() needs, so that it can run on a pool worker
+struct Request {
+    Request() : database(0), native(false), shared(false), cache(false), materialized(false), generation(0) {}
+    // only for fanOut(), outlives the pool running the request
+    const Database *database;
+    QString connectionName;
+    QString query;
+    QVariantList params;
+    bool native;
+    bool shared;
+    bool cache;
+    QString cacheFileName;
+    bool materialized;
+    QString groupKey;
+    QByteArray cacheDigest;
+    int generation;
+};
+
+struct Outcome {
+    Outcome() : ticket(0), changed(true) {}
+    Database::Result result;
+    // reference to the Database::sharedResult() entry
+    quint64 ticket;
+    // false when the result equals the cached one on screen
+    bool changed;
+    QByteArray cacheDigest;
+};
+
+// shared by the model and its tasks on the pool, outlives either of them
+struct Mailbox {
+    Mailbox() : receiver(0), generation(0), pending(false), running(0) {}
+    QMutex mutex;
+    // 0 once the model is gone
+    QObject *receiver;
+    // generation of the latest request
+    QAtomicInt latest;
+    int generation;
+    bool pending;
+    Outcome outcome;
+    // ticket of the shared result the latest request is executing, 0 for none
+    quint64 running;
+};
+
+bool exec(QSqlQuery &query, const QString &sql, const QVariantList &params = QVariantList())
+{
+    query.prepare(sql);
+    foreach (const QVariant &param, params) {
+        query.addBindValue(param);
+    }
+    if (query.exec()) return true;
+    qCWarning(lcDatabase) << sql << params << query.lastError().text();
+    return false;
+}
+
+// materialized views in use by the models of this process, by connection and
+// name; the last model to let go of one drops its tables and triggers
+QMutex viewMutex;
+QHash<QString, int> viewRefs;
+
+QString viewName(const Request &request)
+{
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << request.query << request.params << request.groupKey;
+    return QString("__mv_%1").arg(QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex().left(16)));
+}
+
+void acquireView(const QString &connectionName, const QString &name)
+{
+    QMutexLocker locker(&viewMutex);
+    viewRefs[connectionName + QLatin1Char('/') + name]++;
+}
+
+// true for the last reference
+bool releaseView(const QString &connectionName, const QString &name)
+{
+    QMutexLocker locker(&viewMutex);
+    QString key = connectionName + QLatin1Char('/') + name;
+    if (--viewRefs[key] > 0) return false;
+    viewRefs.remove(key);
+    return true;
+}
+
+bool viewInUse(const QString &connectionName, const QString &name)
+{
+    QMutexLocker locker(&viewMutex);
+    return viewRefs.contains(connectionName + QLatin1Char('/') + name);
+}
+
+// the first error, none when everything is gone
+QSqlError dropView(QSqlDatabase db, const QString &name, const QStringList &tables)
+{
+    QStringList sqls;
+    foreach (const QString &table, tables) {
+        foreach (const QString &event, QStringList() << "insert" << "update" << "delete") {
+            sqls.append(QString("DROP TRIGGER IF EXISTS %1_%2_%3").arg(name).arg(table).arg(event));
+        }
+    }
+    sqls << QString("DROP TABLE IF EXISTS %1_dirty").arg(name)
+         << QString("DROP TABLE IF EXISTS %1").arg(name);
+    QSqlQuery query(db);
+    foreach (const QString &sql, sqls) {
+        if (!query.exec(sql)) return query.lastError();
+    }
+    return QSqlError();
+}
+
+// SQLITE_BUSY or SQLITE_LOCKED, another connection is writing
+bool isBusy(const QSqlError &error)
+{
+    return error.nativeErrorCode() == QLatin1String("5") || error.nativeErrorCode() == QLatin1String("6");
+}
+
+// msecs between the attempts to drop a released view while the file is busy
+const int dropInterval = 100;
+const int dropAttempts = 50;
+
+// drops a released view from the connection of the models, tried again later
+// while a pool connection holds the write lock
+void dropReleasedView(const QString &connectionName, const QString &name, const QStringList &tables, int attempts)
+{
+    // taken again meanwhile or the database is gone
+    if (viewInUse(connectionName, name) || !QSqlDatabase::contains(connectionName)) return;
+    QSqlDatabase db = QSqlDatabase::database(connectionName);
+    if (!db.isOpen()) return;
+
+    QSqlQuery query(db);
+    QSqlError error;
+    if (!query.exec(QLatin1String("BEGIN IMMEDIATE"))) {
+        error = query.lastError();
+    } else {
+        error = dropView(db, name, tables);
+        if (error.type() == QSqlError::NoError && !query.exec(QLatin1String("COMMIT")))
+            error = query.lastError();
+        if (error.type() != QSqlError::NoError)
+            query.exec(QLatin1String("ROLLBACK"));
+    }
+    if (error.type() == QSqlError::NoError) return;
+    if (isBusy(error) && attempts > 1) {
+        QTimer::singleShot(dropInterval, QCoreApplication::instance(), [connectionName, name, tables, attempts]() {
+            dropReleasedView(connectionName, name, tables, attempts - 1);
+        });
+        return;
+    }
+    qCWarning(lcDatabase) << "can not drop" << name << error.text();
+}
+
+// an ORDER BY, LIMIT or OFFSET of the query itself, outside of subqueries and
+// literals: its rows then depend on more than their own group
+bool isBounded(const QString &query)
+{
+    QString top;
+    QChar quote;
+    int depth = 0;
+    foreach (QChar c, query) {
+        if (!quote.isNull()) {
+            if (c == quote)
+                quote = QChar();
+        } else if (c == QLatin1Char('\'') || c == QLatin1Char('"') || c == QLatin1Char('`')) {
+            quote = c;
+        } else if (c == QLatin1Char('(')) {
+            depth++;
+        } else if (c == QLatin1Char(')')) {
+            depth--;
+        } else if (depth == 0) {
+            top.append(c);
+            continue;
+        }
+        top.append(QLatin1Char(' '));
+    }
+    static const QRegularExpression clause(QStringLiteral("\\b(ORDER\\s+BY|LIMIT|OFFSET)\\b"), QRegularExpression::CaseInsensitiveOption);
+    return top.contains(clause);
+}
+
+// the result is kept in the table __mv_<hash>, triggers on the source tables
+// write the groupKey values they touch to __mv_<hash>_dirty and only those
+// groups are computed again; a row with whole set, from a table without the
+// groupKey column, recomputes all of them
+Database::Result materialize(QSqlDatabase db, const Request &request)
+{
+    TraceScope trace("sql", "SqlModel::materialize");
+    QString name = viewName(request);
+    QString dirty = name + QLatin1String("_dirty");
+    QString select = QString("SELECT * FROM (%1)").arg(request.query);
+    QString g = request.groupKey;
+    QStringList tables = Database::tablesIn(request.query);
+
+    Database::Result ret;
+    QSqlQuery query(db);
+    // nobody may mark groups dirty between reading and clearing them
+    if (!exec(query, QLatin1String("BEGIN IMMEDIATE"))) return ret;
+    // released while queued, creating it again would leave it behind
+    if (!viewInUse(request.connectionName, name)) {
+        exec(query, QLatin1String("ROLLBACK"));
+        ret.error = QStringLiteral("released");
+        return ret;
+    }
+
+    bool ok = true;
+    bool exists = db.tables().contains(name);
+    if (exists && !db.record(dirty).contains(QLatin1String("whole"))) {
+        // made before NULL groups were told apart from whole refreshes
+        QSqlError error = dropView(db, name, tables);
+        if (error.type() != QSqlError::NoError)
+            qCWarning(lcDatabase) << "can not drop" << name << error.text();
+        exists = false;
+    }
+    if (!exists) {
+        ok = exec(query, QString("CREATE TABLE IF NOT EXISTS %1(key, whole)").arg(dirty));
+        foreach (const QString &table, tables) {
+            if (!ok) break;
+            bool hasKey = !g.isEmpty() && db.record(table).contains(g);
+            QString newKey = hasKey ? QString("NEW.%1, 0").arg(g) : QString("NULL, 1");
+            QString oldKey = hasKey ? QString("OLD.%1, 0").arg(g) : QString("NULL, 1");
+            QString trigger = QString("CREATE TRIGGER IF NOT EXISTS %1_%2_%3 AFTER %4 ON %2 BEGIN %5 END");
+            ok = exec(query, trigger.arg(name).arg(table).arg("insert").arg("INSERT").arg(QString("INSERT INTO %1(key, whole) VALUES(%2);").arg(dirty).arg(newKey)))
+                && exec(query, trigger.arg(name).arg(table).arg("update").arg("UPDATE").arg(QString("INSERT INTO %1(key, whole) VALUES(%2); INSERT INTO %1(key, whole) VALUES(%3);").arg(dirty).arg(oldKey).arg(newKey)))
+                && exec(query, trigger.arg(name).arg(table).arg("delete").arg("DELETE").arg(QString("INSERT INTO %1(key, whole) VALUES(%2);").arg(dirty).arg(oldKey)));
+        }
+        ok = ok && exec(query, QString("CREATE TABLE %1 AS %2").arg(name).arg(select), request.params)
+                && exec(query, QString("DELETE FROM %1").arg(dirty));
+        if (ok && !g.isEmpty() && !db.record(name).contains(g))
+            qCWarning(lcDatabase) << g << "is not a column of" << request.query << "every change recomputes all groups.";
+    } else if (exec(query, QString("SELECT COUNT(*), SUM(whole) FROM %1").arg(dirty)) && query.next()) {
+        int count = query.value(0).toInt();
+        // groups of an ordered or limited query can not be replaced on their own
+        bool grouped = !g.isEmpty() && db.record(name).contains(g) && !isBounded(request.query);
+        bool all = !grouped || query.value(1).toInt() > 0;
+        query.finish();
+        if (count > 0 && all) {
+            ok = exec(query, QString("DELETE FROM %1").arg(name))
+                && exec(query, QString("INSERT INTO %1 %2").arg(name).arg(select), request.params);
+        } else if (count > 0) {
+            // NULL is a group too, IN never matches it
+            QString groups = QString(" WHERE %1 IN (SELECT key FROM %2 WHERE key IS NOT NULL)"
+                                     " OR (%1 IS NULL AND EXISTS (SELECT 1 FROM %2 WHERE key IS NULL))").arg(g).arg(dirty);
+            ok = exec(query, QString("DELETE FROM %1%2").arg(name).arg(groups))
+                && exec(query, QString("INSERT INTO %1 %2%3").arg(name).arg(select).arg(groups), request.params);
+        }
+        ok = ok && (count == 0 || exec(query, QString("DELETE FROM %1").arg(dirty)));
+    } else {
+        ok = false;
+    }
+    exec(query, QLatin1String(ok ? "COMMIT" : "ROLLBACK"));
+    if (!ok) {
+        ret.error = query.lastError().text();
+        return ret;
+    }
+
+    // rows come in the order of the query when it has one, they were inserted
+    // all at once then; by group otherwise, refreshed groups go to the end
+    QString sql = QString("SELECT * FROM %1").arg(name);
+    if (!g.isEmpty() && db.record(name).contains(g) && !isBounded(request.query))
+        sql += QString(" ORDER BY %1").arg(g);
+    else
+        sql += QLatin1String(" ORDER BY rowid");
+    return Database::execute(db, sql, QVariantList(), request.native);
+}
+
+// a sharded database returns the rows of every shard, in shards order
+Database::Result execute(QSqlDatabase db, const Request &request)
+{
+    if (request.materialized)
+        return materialize(db, request);
+    if (request.database->shards().isEmpty())
+        return Database::execute(db, request.query, request.params, request.native);
+
+    Database::Result ret;
+    ret.ok = true;
+    foreach (const Database::Result &result, request.database->fanOut(db, request.query, request.params)) {
+        if (!result.ok) return result;
+        if (ret.roleNames.isEmpty())
+            ret.roleNames = result.roleNames;
+        ret.rows.append(result.rows);
+        ret.timer = qMax(ret.timer, result.timer);
+    }
+    return ret;
+}
+
+// the digest of a result and its cache file
+void cacheOutcome(Outcome *outcome, const Request &request)
+{
+    if (!outcome->result.ok || !request.cache) return;
+    QByteArray data = serializeResult(outcome->result.roleNames, outcome->result.rows);
+    outcome->cacheDigest = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+    // the cached result on screen is still up to date
+    if (outcome->cacheDigest == request.cacheDigest) {
+        outcome->changed = false;
+        return;
+    }
+    saveCache(request.cacheFileName, data);
+}
+
+// with joined, a shared query in flight elsewhere is not waited for, *pending
+// is set and joined delivers the result
+Outcome run(QSqlDatabase db, const Request &request, Mailbox *mailbox = 0, const Database::Joined &joined = Database::Joined(), bool *pending = 0)
+{
+    Outcome ret;
+    if (request.shared) {
+        ret.result = Database::sharedResult(request.connectionName, request.query, request.params, [&]() {
+            // the ticket is assigned before the query runs
+            if (mailbox) {
+                QMutexLocker locker(&mailbox->mutex);
+                if (mailbox->latest.load() == request.generation)
+                    mailbox->running = ret.ticket;
+            }
+            return execute(db, request);
+        }, &ret.ticket, joined, pending);
+        if (pending && *pending) return ret;
+    } else {
+        ret.result = execute(db, request);
+    }
+    cacheOutcome(&ret, request);
+    return ret;
+}
+
+// hands the outcome of request to the model behind mailbox, from any thread
+void deliver(Mailbox *mailbox, const Request &request, const Outcome &outcome)
+{
+    QMutexLocker locker(&mailbox->mutex);
+    if (outcome.ticket > 0 && mailbox->running == outcome.ticket)
+        mailbox->running = 0;
+    bool stale = !mailbox->receiver || mailbox->latest.load() != request.generation;
+    if (stale) {
+        // interrupted on purpose, nothing to report
+        if (outcome.ticket > 0)
+            Database::releaseResult(outcome.ticket);
+        return;
+    }
+    if (!outcome.result.ok)
+        qCWarning(lcDatabase) << request.query << request.params << outcome.result.error;
+    if (mailbox->pending && mailbox->outcome.ticket > 0)
+        Database::releaseResult(mailbox->outcome.ticket);
+    mailbox->outcome = outcome;
+    mailbox->generation = request.generation;
+    mailbox->pending = true;
+    QMetaObject::invokeMethod(mailbox->receiver, "finished", Qt::QueuedConnection, Q_ARG(int, request.generation));
+}
+
+}
 
 class SqlModel::Private : public QObject
 {
@@ -51,73 +457,149 @@ class SqlModel::Private : public QObject
 public:
     Private(SqlModel *parent);
     void init();
-
-    QString selectSql() const;
-
-signals:
-    void updated();
-    void timerChanged(int timer);
+    void stop();
+
+    QString cacheFileName() const;
+    bool loadCache();
+    // the synchronous path of select()
+    void runNow(const Request &request);
+    void apply(const Outcome &outcome);
+    void update(const QHash<int, QByteArray> &roleNames, const QList<QVariantList> &rows);
+    // stops waiting for task, false when it keeps running for other holders
+    // of its shared result and its outcome has to be ignored
+    bool cancel();
+    // registers the tables of the query with database for pollInterval
+    void observe(Database *database, const QStringList &tableNames);
+    // holds the materialized view of the current request, empty name for none
+    void setView(const QString &connectionName, const QString &name, const QStringList &tables);
 
 private slots:
     void databaseChanged(Database *database);
     void openChanged(bool open);
+    void tableChanged(const QString &tableName);
+    void externalChanged(const QStringList &tableNames);
+    void priorityChanged(int priority);
+    void timeout();
     void select();
+    void finished(int generation);
+    void runDeferred(int generation);
 
 private:
     SqlModel *q;
+    QPointer<Database> database;
 
 public:
-    QThread *thread;
-    QReadWriteLock lock;
-    QSqlQuery query;
     QHash<int, QByteArray> roleNames;
-    bool quit;
+    QList<QVariantList> rows;
+    // sha1 of the serialized result currently shown
+    QByteArray cacheDigest;
+    quint64 ticket;
+    int generation;
+    // the request running or queued on the pool
+    QPointer<WorkerPool> pool;
+    quint64 task;
+    QSharedPointer<Mailbox> mailbox;
+    QTimer *timeoutTimer;
     int timer;
-    int count;
+    QString view;
+    QString viewConnection;
+    QStringList viewTables;
+    // the synchronous request run after the cached result got painted
+    Request deferred;
+    QPointer<Database> observing;
+    QStringList observedTables;
 };
 
 SqlModel::Private::Private(SqlModel *parent)
     : QObject(parent)
     , q(parent)
-    , thread(0)
-    , quit(false)
+    , ticket(0)
+    , generation(0)
+    , task(0)
+    , mailbox(new Mailbox)
+    , timeoutTimer(0)
     , timer(0)
-    , count(0)
 {
+    mailbox->receiver = this;
 }
 
 void SqlModel::Private::init()
 {
-    Qt::ConnectionType type = Qt::DirectConnection;
-    if (q->m_async) {
-        thread = new QThread(q);
-        // TODO
-//        connect(thread, &QThread::destroyed, [&](QObject *object) {
-//        });
-        this->setParent(0);
-        this->moveToThread(thread);
-        thread->start();
-        type = Qt::QueuedConnection;
-    }
-
-    connect(q, SIGNAL(databaseChanged(Database*)), this, SLOT(databaseChanged(Database*)), type);
-    connect(q, SIGNAL(selectChanged(bool)), this, SLOT(select()), type);
-    connect(q, SIGNAL(queryChanged(QString)), this, SLOT(select()), type);
-    connect(q, SIGNAL(paramsChanged(QVariantList)), this, SLOT(select()), type);
-    connect(this, SIGNAL(updated()), q, SLOT(updated()), type);
-    connect(this, SIGNAL(timerChanged(int)), q, SIGNAL(timerChanged(int)), type);
+    timeoutTimer = new QTimer(this);
+    timeoutTimer->setSingleShot(true);
+    connect(timeoutTimer, SIGNAL(timeout()), this, SLOT(timeout()));
+
+    connect(q, SIGNAL(databaseChanged(Database*)), this, SLOT(databaseChanged(Database*)));
+    connect(q, SIGNAL(selectChanged(bool)), this, SLOT(select()));
+    connect(q, SIGNAL(queryChanged(QString)), this, SLOT(select()));
+    connect(q, SIGNAL(paramsChanged(QVariantList)), this, SLOT(select()));
+    connect(q, SIGNAL(materializedChanged(bool)), this, SLOT(select()));
+    connect(q, SIGNAL(groupKeyChanged(QString)), this, SLOT(select()));
+    connect(q, SIGNAL(priorityChanged(int)), this, SLOT(priorityChanged(int)));
 
     if (!q->m_database) {
         q->database(qobject_cast<Database *>(q->QObject::parent()));
+    } else {
+        databaseChanged(q->m_database);
     }
-    QMetaObject::invokeMethod(this, "select", type);
+}
+
+void SqlModel::Private::setView(const QString &connectionName, const QString &name, const QStringList &tables)
+{
+    if (connectionName == viewConnection && name == view) return;
+    if (!name.isEmpty())
+        acquireView(connectionName, name);
+    if (!view.isEmpty() && releaseView(viewConnection, view))
+        dropReleasedView(viewConnection, view, viewTables, dropAttempts);
+    view = name;
+    viewConnection = connectionName;
+    viewTables = tables;
+}
+
+void SqlModel::Private::observe(Database *database, const QStringList &tableNames)
+{
+    if (observing.data() == database && observedTables == tableNames) return;
+    if (observing)
+        observing->unobserve(observedTables);
+    observing = database;
+    observedTables = tableNames;
+    if (database)
+        database->observe(observedTables);
+}
+
+void SqlModel::Private::stop()
+{
+    {
+        QMutexLocker locker(&mailbox->mutex);
+        mailbox->receiver = 0;
+        if (mailbox->pending && mailbox->outcome.ticket > 0)
+            Database::releaseResult(mailbox->outcome.ticket);
+        mailbox->pending = false;
+    }
+    // do not let a query nobody will look at hold a worker
+    cancel();
+    task = 0;
+    setView(QString(), QString(), QStringList());
+    observe(0, QStringList());
+    if (ticket > 0)
+        Database::releaseResult(ticket);
+    ticket = 0;
 }
 
 void SqlModel::Private::databaseChanged(Database *database)
 {
-    disconnect(this, SLOT(openChanged(bool)));
+    if (this->database) {
+        disconnect(this->database, 0, this, 0);
+    }
+    this->database = database;
     if (database) {
         connect(database, SIGNAL(openChanged(bool)), this, SLOT(openChanged(bool)));
+        connect(database, SIGNAL(tableChanged(QString)), this, SLOT(tableChanged(QString)));
+        connect(database, SIGNAL(externalChanged(QStringList)), this, SLOT(externalChanged(QStringList)));
+        // show the last known result until the live one arrives, the file
+        // name needs the database and nothing was selected yet
+        if (q->m_cache && generation == 0)
+            loadCache();
         openChanged(database->open());
     }
 }
@@ -126,112 +608,270 @@ void SqlModel::Private::openChanged(bool open)
 {
     if (open) {
         if (q->query().isEmpty()) {
-            qWarning() << "query is empty.";
+            qCWarning(lcDatabase) << "query is empty.";
             return;
         }
         select();
     }
 }
 
+void SqlModel::Private::tableChanged(const QString &tableName)
+{
+    // shared results are dropped on writes and materialized ones have dirty
+    // groups now, pick up a fresh one
+    if (!q->m_shared && !q->m_materialized) return;
+    QStringList tables = Database::tablesIn(q->m_query);
+    if (tables.isEmpty() || tables.contains(tableName.toLower())) {
+        select();
+    }
+}
+
+// written elsewhere, every model on those tables is outdated
+void SqlModel::Private::externalChanged(const QStringList &tableNames)
+{
+    QStringList tables = Database::tablesIn(q->m_query);
+    foreach (const QString &tableName, tableNames) {
+        if (tables.isEmpty() || tables.contains(tableName.toLower())) {
+            select();
+            return;
+        }
+    }
+}
+
+void SqlModel::Private::priorityChanged(int priority)
+{
+    if (pool && task > 0)
+        pool->setPriority(task, priority);
+}
+
+void SqlModel::Private::timeout()
+{
+    // dropped, interrupted or, while other models still wait for it, given
+    // up on here only; either way this model is done with it
+    cancel();
+    qCWarning(lcDatabase) << q->m_query << "timed out.";
+    mailbox->latest.store(++generation);
+    task = 0;
+    apply(Outcome());
+}
+
+bool SqlModel::Private::cancel()
+{
+    if (!pool || task == 0) return true;
+    quint64 running = 0;
+    {
+        QMutexLocker locker(&mailbox->mutex);
+        running = mailbox->running;
+        mailbox->running = 0;
+    }
+    if (running > 0 && !Database::abandonResult(running)) return false;
+    pool->cancel(task);
+    return true;
+}
+
+QString SqlModel::Private::cacheFileName() const
+{
+    if (!q->m_database) return QString();
+
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << q->m_database->type()
+        << q->m_database->hostName()
+        << q->m_database->userName()
+        << q->m_database->databaseName()
+        << q->m_query
+        << q->m_params
+        << q->m_cacheVersion;
+
+    QString path = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    return QString("%1/sqlmodel/%2.cache").arg(path).arg(QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()));
+}
+
+bool SqlModel::Private::loadCache()
+{
+    QFile file(cacheFileName());
+    if (!file.open(QFile::ReadOnly)) return false;
+
+    // deserializing copies every value anyway, a plain read is enough
+    QByteArray bytes = file.readAll();
+    QHash<int, QByteArray> cachedRoleNames;
+    QList<QVariantList> cachedRows;
+    if (bytes.isEmpty() || !deserializeResult(bytes, &cachedRoleNames, &cachedRows)) {
+        qCWarning(lcDatabase) << file.fileName() << "is broken.";
+        return false;
+    }
+    cacheDigest = QCryptographicHash::hash(bytes, QCryptographicHash::Sha1);
+    update(cachedRoleNames, cachedRows);
+    return true;
+}
+
 void SqlModel::Private::select()
 {
     if (!q->m_select) return;
     if (!q->m_database || !q->m_database->open()) return;
 
-    if (query.isActive()) {
-        query.finish();
+    Request request;
+    request.database = q->m_database;
+    request.connectionName = q->m_database->connectionName();
+    request.query = q->m_query;
+    request.params = q->m_params;
+    request.native = q->m_database->native();
+    request.shared = q->m_shared;
+    request.cache = q->m_cache;
+    if (request.cache)
+        request.cacheFileName = cacheFileName();
+    request.cacheDigest = cacheDigest;
+    request.materialized = q->m_materialized;
+    request.groupKey = q->m_groupKey;
+    if (request.materialized && (q->m_database->type() != QLatin1String("QSQLITE") || !q->m_database->shards().isEmpty())) {
+        qCWarning(lcDatabase) << "materialized is supported for a single QSQLITE database only.";
+        request.materialized = false;
     }
+    QStringList tables = Database::tablesIn(request.query);
+    // a query we can not parse reads any table
+    observe(q->m_database, tables.isEmpty() ? QStringList(QStringLiteral("*")) : tables);
+    if (request.materialized)
+        setView(request.connectionName, viewName(request), tables);
+    else
+        setView(QString(), QString(), QStringList());
+    request.generation = ++generation;
+    mailbox->latest.store(generation);
 
-    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    q->m_database->advise(request.query, request.params);
 
-    query = QSqlQuery(db);
-    query.prepare(q->m_query);
-    foreach (const QVariant &param, q->m_params) {
-        query.addBindValue(param);
+    if (!q->m_async && q->m_cache) {
+        // running it right away would replace the cached rows before they are shown
+        deferred = request;
+        QMetaObject::invokeMethod(this, "runDeferred", Qt::QueuedConnection, Q_ARG(int, request.generation));
+        return;
     }
-
-    QTime time;
-    time.start();
-    if (!query.exec()) {
-        qDebug() << Q_FUNC_INFO << __LINE__ << query.lastQuery() << query.boundValues() << query.lastError();
-        updated();
+    if (!q->m_async) {
+        runNow(request);
         return;
     }
-    timer = time.elapsed();
-    emit timerChanged(timer);
 
-    QSqlRecord record = query.record();
+    // the running request is superseded, interrupt it instead of waiting
+    cancel();
 
-    for (int i = 0; i < record.count(); i++) {
-        roleNames.insert(Qt::UserRole + i, record.fieldName(i).toUtf8());
-    }
+    pool = q->m_database->pool();
+    QSharedPointer<Mailbox> mailbox = this->mailbox;
+    task = pool->submit([mailbox, request](QSqlDatabase db) {
+        deliver(mailbox.data(), request, run(db, request, mailbox.data()));
+    }, q->m_priority);
 
-    emit updated();
+    if (q->m_timeout > 0)
+        timeoutTimer->start(q->m_timeout);
 }
 
-SqlModel::SqlModel(QObject *parent)
-    : QAbstractListModel(parent)
-    , d(new Private(this))
-    , m_database(0)
-    , m_select(true)
-    , m_async(false)
+void SqlModel::Private::runDeferred(int generation)
 {
+    // superseded by another select() meanwhile
+    if (generation != this->generation || deferred.generation != generation) return;
+    Request request = deferred;
+    deferred = Request();
+    if (!database || !database->open()) return;
+    runNow(request);
 }
 
-SqlModel::~SqlModel()
+void SqlModel::Private::runNow(const Request &request)
 {
-    if (m_async) {
-        d->lock.lockForWrite();
-        d->quit = true;
-        d->lock.unlock();
-        d->thread->quit();
-        d->thread->wait();
-        delete d->thread;
-        delete d;
+    // an identical shared query on the pool is joined instead of waited for,
+    // its result comes through finished() like that of an async request
+    QSharedPointer<Mailbox> mailbox = this->mailbox;
+    bool pending = false;
+    Outcome outcome = run(QSqlDatabase::database(request.connectionName), request, 0, [mailbox, request](quint64 ticket, const Database::Result &result) {
+        Outcome outcome;
+        outcome.ticket = ticket;
+        outcome.result = result;
+        cacheOutcome(&outcome, request);
+        deliver(mailbox.data(), request, outcome);
+    }, &pending);
+    if (pending) return;
+    if (!outcome.result.ok)
+        qCWarning(lcDatabase) << request.query << request.params << outcome.result.error;
+    apply(outcome);
+}
+
+void SqlModel::Private::finished(int generation)
+{
+    Outcome outcome;
+    {
+        QMutexLocker locker(&mailbox->mutex);
+        if (!mailbox->pending || mailbox->generation != generation) return;
+        outcome = mailbox->outcome;
+        mailbox->outcome = Outcome();
+        mailbox->pending = false;
     }
+    if (generation != this->generation) {
+        if (outcome.ticket > 0)
+            Database::releaseResult(outcome.ticket);
+        return;
+    }
+
+    task = 0;
+    timeoutTimer->stop();
+    apply(outcome);
 }
 
-void SqlModel::updated()
+void SqlModel::Private::apply(const Outcome &outcome)
 {
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
+    if (ticket > 0)
+        Database::releaseResult(ticket);
+    ticket = outcome.ticket;
 
-    if (d->count > 0) {
-        beginRemoveRows(QModelIndex(), 0, d->count - 1);
-        endRemoveRows();
+    if (!outcome.result.ok) {
+        cacheDigest.clear();
+        update(QHash<int, QByteArray>(), QList<QVariantList>());
+        return;
     }
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
 
-//    DEBUG() << "locking write";
-    if (m_async) d->lock.lockForWrite();
-//    DEBUG() << "locked";
+    timer = outcome.result.timer;
+    emit q->timerChanged(timer);
 
-    if (d->query.isActive())
-        d->count = d->query.size();
-    else
-        d->count = 0;
+    if (!outcome.changed) return;
+    cacheDigest = outcome.cacheDigest;
+    update(outcome.result.roleNames, outcome.result.rows);
+}
 
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
+void SqlModel::Private::update(const QHash<int, QByteArray> &roleNames, const QList<QVariantList> &rows)
+{
+    TraceScope trace("model", "SqlModel::update");
 
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
+    if (!this->rows.isEmpty()) {
+        q->beginRemoveRows(QModelIndex(), 0, this->rows.count() - 1);
+        this->rows.clear();
+        q->endRemoveRows();
+    }
+
+    this->roleNames = roleNames;
 
-    if (d->count > 0) {
-        beginInsertRows(QModelIndex(), 0, d->count - 1);
-        endInsertRows();
+    if (!rows.isEmpty()) {
+        q->beginInsertRows(QModelIndex(), 0, rows.count() - 1);
+        this->rows = rows;
+        q->endInsertRows();
     }
 
-    emit countChanged(d->count);
+    emit q->countChanged(this->rows.count());
+}
+
+SqlModel::SqlModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , d(new Private(this))
+    , m_database(0)
+    , m_select(true)
+    , m_async(false)
+    , m_cache(false)
+    , m_shared(false)
+    , m_timeout(0)
+    , m_priority(0)
+    , m_materialized(false)
+{
+}
 
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
+SqlModel::~SqlModel()
+{
+    d->stop();
 }
 
 void SqlModel::classBegin()
@@ -245,72 +885,27 @@ void SqlModel::componentComplete()
 
 QHash<int, QByteArray> SqlModel::roleNames() const
 {
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
-
-    QHash<int, QByteArray> ret = d->roleNames;
-
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
-
-    return ret;
+    return d->roleNames;
 }
 
 int SqlModel::rowCount(const QModelIndex &parent) const
 {
     Q_UNUSED(parent)
-//    DEBUG() << QThread::currentThread() << thread() << d->thread;
-
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
-
-    int ret = d->count;
-
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
-
-//    DEBUG() << ret;
-//    DEBUG() << QThread::currentThread() << thread();
-    return ret;
+    return d->rows.count();
 }
 
 QVariant SqlModel::data(const QModelIndex &index, int role) const
 {
     QVariant ret;
-    if (role >= Qt::UserRole) {
-//        DEBUG() << "locking read";
-        if (m_async) d->lock.lockForRead();
-//        DEBUG() << "locked";
-
-        if (d->query.seek(index.row())) {
-            ret = d->query.value(role - Qt::UserRole);
-        }
-
-//        DEBUG() << "unlocking";
-        if (m_async) d->lock.unlock();
-//        DEBUG() << "unlocked";
+    if (role >= Qt::UserRole && index.row() < d->rows.count()) {
+        ret = d->rows.at(index.row()).value(role - Qt::UserRole);
     }
     return ret;
 }
 
 int SqlModel::timer() const
 {
-    int ret = 0;
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
-
-    ret = d->timer;
-
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
-
-    return ret;
+    return d->timer;
 }
 
 int SqlModel::count() const
@@ -318,24 +913,21 @@ int SqlModel::count() const
     return rowCount();
 }
 
+QVariantList SqlModel::explain() const
+{
+    if (!m_database) return QVariantList();
+    return m_database->explain(m_query, m_params);
+}
+
 QVariantMap SqlModel::get(int index) const
 {
     QVariantMap ret;
+    if (index < 0 || index >= d->rows.count()) return ret;
 
-//    DEBUG() << "locking read";
-    if (m_async) d->lock.lockForRead();
-//    DEBUG() << "locked";
-
-    if (d->query.seek(index)) {
-        for (int i = 0; i < d->roleNames.keys().length(); i++) {
-            ret.insert(QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)), d->query.value(i));
-        }
+    const QVariantList &row = d->rows.at(index);
+    for (int i = 0; i < row.count(); i++) {
+        ret.insert(QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)), row.at(i));
     }
-
-//    DEBUG() << "unlocking";
-    if (m_async) d->lock.unlock();
-//    DEBUG() << "unlocked";
-
     return ret;
 }
 
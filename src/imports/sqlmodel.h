@@ -44,6 +44,15 @@ class SqlModel : public QAbstractListModel, public QQmlParserStatus
     Q_PROPERTY(int count READ count NOTIFY countChanged)
     Q_PROPERTY(bool select READ select WRITE select NOTIFY selectChanged)
     Q_PROPERTY(bool async READ async WRITE async NOTIFY asyncChanged)
+    // shows the last result at once, the live query follows; without async
+    // it runs on the next event loop turn so that the cached rows get painted
+    Q_PROPERTY(bool cache READ cache WRITE cache NOTIFY cacheChanged)
+    Q_PROPERTY(QString cacheVersion READ cacheVersion WRITE cacheVersion NOTIFY cacheVersionChanged)
+    Q_PROPERTY(bool shared READ shared WRITE shared NOTIFY sharedChanged)
+    Q_PROPERTY(int timeout READ timeout WRITE timeout NOTIFY timeoutChanged)
+    Q_PROPERTY(int priority READ priority WRITE priority NOTIFY priorityChanged)
+    Q_PROPERTY(bool materialized READ materialized WRITE materialized NOTIFY materializedChanged)
+    Q_PROPERTY(QString groupKey READ groupKey WRITE groupKey NOTIFY groupKeyChanged)
 
     Q_INTERFACES(QQmlParserStatus)
 public:
@@ -53,6 +62,8 @@ public:
     int timer() const;
     int count() const;
     Q_INVOKABLE QVariantMap get(int index) const;
+    // the plan of the current select, see Database::explain()
+    Q_INVOKABLE QVariantList explain() const;
 
     virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
     virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
@@ -69,9 +80,13 @@ signals:
     void countChanged(int count);
     void selectChanged(bool select);
     void asyncChanged(bool async);
-
-private slots:
-    void updated();
+    void cacheChanged(bool cache);
+    void cacheVersionChanged(const QString &cacheVersion);
+    void sharedChanged(bool shared);
+    void timeoutChanged(int timeout);
+    void priorityChanged(int priority);
+    void materializedChanged(bool materialized);
+    void groupKeyChanged(const QString &groupKey);
 
 private:
     class Private;
@@ -93,6 +108,13 @@ private: \
     ADD_PROPERTY(const QVariantList &, params, QVariantList)
     ADD_PROPERTY(bool, select, bool)
     ADD_PROPERTY(bool, async, bool)
+    ADD_PROPERTY(bool, cache, bool)
+    ADD_PROPERTY(const QString &, cacheVersion, QString)
+    ADD_PROPERTY(bool, shared, bool)
+    ADD_PROPERTY(int, timeout, int)
+    ADD_PROPERTY(int, priority, int)
+    ADD_PROPERTY(bool, materialized, bool)
+    ADD_PROPERTY(const QString &, groupKey, QString)
 
 #undef ADD_PROPERTY
 };
@@ -25,18 +25,108 @@
  */
 
 #include "tablemodel.h"
+#include "blob.h"
 #include "database.h"
+#include "sqliteengine.h"
+#include "tracing.h"
+#include "workerpool.h"
 
+#include <QtCore/QCache>
 #include <QtCore/QDateTime>
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QQueue>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+#include <QtCore/QUrl>
+#include <QtCore/QWaitCondition>
 #include <QtCore/QMetaObject>
 #include <QtCore/QMetaProperty>
+#include <QtCore/QSet>
 #include <QtCore/QStringList>
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlDriver>
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlRecord>
 #include <QtSql/QSqlQuery>
+#include <QtQml/QQmlEngine>
+
+namespace {
+
+// an insert, update or remove planned on the thread of the model, it runs on
+// any connection without touching the model
+struct Write {
+    enum Kind { Insert, Update, Remove };
+    Write() : kind(Insert), ok(false) {}
+    Kind kind;
+    QVariantMap data;
+    QString sql;
+    QVariantList values;
+    // reads an inserted row back by primary key
+    QString selectSql;
+    QString tableName;
+    QString primaryKey;
+    // url columns, streamed once the row exists
+    QMap<QString, QString> files;
+    // indexes into Database::shards, empty without shards
+    QList<int> shards;
+    // results
+    bool ok;
+    QVariant key;
+    QVariantList row;
+};
+
+// shared by the model and the write running on the pool
+struct WriteMailbox {
+    WriteMailbox() : receiver(0), ready(false) {}
+    QMutex mutex;
+    // signalled once write holds the result, see drain()
+    QWaitCondition done;
+    // 0 once the model is gone
+    QObject *receiver;
+    bool ready;
+    Write write;
+};
+
+// prepare and exec time of a buildQuery(), the caller times its fetch
+struct QueryTimes {
+    QueryTimes() : prepare(0), exec(0) {}
+    qint64 prepare;
+    qint64 exec;
+};
+
+// a write on a pool connection, see Database::beginWrite()
+struct OwnWrite {
+    OwnWrite(const Database *database, const QString &tableName) : database(database), tableName(tableName) { database->beginWrite(); }
+    ~OwnWrite() { database->endWrite(tableName); }
+    const Database *database;
+    QString tableName;
+};
+
+// an importFrom() in progress, read and inserted a chunk per pool task
+struct Import {
+    Import() : csv(true), pending(false), rows(0) {}
+    QFile file;
+    QTextStream stream;
+    bool csv;
+    QString tableName;
+    // the columns inserted, their index in a csv record and their types
+    QStringList keys;
+    QList<int> indexes;
+    QList<QVariant::Type> types;
+    // the first json object, read for its keys already
+    QVariantMap object;
+    bool pending;
+    int rows;
+};
+
+}
 
 class TableModel::Private : public QObject
 {
@@ -46,14 +136,93 @@ public:
     ~Private();
     void init();
 
-    QSqlQuery buildQuery(const QString &condition, const QVariantList &params) const;
+    // byKey for lookups by primary key, without the order, limit and offset of the model
+    QString selectSql(const QString &condition, bool withLazy = false, bool perShard = false, bool byKey = false) const;
+    // reports to Tracing::query() without times, with a fetch time of 0
+    QSqlQuery buildQuery(const QString &condition, const QVariantList &params, bool forwardOnly = false, bool withLazy = false, const QSqlDatabase &db = QSqlDatabase(), QueryTimes *times = 0) const;
+    // every connection a write has to go to, the shards or the database itself
+    QList<QSqlDatabase> connections() const;
+    // the shard of row, chosen by its shardKey (or primaryKey) value,
+    // invalid when the row has no such value
+    QSqlDatabase connection(const QVariantMap &row) const;
+    // the shard of the row with key, the shard key is taken from the loaded row
+    QSqlDatabase connectionOf(const QVariant &key) const;
+    // index of that shard, noShard without shards
+    int shardOf(const QVariantMap &row) const;
+    // the row with key, rows held back by coalesce come after data
+    int rowOf(const QVariant &key) const;
+    const QVariantList &rowAt(int row) const;
+    // the only places rows change after a select, they notify views or leave it to flush()
+    void setRow(int row, const QVariantList &values, const QVector<int> &roles);
+    void rowChanged(int row, const QVector<int> &roles);
+    void appendRows(const QList<QVariantList> &rows);
+    // drops the oldest rows beyond maxCount of an appendOnly model
+    void trim();
+    void removeRow(int row);
+    QVariant value(int row, int role);
+    void fetchLazy(int row);
+    int keyColumn() const;
+    // evicted rows keep nothing but their primary key
+    bool isResident(int row) const;
+    QVariant keyAt(int row) const;
+    // brings the evicted rows around row back by primary key
+    void reload(int row);
+    // replaces the rows in [first, last) by their keys
+    void evictRows(int first, int last);
+    Write plan(Write::Kind kind, const QVariantMap &data) const;
+    // the model side of a write that ran
+    void apply(const Write &write);
+    // writes of insertAsync() and friends, one at a time in call order
+    void enqueue(const Write &write, const QJSValue &callback);
+    void next();
+    // finishes the queued writes, a blocking write runs after them
+    void drain();
+    // the rows of the current select through QSqlQuery
+    void fetch();
+    QString upsertSql(const QStringList &keys, const QString &driverName = QString()) const;
+    QString journalName() const;
+    // the journal lives in a single database, false with a warning otherwise
+    bool journalSupported() const;
+    void createJournal(QSqlDatabase db);
+    // name and CREATE INDEX statement of each entry of indexes
+    QList<QPair<QString, QString> > indexSql() const;
+    void createIndexes(bool background);
+    void patch(const QVariantMap &data);
+    // reads the header and imports the rows on the pool, see importChunk()
+    bool importFrom(const QString &fileName, const QString &format);
+    bool exportTo(const QString &fileName, const QString &format);
 //    QString toSql(const QVariant &value);
 
 private slots:
     void databaseChanged(Database *database);
     void openChanged(bool open);
+    void indexReady(const QString &tableName, const QString &name, int msecs);
+    void backfillFinished(const QString &tableName, const QString &column, int rows);
     void create();
     void select();
+    void written();
+    void importProgressed(qint64 bytesRead, qint64 bytesTotal);
+    void imported(bool ok, int rows, qint64 bytesRead, qint64 bytesTotal);
+    // drops the rows far from the last accessed one while over memoryBudget
+    void evict();
+    void tableChanged(const QString &tableName);
+    void externalChanged(const QStringList &tableNames);
+    void flush();
+public slots:
+    // the rows past tailKey of an appendOnly model, a select otherwise
+    void refresh();
+
+public:
+    void create(QSqlDatabase db);
+    QString columnDefinition(const QMetaProperty &property, const QString &propertyName, const QString &type) const;
+    // adds the columns of new properties to an existing table, returns their names
+    QStringList migrate(QSqlDatabase db);
+    // notes a column to backfill in db before it is added
+    bool planBackfill(QSqlDatabase db, const QString &column, const QString &expression);
+    // starts or resumes the backfills of our table noted in db
+    void backfill(QSqlDatabase db, int shard);
+    // registers the tables of the model with database for pollInterval
+    void observe(Database *database);
 
 private:
     TableModel *q;
@@ -61,18 +230,111 @@ private:
     QMap<QString, QString> ifNotExistsMap;
     QMap<QString, QString> autoIncrementMap;
     QMap<QString, QString> primaryKeyMap;
+    QMap<QString, QString> blobTypeMap;
+    QMap<QString, QString> upsertMap;
+    QMap<QString, QString> upsertSetMap;
     QStringList fieldNames;
+    // property values at componentComplete(), the column defaults
+    QHash<QByteArray, QVariant> name2default;
 
 public:
     QList<QVariantList> data;
     QHash<int, QByteArray> roleNames;
     QHash<QByteArray, QVariant::Type> name2type;
+    // columns left out of the bulk select, fetched by primary key on access
+    QStringList lazyFields;
+    QCache<QString, QVariantList> lazyCache;
+    // never selected, streamed through BlobDevice
+    QStringList blobFields;
+    // read only roles from the tables of relations, after the columns
+    QStringList relationFields;
+    QStringList relationColumns;
+    QStringList relationTables;
+    QStringList relationKeys;
+    // the head is on the pool while writing
+    QQueue<Write> writes;
+    QQueue<QJSValue> callbacks;
+    bool writing;
+    quint64 writeTask;
+    QSharedPointer<WriteMailbox> writeMailbox;
+    // approximate bytes of data
+    qint64 residentBytes;
+    qint64 reportedBytes;
+    int recentRow;
+    // the rows before evictFront and from evictBack on are all evicted
+    int evictFront;
+    int evictBack;
+    // held back for coalesce msecs: appended rows, the keys of removed ones
+    // and the range and roles of the changed ones
+    QTimer *coalesceTimer;
+    QList<QVariantList> staged;
+    QSet<QString> removedKeys;
+    int changedFirst;
+    int changedLast;
+    QSet<int> changedRoles;
+    bool allRolesChanged;
+    // the highest primary key loaded by an appendOnly model
+    QVariant tailKey;
+    QPointer<Database> database;
+    // where pollInterval watches our tables
+    QPointer<Database> observing;
+    QStringList observedTables;
 };
 
+// results of Private::shardOf()
+static const int noShard = -1;
+static const int missingShardKey = -2;
+// rows fetched per lazy lookup around the accessed one
+static const int lazyBatch = 64;
+// approximate bytes of lazy values kept in memory
+static const int lazyCacheCost = 16 * 1024 * 1024;
+// rows updated per statement by backfill
+static const int backfillBatchSize = 500;
+// the columns still being backfilled and how far they got, per database file
+static const char *backfillTable = "__database_backfill";
+// rows evicted or reloaded at once
+static const int evictBatch = 256;
+// rows around the last accessed one that are never evicted
+static const int evictWindow = 512;
+
+// tables() keeps the case the table was created with
+static bool hasTable(const QSqlDatabase &db, const QString &tableName)
+{
+    return db.tables().contains(tableName, Qt::CaseInsensitive);
+}
+
+static qint64 rowCost(const QVariantList &row)
+{
+    qint64 ret = sizeof(QVariantList) + row.count() * (sizeof(QVariant) + sizeof(void *));
+    foreach (const QVariant &value, row) {
+        if (value.type() == QVariant::String)
+            ret += value.toString().size() * sizeof(QChar);
+        else if (value.type() == QVariant::ByteArray)
+            ret += value.toByteArray().size();
+    }
+    return ret;
+}
+
 TableModel::Private::Private(TableModel *parent)
     : QObject(parent)
     , q(parent)
+    , lazyCache(lazyCacheCost)
+    , writing(false)
+    , writeTask(0)
+    , writeMailbox(new WriteMailbox)
+    , residentBytes(0)
+    , reportedBytes(0)
+    , recentRow(0)
+    , evictFront(0)
+    , evictBack(0)
+    , coalesceTimer(new QTimer(this))
+    , changedFirst(-1)
+    , changedLast(-1)
+    , allRolesChanged(false)
 {
+    coalesceTimer->setSingleShot(true);
+    connect(coalesceTimer, SIGNAL(timeout()), this, SLOT(flush()));
+    writeMailbox->receiver = this;
     ifNotExistsMap.insert("QSQLITE", " IF NOT EXISTS");
     ifNotExistsMap.insert("QMYSQL", " IF NOT EXISTS");
     ifNotExistsMap.insert("QPSQL", " IF NOT EXISTS");
@@ -82,9 +344,20 @@ TableModel::Private::Private(TableModel *parent)
     primaryKeyMap.insert("QSQLITE", " PRIMARY KEY");
     primaryKeyMap.insert("QMYSQL", " PRIMARY KEY");
     primaryKeyMap.insert("QPSQL", " PRIMARY KEY");
+    blobTypeMap.insert("QSQLITE", " BLOB");
+    blobTypeMap.insert("QMYSQL", " LONGBLOB");
+    blobTypeMap.insert("QPSQL", " BYTEA");
+    upsertMap.insert("QSQLITE", " ON CONFLICT(%1) DO UPDATE SET %2");
+    upsertMap.insert("QMYSQL", " ON DUPLICATE KEY UPDATE %2");
+    upsertMap.insert("QPSQL", " ON CONFLICT(%1) DO UPDATE SET %2");
+    upsertSetMap.insert("QSQLITE", "%1=excluded.%1");
+    upsertSetMap.insert("QMYSQL", "%1=VALUES(%1)");
+    upsertSetMap.insert("QPSQL", "%1=excluded.%1");
 
     connect(q, SIGNAL(databaseChanged(Database*)), this, SLOT(databaseChanged(Database*)));
     connect(q, SIGNAL(selectChanged(bool)), this, SLOT(select()));
+    connect(q, SIGNAL(memoryBudgetChanged(qint64)), this, SLOT(evict()));
+    connect(q, SIGNAL(coalesceChanged(int)), this, SLOT(flush()));
     const QMetaObject *mo = q->metaObject();
     for (int i = 0; i < mo->propertyCount(); i++) {
         QMetaProperty property = mo->property(i);
@@ -95,6 +368,11 @@ TableModel::Private::Private(TableModel *parent)
 
 TableModel::Private::~Private()
 {
+    if (observing)
+        observing->unobserve(observedTables);
+    // a running write still completes, nobody is notified
+    QMutexLocker locker(&writeMailbox->mutex);
+    writeMailbox->receiver = 0;
 }
 
 void TableModel::Private::init()
@@ -114,6 +392,9 @@ void TableModel::Private::init()
             }
             roleNames.insert(Qt::UserRole + j, propertyName);
             fieldNames.append(propertyName);
+            name2default.insert(propertyName, property.read(q));
+            if (property.type() == QVariant::ByteArray || property.type() == QVariant::Url)
+                blobFields.append(propertyName);
             switch (property.type()) {
             case QVariant::Int:
                 name2type.insert(propertyName, QVariant::LongLong);
@@ -125,6 +406,48 @@ void TableModel::Private::init()
 
             j++;
         }
+
+        // {model: users, key: "userId", columns: ["name"]} adds the role users_name
+        foreach (const QVariant &item, q->m_relations) {
+            QVariantMap relation = item.toMap();
+            QString table = relation.value("table").toString();
+            QString foreignKey = relation.value("foreignKey").toString();
+            TableModel *model = qobject_cast<TableModel *>(relation.value("model").value<QObject *>());
+            if (model) {
+                if (table.isEmpty()) table = model->tableName();
+                if (foreignKey.isEmpty()) foreignKey = model->primaryKey();
+            }
+            if (foreignKey.isEmpty()) foreignKey = QStringLiteral("id");
+            QString key = relation.value("key").toString();
+            if (table.isEmpty() || !fieldNames.contains(key)) {
+                qCWarning(lcDatabase) << "relation" << relation << "needs a table and a key column of" << q->tableName();
+                continue;
+            }
+            QString prefix = relation.value("as", table).toString();
+            QString alias = QString("__r%1").arg(relationTables.count());
+            relationTables.append(table);
+            relationKeys.append(key);
+            foreach (const QString &column, relation.value("columns").toStringList()) {
+                QString name = QString("%1_%2").arg(prefix).arg(column);
+                roleNames.insert(Qt::UserRole + j, name.toUtf8());
+                relationFields.append(name);
+                // a primary key lookup per row within the select, no query per delegate
+                relationColumns.append(QString("(SELECT %1.%2 FROM %3 %1 WHERE %1.%4 = %5.%6) AS %7")
+                                       .arg(alias).arg(column).arg(table).arg(foreignKey).arg(q->tableName()).arg(key).arg(name));
+                j++;
+            }
+        }
+    }
+
+    lazyFields.clear();
+    foreach (const QString &field, q->m_lazy) {
+        if (!fieldNames.contains(field)) {
+            qCWarning(lcDatabase) << field << "is not a column of" << q->tableName();
+        } else if (q->m_primaryKey.isEmpty() || field == q->m_primaryKey) {
+            qCWarning(lcDatabase) << field << "can not be lazy without a primary key.";
+        } else {
+            lazyFields.append(field);
+        }
     }
 
     if (!q->m_database) {
@@ -134,9 +457,18 @@ void TableModel::Private::init()
 
 void TableModel::Private::databaseChanged(Database *database)
 {
-    disconnect(this, SLOT(openChanged(bool)));
+    observe(database);
+
+    if (this->database) {
+        disconnect(this->database, 0, this, 0);
+    }
+    this->database = database;
     if (database) {
         connect(database, SIGNAL(openChanged(bool)), this, SLOT(openChanged(bool)));
+        connect(database, SIGNAL(indexReady(QString,QString,int)), this, SLOT(indexReady(QString,QString,int)));
+        connect(database, SIGNAL(backfillFinished(QString,QString,int)), this, SLOT(backfillFinished(QString,QString,int)));
+        connect(database, SIGNAL(tableChanged(QString)), this, SLOT(tableChanged(QString)));
+        connect(database, SIGNAL(externalChanged(QStringList)), this, SLOT(externalChanged(QStringList)));
         openChanged(database->open());
     }
 }
@@ -145,27 +477,56 @@ void TableModel::Private::openChanged(bool open)
 {
     if (open) {
         if (q->tableName().isEmpty()) {
-            qWarning() << "table name is empty.";
+            qCWarning(lcDatabase) << "table name is empty.";
             return;
         }
+        // the table name is known by now
+        observe(q->m_database);
         create();
         select();
     }
 }
 
+void TableModel::Private::observe(Database *database)
+{
+    QStringList tableNames = QStringList() << q->tableName() << relationTables;
+    if (observing.data() == database && observedTables == tableNames) return;
+    if (observing)
+        observing->unobserve(observedTables);
+    observing = database;
+    observedTables = tableNames;
+    if (database)
+        database->observe(observedTables);
+}
+
 void TableModel::Private::create()
 {
     if (fieldNames.isEmpty()) return;
-    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
-    if (db.tables().contains(q->tableName().toLower())) return;
+    // indexes on an empty table are cheap, on an existing one they may take long
+    bool exists = true;
+    QList<QSqlDatabase> dbs = connections();
+    for (int i = 0; i < dbs.count(); i++) {
+        if (!hasTable(dbs.at(i), q->tableName())) {
+            create(dbs.at(i));
+            exists = false;
+        } else {
+            migrate(dbs.at(i));
+            backfill(dbs.at(i), q->m_database->shards().isEmpty() ? -1 : i);
+        }
+    }
+    createIndexes(exists);
+    if (q->m_journal && journalSupported())
+        createJournal(QSqlDatabase::database(q->m_database->connectionName()));
+}
 
+QStringList TableModel::Private::migrate(QSqlDatabase db)
+{
+    QStringList ret;
+    QSqlRecord record = db.record(q->tableName());
     QString type = db.driverName();
 
-    QString sql = QString("CREATE TABLE%2 %1 (").arg(q->tableName()).arg(ifNotExistsMap.value(type));
-
     const QMetaObject *mo = q->metaObject();
-    int start = initialProperties.count();
-    for (int i = start; i < mo->propertyCount(); i++) {
+    for (int i = initialProperties.count(); i < mo->propertyCount(); i++) {
         QMetaProperty property = mo->property(i);
         QString propertyName = QString::fromUtf8(property.name());
         if (propertyName.startsWith('_')) {
@@ -175,388 +536,2308 @@ void TableModel::Private::create()
                 continue;
             }
         }
-        if (i > start)
-            sql.append(QLatin1String(", "));
-        sql.append(propertyName);
-
-        bool isPrimaryKey = (q->m_primaryKey == propertyName);
-
-        switch (property.type()) {
-        case QVariant::Int:
-            if (type == QLatin1String("QPSQL") && isPrimaryKey)
-                sql += QString(" SERIAL");
-            else
-                sql += QString(" INTEGER");
-            break;
-        case QVariant::String:
-            sql += QString(" TEXT");
-            break;
-        case QVariant::Bool:
-            sql += QString(" bool");
-            break;
-        case QVariant::Double:
-            sql += QString(" DOUBLE");
-            break;
-        case QVariant::DateTime:
-            sql += QString(" TIMESTAMP");
-            break;
-        default:
-            qWarning() << property.typeName() << "is not supported.";
-            break;
+        if (record.contains(propertyName)) continue;
+        if (propertyName == q->m_primaryKey) {
+            qCWarning(lcDatabase) << "primary key" << propertyName << "can not be added to" << q->tableName();
+            continue;
         }
 
-        if (isPrimaryKey) {
-            sql += primaryKeyMap.value(type);
-            if (property.type() == QVariant::Int) {
-                sql += autoIncrementMap.value(type);
-            }
-        } else {
-            QVariant value = property.read(q);
-            if (!value.isNull()) {
-                if (property.type() == QVariant::String || property.type() == QVariant::DateTime) {
-                    sql += QString(" DEFAULT '%1'").arg(value.toString());
-                } else {
-                    sql += QString(" DEFAULT %1").arg(value.toString());
-                }
+        // noted first, a column added without it would never be backfilled
+        QString expression = q->m_backfill.value(propertyName).toString();
+        if (!expression.isEmpty() && !planBackfill(db, propertyName, expression)) continue;
+
+        // existing rows get the default, backfill overwrites it afterwards
+        QString sql = QString("ALTER TABLE %1 ADD COLUMN %2%3").arg(q->tableName()).arg(propertyName)
+                .arg(columnDefinition(property, propertyName, type));
+        QSqlQuery query(db);
+        if (!query.exec(sql)) {
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+            if (!expression.isEmpty()) {
+                query.prepare(QString("DELETE FROM %1 WHERE tableName = ? AND columnName = ?").arg(backfillTable));
+                query.addBindValue(q->tableName());
+                query.addBindValue(propertyName);
+                query.exec();
             }
+            continue;
         }
-//        qDebug() << Q_FUNC_INFO << __LINE__ << property.name() << property.typeName() << property.read(q) << property.read(q).isNull();
+        ret.append(propertyName);
     }
+    return ret;
+}
 
-    sql.append(")");
-    if (type == QLatin1String("QPSQL"))
-        sql.append(" WITH oids");
-    QSqlQuery query(sql, db);
-    if (!query.exec()) {
-        qWarning() << Q_FUNC_INFO << __LINE__ << sql << query.lastError().text();
+bool TableModel::Private::planBackfill(QSqlDatabase db, const QString &column, const QString &expression)
+{
+    // doneKey is the last key updated, lastKey the largest one when it started
+    QSqlQuery query(db);
+    QStringList sqls;
+    sqls << QString("CREATE TABLE%1 %2 (tableName VARCHAR(255), columnName VARCHAR(255), expression TEXT, doneKey TEXT, lastKey TEXT, "
+                    "PRIMARY KEY(tableName, columnName))").arg(ifNotExistsMap.value(db.driverName())).arg(backfillTable)
+         << QString("DELETE FROM %1 WHERE tableName = ? AND columnName = ?").arg(backfillTable)
+         << QString("INSERT INTO %1 (tableName, columnName, expression) VALUES (?, ?, ?)").arg(backfillTable);
+    foreach (const QString &sql, sqls) {
+        query.prepare(sql);
+        if (sql.contains(QLatin1Char('?'))) {
+            query.addBindValue(q->tableName());
+            query.addBindValue(column);
+        }
+        if (sql.startsWith(QLatin1String("INSERT")))
+            query.addBindValue(expression);
+        if (!query.exec()) {
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+            return false;
+        }
     }
-//    qDebug() << Q_FUNC_INFO << __LINE__;
+    return true;
 }
 
-QSqlQuery TableModel::Private::buildQuery(const QString &condition, const QVariantList &params) const
+// backfills in progress in this process, by connection, table and column;
+// another model of the same table must not start them a second time
+static QMutex backfillMutex;
+static QSet<QString> backfills;
+
+static void endBackfill(const QString &id)
 {
-//    qDebug() << Q_FUNC_INFO << __LINE__ << condition << params;
-    QSqlQuery ret(QSqlDatabase::database(q->m_database->connectionName()));
-    QString sql = QString("SELECT %2 FROM %1").arg(q->tableName()).arg(fieldNames.isEmpty() ? "*" : fieldNames.join(", "));
-    if (!condition.isEmpty())
-        sql += QString(" WHERE %1").arg(condition);
-    if (!q->m_order.isEmpty())
-        sql += QString(" ORDER BY %1").arg(q->m_order);
-    if (q->m_limit > 0) {
-        sql += QString(" LIMIT %1").arg(q->m_limit);
-        if (q->m_offset > 0) {
-            sql += QString(" OFFSET %1").arg(q->m_offset);
+    QMutexLocker locker(&backfillMutex);
+    backfills.remove(id);
+}
+
+// one short UPDATE per task so that no write lock is held for long and queries
+// of the models get the pool in between. the batches walk the key up to the
+// largest one at the start, the rows inserted later already have their value;
+// a key range instead of UPDATE ... IN (SELECT ... LIMIT n) as MySQL has no
+// LIMIT in subqueries. every batch commits the key it got to along with its
+// rows, a backfill cut short by the end of the process goes on from there
+static void backfillBatch(const Database *database, int shard, const QString &tableName, const QString &column, const QString &expression,
+                          const QString &key, const QVariant &after, const QVariant &last, int rows, const QString &id)
+{
+    database->pool()->submit([=](QSqlDatabase db) {
+        OwnWrite own(database, tableName);
+        QSqlDatabase target = shard < 0 ? db : database->shard(db, shard);
+        QSqlQuery query(target);
+        QString progress = QString("UPDATE %1 SET %2 = ? WHERE tableName = ? AND columnName = ?").arg(backfillTable);
+        QVariant until = last;
+        if (until.isNull()) {
+            QString sql = QString("SELECT MAX(%1) FROM %2").arg(key).arg(tableName);
+            if (!query.exec(sql)) {
+                qCWarning(lcDatabase) << sql << query.lastError().text();
+                endBackfill(id);
+                return;
+            }
+            until = query.next() ? query.value(0) : QVariant();
+            query.finish();
+            // the rows inserted from now on have their value already
+            if (!until.isNull()) {
+                query.prepare(progress.arg(QLatin1String("lastKey")));
+                query.addBindValue(until);
+                query.addBindValue(tableName);
+                query.addBindValue(column);
+                if (!query.exec()) {
+                    qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+                    endBackfill(id);
+                    return;
+                }
+            }
         }
-    }
-    ret.prepare(sql);
-    foreach (const QVariant &val, params) {
-        ret.addBindValue(val);
-    }
 
-    if (!ret.exec()) {
-        qDebug() << Q_FUNC_INFO << __LINE__ << ret.lastError();
-        qDebug() << Q_FUNC_INFO << __LINE__ << ret.lastQuery();
-        qDebug() << Q_FUNC_INFO << __LINE__ << ret.boundValues();
-    }
-//    qDebug() << Q_FUNC_INFO << __LINE__;
-    return ret;
+        QString sql = QString("SELECT %1 FROM %2 WHERE %3%1 <= ? ORDER BY %1 LIMIT %4")
+                .arg(key).arg(tableName).arg(after.isNull() ? QString() : QString("%1 > ? AND ").arg(key)).arg(backfillBatchSize);
+        QVariant first;
+        QVariant next;
+        if (!until.isNull()) {
+            query.prepare(sql);
+            if (!after.isNull())
+                query.addBindValue(after);
+            query.addBindValue(until);
+            if (!query.exec()) {
+                qCWarning(lcDatabase) << sql << query.lastError().text();
+                endBackfill(id);
+                return;
+            }
+            while (query.next()) {
+                if (!first.isValid())
+                    first = query.value(0);
+                next = query.value(0);
+            }
+            query.finish();
+        }
+        if (!first.isValid()) {
+            query.prepare(QString("DELETE FROM %1 WHERE tableName = ? AND columnName = ?").arg(backfillTable));
+            query.addBindValue(tableName);
+            query.addBindValue(column);
+            if (!query.exec())
+                qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+            endBackfill(id);
+            QMetaObject::invokeMethod(const_cast<Database *>(database), "backfillFinished", Qt::QueuedConnection, Q_ARG(QString, tableName), Q_ARG(QString, column), Q_ARG(int, rows));
+            return;
+        }
+
+        // a NULL expression keeps the default
+        sql = QString("UPDATE %1 SET %2 = COALESCE((%3), %2) WHERE %4 BETWEEN ? AND ?")
+                .arg(tableName).arg(column).arg(expression).arg(key);
+        bool transaction = target.transaction();
+        query.prepare(sql);
+        query.addBindValue(first);
+        query.addBindValue(next);
+        bool ok = query.exec();
+        int updated = query.numRowsAffected();
+        if (ok) {
+            query.prepare(progress.arg(QLatin1String("doneKey")));
+            query.addBindValue(next);
+            query.addBindValue(tableName);
+            query.addBindValue(column);
+            ok = query.exec();
+        }
+        if (!ok) {
+            qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+            if (transaction)
+                target.rollback();
+            endBackfill(id);
+            return;
+        }
+        if (transaction && !target.commit()) {
+            qCWarning(lcDatabase) << sql << target.lastError().text();
+            endBackfill(id);
+            return;
+        }
+        backfillBatch(database, shard, tableName, column, expression, key, next, until, rows + qMax(0, updated), id);
+    }, -1);
 }
 
-void TableModel::Private::select()
+void TableModel::Private::backfill(QSqlDatabase db, int shard)
 {
-    if (!q->m_select) return;
-    if (!q->m_database || !q->m_database->open()) return;
+    if (!hasTable(db, QLatin1String(backfillTable))) return;
 
-    if (data.count() > 0) {
-        q->beginRemoveRows(QModelIndex(), 0, data.count() - 1);
-        data.clear();
-        q->endRemoveRows();
+    QString key = q->m_primaryKey;
+    if (key.isEmpty()) {
+        // tables are created WITH oids on PostgreSQL
+        key = db.driverName() == QLatin1String("QPSQL") ? QStringLiteral("oid") : QStringLiteral("rowid");
     }
-    QSqlQuery query = buildQuery(q->m_condition, q->m_params);
-    if (roleNames.isEmpty()) {
-        QSqlRecord record = query.record();
-        for (int i = 0; i < record.count(); i++) {
-            roleNames.insert(i + Qt::UserRole, record.fieldName(i).toUtf8());
-        }
+
+    // the columns added just now and those of a backfill cut short before
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    query.prepare(QString("SELECT columnName, expression, doneKey, lastKey FROM %1 WHERE tableName = ?").arg(backfillTable));
+    query.addBindValue(q->tableName());
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+        return;
     }
     while (query.next()) {
-        QVariantList d;
-        for (int i = 0; i < roleNames.keys().count(); i++) {
-            QVariant v = query.value(i);
-            QByteArray roleName = roleNames.value(i + Qt::UserRole);
-            if (name2type.contains(roleName) && v.type() != name2type.value(roleName)) {
-                v.convert(name2type.value(roleName));
-            }
-            d.append(v);
+        QString column = query.value(0).toString();
+        QString id = QString("%1/%2/%3").arg(db.connectionName()).arg(q->tableName()).arg(column);
+        {
+            QMutexLocker locker(&backfillMutex);
+            if (backfills.contains(id)) continue;
+            backfills.insert(id);
         }
-        data.append(d);
-    }
-    if (data.count() > 0) {
-        q->beginInsertRows(QModelIndex(), 0, data.count() - 1);
-        q->endInsertRows();
+        backfillBatch(q->m_database, shard, q->tableName(), column, query.value(1).toString(), key, query.value(2), query.value(3), 0, id);
     }
-    emit q->countChanged(data.count());
 }
 
-//QString TableModel::Private::toSql(const QVariant &value)
-//{
-//    switch (value.type()) {
-//    case QVariant::Int:
-//        return QString::number(value.toInt());
-//        break;
-//    case QVariant::LongLong:
-//        return QString::number(value.toLongLong());
-//        break;
-//    case QVariant::Double:
-//        return QString::number(value.toDouble());
-//        break;
-//    case QVariant::Bool:
-//        return value.toBool() ? "True" : "False";
-//        break;
-//    case QVariant::String:
-//        return QString("'%1'").arg(value.toString());
-//        break;
-//    case QVariant::DateTime:
-//        // TODO: format
-//        return value.toDateTime().toString("'yyyy-MM-dd hh:mm:ss'");
-//        break;
-//    default:
-//        qDebug() << Q_FUNC_INFO << __LINE__ << value.type() << "is not handled here.";
-//        break;
-//    }
-//    return QString();
-//}
-
-TableModel::TableModel(QObject *parent)
-    : QAbstractListModel(parent)
-    , d(new Private(this))
-    , m_database(0)
-    , m_limit(0)
-    , m_offset(0)
-    , m_select(true)
+void TableModel::Private::backfillFinished(const QString &tableName, const QString &column, int rows)
 {
+    if (tableName != q->tableName()) return;
+    emit q->backfillFinished(column, rows);
+    // the rows on screen still have NULL there
+    select();
 }
 
-void TableModel::classBegin()
+QList<QPair<QString, QString> > TableModel::Private::indexSql() const
 {
+    QList<QPair<QString, QString> > ret;
+    foreach (const QVariant &index, q->m_indexes) {
+        QVariantMap map = index.type() == QVariant::String ? QVariantMap() : index.toMap();
+        QVariant columnsValue = map.isEmpty() ? index : map.value(QStringLiteral("columns"));
+        QStringList columns;
+        foreach (const QString &column, columnsValue.type() == QVariant::String ? columnsValue.toString().split(QLatin1Char(',')) : columnsValue.toStringList()) {
+            if (!column.trimmed().isEmpty())
+                columns.append(column.trimmed());
+        }
+        if (columns.isEmpty()) {
+            qCWarning(lcDatabase) << index << "has no columns.";
+            continue;
+        }
 
+        QString name = map.value(QStringLiteral("name")).toString();
+        if (name.isEmpty())
+            name = QString("idx_%1_%2").arg(q->tableName()).arg(columns.join(QLatin1String("_")).remove(QLatin1Char(' ')));
+        QString sql = QString("CREATE %1INDEX IF NOT EXISTS %2 ON %3(%4)")
+                .arg(map.value(QStringLiteral("unique")).toBool() ? QLatin1String("UNIQUE ") : QLatin1String(""))
+                .arg(name).arg(q->tableName()).arg(columns.join(QLatin1String(", ")));
+        QString where = map.value(QStringLiteral("where")).toString();
+        if (!where.isEmpty())
+            sql += QString(" WHERE %1").arg(where);
+        ret.append(qMakePair(name, sql));
+    }
+    return ret;
 }
 
-void TableModel::componentComplete()
+void TableModel::Private::createIndexes(bool background)
 {
-    d->init();
-}
+    QList<QPair<QString, QString> > indexes = indexSql();
+    if (indexes.isEmpty()) return;
 
-QHash<int, QByteArray> TableModel::roleNames() const
-{
-    return d->roleNames;
+    if (!background) {
+        foreach (QSqlDatabase db, connections()) {
+            QSqlQuery query(db);
+            for (int i = 0; i < indexes.count(); i++) {
+                QElapsedTimer timer;
+                timer.start();
+                if (!query.exec(indexes.at(i).second))
+                    qCWarning(lcDatabase) << indexes.at(i).second << query.lastError().text();
+                else
+                    emit q->indexReady(indexes.at(i).first, timer.elapsed());
+            }
+        }
+        return;
+    }
+
+    // IF NOT EXISTS makes the existing ones cheap, the others are built on the
+    // pool and reported through Database::indexReady()
+    const Database *database = q->m_database;
+    QString tableName = q->tableName();
+    int shards = database->shards().count();
+    for (int shard = shards > 0 ? 0 : -1; shard < shards; shard++) {
+        for (int i = 0; i < indexes.count(); i++) {
+            QString name = indexes.at(i).first;
+            QString sql = indexes.at(i).second;
+            database->pool()->submit([database, tableName, shard, name, sql](QSqlDatabase db) {
+                QElapsedTimer timer;
+                timer.start();
+                QSqlQuery query(shard < 0 ? db : database->shard(db, shard));
+                if (!query.exec(sql)) {
+                    qCWarning(lcDatabase) << sql << query.lastError().text();
+                    return;
+                }
+                QMetaObject::invokeMethod(const_cast<Database *>(database), "indexReady", Qt::QueuedConnection, Q_ARG(QString, tableName), Q_ARG(QString, name), Q_ARG(int, int(timer.elapsed())));
+            }, -1);
+        }
+    }
 }
 
-int TableModel::rowCount(const QModelIndex &parent) const
+void TableModel::Private::indexReady(const QString &tableName, const QString &name, int msecs)
 {
-    return d->data.count();
+    if (tableName == q->tableName())
+        emit q->indexReady(name, msecs);
 }
 
-QVariant TableModel::data(const QModelIndex &index, int role) const
+QString TableModel::Private::journalName() const
 {
-    if (role >= Qt::UserRole) {
-        return d->data.at(index.row()).at(role - Qt::UserRole);
-    }
-    return QVariant();
+    return QString("%1__journal").arg(q->tableName());
 }
 
-int TableModel::count() const
+bool TableModel::Private::journalSupported() const
 {
-    return rowCount();
+    if (!q->m_database) return false;
+    if (q->m_database->shards().isEmpty()) return true;
+    qCWarning(lcDatabase) << "journal is not supported for sharded databases.";
+    return false;
 }
 
-QVariantMap TableModel::get(int index) const
+// seq orders the changes, key is the primary key of the row, op is insert,
+// update or delete and columns lists the columns an update changed
+void TableModel::Private::createJournal(QSqlDatabase db)
 {
-    QVariantMap ret;
-    QVariantList list = d->data.at(index);
-    for (int i = 0; i < list.length(); i++) {
-//        qDebug() << Q_FUNC_INFO << __LINE__ << i << QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)) << list.at(i);
-        ret.insert(QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)), list.at(i));
+    if (db.driverName() != QLatin1String("QSQLITE")) {
+        qCWarning(lcDatabase) << "journal needs triggers of QSQLITE.";
+        return;
+    }
+    if (q->m_primaryKey.isEmpty()) {
+        qCWarning(lcDatabase) << "journal needs a primary key.";
+        return;
     }
-    return ret;
-}
 
-QVariant TableModel::insert(const QVariantMap &data)
-{
-    QVariant ret;
-    QStringList keys;
-    QStringList placeHolders;
-    QVariantMap values;
-    foreach (const QByteArray &r, d->roleNames.values()) {
-        QString field = QString::fromUtf8(r);
-        if (data.contains(field)) {
-            keys.append(field);
-            placeHolders.append(QString(":%1").arg(field));
-            values.insert(QString(":%1").arg(field), data.value(field));
+    QStringList changed;
+    foreach (const QString &field, fieldNames) {
+        if (field != q->m_primaryKey)
+            changed.append(QString("CASE WHEN OLD.%1 IS NOT NEW.%1 THEN '%1,' ELSE '' END").arg(field));
+    }
+    QString journal = journalName();
+    QString table = q->tableName();
+    QString pk = q->m_primaryKey;
+    QStringList sqls;
+    sqls << QString("CREATE TABLE IF NOT EXISTS %1 (seq INTEGER PRIMARY KEY AUTOINCREMENT, key, op TEXT, columns TEXT)").arg(journal)
+         << QString("CREATE TRIGGER IF NOT EXISTS %1_insert AFTER INSERT ON %2 BEGIN INSERT INTO %1(key, op) VALUES(NEW.%3, 'insert'); END").arg(journal).arg(table).arg(pk)
+         << QString("CREATE TRIGGER IF NOT EXISTS %1_update AFTER UPDATE ON %2 BEGIN INSERT INTO %1(key, op, columns) VALUES(NEW.%3, 'update', rtrim(%4, ',')); END").arg(journal).arg(table).arg(pk).arg(changed.isEmpty() ? QString("''") : changed.join(" || "))
+         << QString("CREATE TRIGGER IF NOT EXISTS %1_delete AFTER DELETE ON %2 BEGIN INSERT INTO %1(key, op) VALUES(OLD.%3, 'delete'); END").arg(journal).arg(table).arg(pk);
+    QSqlQuery query(db);
+    foreach (const QString &sql, sqls) {
+        if (!query.exec(sql)) {
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+            return;
         }
     }
+}
 
-    QSqlDatabase db = QSqlDatabase::database(m_database->connectionName());
-    QSqlQuery query(db);
-    if (!query.prepare(QString("INSERT INTO %1(%2) VALUES(%3)").arg(tableName()).arg(keys.join(", ")).arg(placeHolders.join(", ")))) {
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.lastQuery() << query.lastError().text();
-        return false;
+// type, key and default of a column for property, as in CREATE TABLE
+QString TableModel::Private::columnDefinition(const QMetaProperty &property, const QString &propertyName, const QString &type) const
+{
+    QString ret;
+    bool isPrimaryKey = (q->m_primaryKey == propertyName);
+
+    switch (property.type()) {
+    case QVariant::Int:
+        if (type == QLatin1String("QPSQL") && isPrimaryKey)
+            ret += QString(" SERIAL");
+        else
+            ret += QString(" INTEGER");
+        break;
+    case QVariant::String:
+        ret += QString(" TEXT");
+        break;
+    case QVariant::Bool:
+        ret += QString(" bool");
+        break;
+    case QVariant::Double:
+        ret += QString(" DOUBLE");
+        break;
+    case QVariant::DateTime:
+        ret += QString(" TIMESTAMP");
+        break;
+    case QVariant::ByteArray:
+    case QVariant::Url:
+        ret += blobTypeMap.value(type);
+        break;
+    default:
+        qCWarning(lcDatabase) << property.typeName() << "is not supported.";
+        break;
     }
-    foreach (const QString &key, values.keys()) {
-        query.bindValue(key, values.value(key));
-    }
-
-    if (query.exec()) {
-        if (!m_primaryKey.isEmpty()) {
-            QString condition;
-            QVariantList params;
-            condition = QString("%1=?").arg(m_primaryKey);
-            params.append(query.lastInsertId());
-
-//            qDebug() << Q_FUNC_INFO << __LINE__ << sql << query.lastInsertId() << db.driver()->hasFeature(QSqlDriver::LastInsertId);
-            QSqlQuery query2 = d->buildQuery(condition, params);
-            if (query2.first()) {
-                int row = rowCount();
-                beginInsertRows(QModelIndex(), row, row);
-                QVariantList v;
-                for (int i = 0; i < d->roleNames.keys().count(); i++) {
-//                    qDebug() << Q_FUNC_INFO << __LINE__ << i << d->roleNames.value(Qt::UserRole + i) << d->primaryKey;
-                    if (d->roleNames.value(Qt::UserRole + i) == m_primaryKey) {
-                        ret = query2.value(i);
-                    }
-                    v.append(query2.value(i));
-                }
-                d->data.append(v);
-                endInsertRows();
-                emit countChanged(d->data.count());
+
+    if (isPrimaryKey) {
+        ret += primaryKeyMap.value(type);
+        if (property.type() == QVariant::Int) {
+            ret += autoIncrementMap.value(type);
+        }
+    } else if (!blobFields.contains(propertyName)) {
+        QVariant value = property.read(q);
+        if (!value.isNull()) {
+            if (property.type() == QVariant::String || property.type() == QVariant::DateTime) {
+                ret += QString(" DEFAULT '%1'").arg(value.toString());
             } else {
-                qWarning() << Q_FUNC_INFO << __LINE__ << query2.lastError().text() << query2.lastQuery() << query2.boundValues();
+                ret += QString(" DEFAULT %1").arg(value.toString());
             }
         }
-    } else {
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.lastQuery() << query.boundValues() << query.lastError().text();
     }
     return ret;
 }
 
-void TableModel::update(const QVariantMap &data)
+void TableModel::Private::create(QSqlDatabase db)
 {
-    QStringList sets;
-    QVariantList values;
-    QString where;
+    QString type = db.driverName();
 
-    int keyRole = -1;
-    QVariant key;
+    QString sql = QString("CREATE TABLE%2 %1 (").arg(q->tableName()).arg(ifNotExistsMap.value(type));
 
-    foreach (int i, d->roleNames.keys()) {
-        QString field = QString::fromUtf8(d->roleNames.value(i));
-        if (data.contains(field)) {
-            QVariant value = data.value(field);
-            if (field == m_primaryKey) {
-                keyRole = i;
-                key = value;
-                where = QString(" WHERE %1=?").arg(field);
-            } else {
-                sets.append(QString("%1=?").arg(field));
-                values.append(value);
+    const QMetaObject *mo = q->metaObject();
+    int start = initialProperties.count();
+    for (int i = start; i < mo->propertyCount(); i++) {
+        QMetaProperty property = mo->property(i);
+        QString propertyName = QString::fromUtf8(property.name());
+        if (propertyName.startsWith('_')) {
+            propertyName.remove(0, 1);
+            if (propertyName.startsWith('_')) {
+                // __name should be used for private properties
+                continue;
             }
         }
+        if (i > start)
+            sql.append(QLatin1String(", "));
+        sql.append(propertyName);
+
+        sql += columnDefinition(property, propertyName, type);
+//        qDebug() << Q_FUNC_INFO << __LINE__ << property.name() << property.typeName() << property.read(q) << property.read(q).isNull();
     }
-    values.append(key);
 
-    QSqlDatabase db = QSqlDatabase::database(m_database->connectionName());
+    sql.append(")");
+    if (type == QLatin1String("QPSQL"))
+        sql.append(" WITH oids");
+    QSqlQuery query(sql, db);
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << sql << query.lastError().text();
+    }
+//    qDebug() << Q_FUNC_INFO << __LINE__;
+}
+
+QString TableModel::Private::selectSql(const QString &condition, bool withLazy, bool perShard, bool byKey) const
+{
+    QStringList columns;
+    foreach (const QString &field, fieldNames) {
+        // keep the column positions, the values are fetched on access
+        if (blobFields.contains(field) || (!withLazy && lazyFields.contains(field)))
+            columns.append(QString("NULL AS %1").arg(field));
+        else
+            columns.append(field);
+    }
+    if (!columns.isEmpty())
+        columns.append(relationColumns);
+    QString sql = QString("SELECT %2 FROM %1").arg(q->tableName()).arg(columns.isEmpty() ? "*" : columns.join(", "));
+    if (!condition.isEmpty())
+        sql += QString(" WHERE %1").arg(condition);
+    if (byKey) return sql;
+    if (q->m_appendOnly && !q->m_primaryKey.isEmpty() && !perShard) {
+        // ascending by key, only the newest maxCount rows
+        if (q->m_maxCount <= 0)
+            return sql + QString(" ORDER BY %1").arg(q->m_primaryKey);
+        return QString("SELECT * FROM (%1 ORDER BY %2 DESC LIMIT %3) AS __tail ORDER BY %2").arg(sql).arg(q->m_primaryKey).arg(q->m_maxCount);
+    }
+    if (!q->m_order.isEmpty())
+        sql += QString(" ORDER BY %1").arg(q->m_order);
+    if (q->m_limit > 0 && perShard) {
+        // the offset is applied to the merged rows
+        sql += QString(" LIMIT %1").arg(q->m_limit + q->m_offset);
+    } else if (q->m_limit > 0) {
+        sql += QString(" LIMIT %1").arg(q->m_limit);
+        if (q->m_offset > 0) {
+            sql += QString(" OFFSET %1").arg(q->m_offset);
+        }
+    }
+    return sql;
+}
+
+QSqlQuery TableModel::Private::buildQuery(const QString &condition, const QVariantList &params, bool forwardOnly, bool withLazy, const QSqlDatabase &db, QueryTimes *times) const
+{
+//    qDebug() << Q_FUNC_INFO << __LINE__ << condition << params;
+    QSqlQuery ret(db.isValid() ? db : QSqlDatabase::database(q->m_database->connectionName()));
+    ret.setForwardOnly(forwardOnly);
+    QString sql = selectSql(condition, withLazy);
+    qint64 start = Tracing::now();
+    ret.prepare(sql);
+    foreach (const QVariant &val, params) {
+        ret.addBindValue(val);
+    }
+    qint64 prepared = Tracing::now();
+
+    if (!ret.exec()) {
+        qCWarning(lcDatabase) << ret.lastError() << ret.lastQuery() << ret.boundValues();
+    }
+    qint64 executed = Tracing::now();
+    if (Tracing::isEnabled()) {
+        Tracing::record("sql", "prepare", start, prepared, sql);
+        Tracing::record("sql", "exec", prepared, executed, sql);
+    }
+    if (times) {
+        times->prepare = prepared - start;
+        times->exec = executed - prepared;
+    } else {
+        Tracing::query(sql, params, prepared - start, executed - prepared, 0);
+    }
+//    qDebug() << Q_FUNC_INFO << __LINE__;
+    return ret;
+}
+
+// INSERT which updates the row with the same primary key instead of failing
+QString TableModel::Private::upsertSql(const QStringList &keys, const QString &driverName) const
+{
+    QString type = driverName;
+    if (type.isEmpty())
+        type = QSqlDatabase::database(q->m_database->connectionName()).driverName();
+    if (!upsertMap.contains(type)) {
+        qCWarning(lcDatabase) << type << "does not support upsert.";
+        return QString();
+    }
+
+    QStringList placeHolders;
+    QStringList sets;
+    foreach (const QString &key, keys) {
+        placeHolders.append(QLatin1String("?"));
+        if (key != q->m_primaryKey)
+            sets.append(upsertSetMap.value(type).arg(key));
+    }
+    QString ret = QString("INSERT INTO %1(%2) VALUES(%3)").arg(q->tableName()).arg(keys.join(", ")).arg(placeHolders.join(", "));
+    if (sets.isEmpty()) {
+        // nothing to update, keep the existing row
+        if (type == QLatin1String("QMYSQL"))
+            sets.append(QString("%1=%1").arg(q->m_primaryKey));
+        else
+            return ret + QString(" ON CONFLICT(%1) DO NOTHING").arg(q->m_primaryKey);
+    }
+    return ret + upsertMap.value(type).arg(q->m_primaryKey).arg(sets.join(", "));
+}
+
+// applies an upserted row to data, the statement succeeded so no reselect is needed
+void TableModel::Private::patch(const QVariantMap &values)
+{
+    int keyRole = roleNames.key(q->m_primaryKey.toUtf8(), -1);
+    if (keyRole < 0) return;
+    QVariant key = values.value(q->m_primaryKey);
+    QByteArray keyName = q->m_primaryKey.toUtf8();
+    if (name2type.contains(keyName))
+        key.convert(name2type.value(keyName));
+
+    int i = rowOf(key);
+    if (i >= 0) {
+        // reloaded with the new values on access
+        if (i < data.count() && !isResident(i)) return;
+
+        QVariantList newData = rowAt(i);
+        QVector<int> roles;
+        foreach (int j, roleNames.keys()) {
+            QString field = QString::fromUtf8(roleNames.value(j));
+            if (j == keyRole || !values.contains(field) || relationFields.contains(field)) continue;
+            if (lazyFields.contains(field)) {
+                lazyCache.remove(key.toString());
+                roles.append(j);
+                continue;
+            }
+            QVariant value = values.value(field);
+            if (name2type.contains(roleNames.value(j)))
+                value.convert(name2type.value(roleNames.value(j)));
+            newData[j - Qt::UserRole] = value;
+            roles.append(j);
+        }
+        if (!roles.isEmpty())
+            setRow(i, newData, roles);
+        return;
+    }
+
+    // a new row, the columns not given have their defaults
+    lazyCache.remove(key.toString());
+    QVariantList newData;
+    for (int j = 0; j < roleNames.count(); j++) {
+        QByteArray roleName = roleNames.value(Qt::UserRole + j);
+        QString field = QString::fromUtf8(roleName);
+        QVariant value = values.contains(field) ? values.value(field) : name2default.value(roleName);
+        if (lazyFields.contains(field))
+            value = QVariant();
+        if (name2type.contains(roleName))
+            value.convert(name2type.value(roleName));
+        newData.append(value);
+    }
+    appendRows(QList<QVariantList>() << newData);
+}
+
+int TableModel::Private::rowOf(const QVariant &key) const
+{
+    if (!removedKeys.contains(key.toString())) {
+        for (int i = 0; i < data.count(); i++) {
+            if (keyAt(i) == key) return i;
+        }
+    }
+    int column = keyColumn();
+    for (int i = 0; i < staged.count() && column >= 0; i++) {
+        if (staged.at(i).at(column) == key) return data.count() + i;
+    }
+    return -1;
+}
+
+const QVariantList &TableModel::Private::rowAt(int row) const
+{
+    return row < data.count() ? data.at(row) : staged.at(row - data.count());
+}
+
+void TableModel::Private::setRow(int row, const QVariantList &values, const QVector<int> &roles)
+{
+    // announced with its insert
+    if (row >= data.count()) {
+        staged[row - data.count()] = values;
+        return;
+    }
+    residentBytes += rowCost(values) - rowCost(data.at(row));
+    data[row] = values;
+    rowChanged(row, roles);
+}
+
+void TableModel::Private::rowChanged(int row, const QVector<int> &roles)
+{
+    if (q->m_coalesce <= 0) {
+        emit q->dataChanged(q->index(row), q->index(row), roles);
+        return;
+    }
+    changedFirst = changedFirst < 0 ? row : qMin(changedFirst, row);
+    changedLast = qMax(changedLast, row);
+    if (roles.isEmpty())
+        allRolesChanged = true;
+    foreach (int role, roles) {
+        changedRoles.insert(role);
+    }
+    if (!coalesceTimer->isActive())
+        coalesceTimer->start(q->m_coalesce);
+}
+
+static int compare(const QVariant &a, const QVariant &b);
+
+void TableModel::Private::appendRows(const QList<QVariantList> &rows)
+{
+    if (rows.isEmpty()) return;
+    int column = keyColumn();
+    if (q->m_appendOnly && column >= 0) {
+        foreach (const QVariantList &values, rows) {
+            if (!tailKey.isValid() || compare(values.at(column), tailKey) > 0)
+                tailKey = values.at(column);
+        }
+    }
+
+    if (q->m_coalesce > 0) {
+        staged.append(rows);
+        if (!coalesceTimer->isActive())
+            coalesceTimer->start(q->m_coalesce);
+        return;
+    }
+    int row = data.count();
+    q->beginInsertRows(QModelIndex(), row, row + rows.count() - 1);
+    foreach (const QVariantList &values, rows) {
+        residentBytes += rowCost(values);
+    }
+    data.append(rows);
+    q->endInsertRows();
+    evictBack = data.count();
+    trim();
+    emit q->countChanged(data.count());
+    evict();
+}
+
+void TableModel::Private::trim()
+{
+    if (!q->m_appendOnly || q->m_maxCount <= 0) return;
+    int excess = data.count() - q->m_maxCount;
+    if (excess <= 0) return;
+
+    q->beginRemoveRows(QModelIndex(), 0, excess - 1);
+    for (int i = 0; i < excess; i++) {
+        residentBytes -= rowCost(data.at(i));
+        lazyCache.remove(keyAt(i).toString());
+    }
+    data.erase(data.begin(), data.begin() + excess);
+    q->endRemoveRows();
+    evictFront = qMax(0, evictFront - excess);
+    evictBack = qMax(0, evictBack - excess);
+    recentRow = qMax(0, recentRow - excess);
+    if (changedFirst >= 0) {
+        changedFirst = qMax(0, changedFirst - excess);
+        changedLast -= excess;
+        if (changedLast < 0)
+            changedFirst = changedLast = -1;
+    }
+}
+
+void TableModel::Private::refresh()
+{
+    if (!q->m_database || !q->m_database->open()) return;
+    if (!q->m_appendOnly || !tailKey.isValid() || keyColumn() < 0 || !q->m_database->shards().isEmpty()) {
+        select();
+        return;
+    }
+
+    TraceScope trace("sql", "TableModel::refresh");
+    QString condition = QString("%1 > ?").arg(q->m_primaryKey);
+    if (!q->m_condition.isEmpty())
+        condition = QString("(%1) AND %2").arg(q->m_condition).arg(condition);
+    QVariantList params = q->m_params;
+    params.append(tailKey);
+
+    QueryTimes times;
+    QSqlQuery query = buildQuery(condition, params, true, false, QSqlDatabase(), &times);
+    qint64 start = Tracing::now();
+    QList<QVariantList> rows;
+    while (query.next()) {
+        QVariantList values;
+        for (int i = 0; i < roleNames.count(); i++) {
+            QVariant v = query.value(i);
+            QByteArray roleName = roleNames.value(i + Qt::UserRole);
+            if (name2type.contains(roleName) && v.type() != name2type.value(roleName))
+                v.convert(name2type.value(roleName));
+            values.append(v);
+        }
+        rows.append(values);
+    }
+    Tracing::query(query.lastQuery(), params, times.prepare, times.exec, Tracing::now() - start);
+    appendRows(rows);
+}
+
+void TableModel::Private::removeRow(int row)
+{
+    if (row >= data.count()) {
+        staged.removeAt(row - data.count());
+        return;
+    }
+    if (q->m_coalesce > 0) {
+        // stays visible until the flush
+        removedKeys.insert(keyAt(row).toString());
+        if (!coalesceTimer->isActive())
+            coalesceTimer->start(q->m_coalesce);
+        return;
+    }
+    residentBytes -= rowCost(data.at(row));
+    if (row < evictFront) evictFront--;
+    if (row < evictBack) evictBack--;
+    q->beginRemoveRows(QModelIndex(), row, row);
+    data.removeAt(row);
+    q->endRemoveRows();
+    emit q->countChanged(data.count());
+}
+
+// the changes held back by coalesce as one range each
+void TableModel::Private::flush()
+{
+    coalesceTimer->stop();
+    int count = data.count();
+
+    if (changedFirst >= 0) {
+        QVector<int> roles;
+        if (!allRolesChanged)
+            roles = changedRoles.toList().toVector();
+        emit q->dataChanged(q->index(changedFirst), q->index(changedLast), roles);
+        changedFirst = -1;
+        changedLast = -1;
+        changedRoles.clear();
+        allRolesChanged = false;
+    }
+
+    if (!removedKeys.isEmpty()) {
+        // contiguous runs from the end, the rows before keep their indexes
+        for (int i = data.count() - 1; i >= 0; i--) {
+            if (!removedKeys.contains(keyAt(i).toString())) continue;
+            int last = i;
+            while (i > 0 && removedKeys.contains(keyAt(i - 1).toString()))
+                i--;
+            q->beginRemoveRows(QModelIndex(), i, last);
+            for (int j = last; j >= i; j--) {
+                residentBytes -= rowCost(data.at(j));
+                data.removeAt(j);
+            }
+            evictFront -= qMax(0, qMin(evictFront, last + 1) - i);
+            evictBack -= qMax(0, qMin(evictBack, last + 1) - i);
+            q->endRemoveRows();
+        }
+        removedKeys.clear();
+    }
+
+    if (!staged.isEmpty()) {
+        int row = data.count();
+        q->beginInsertRows(QModelIndex(), row, row + staged.count() - 1);
+        foreach (const QVariantList &values, staged) {
+            residentBytes += rowCost(values);
+        }
+        data.append(staged);
+        staged.clear();
+        q->endInsertRows();
+        evictBack = data.count();
+        trim();
+    }
+
+    if (data.count() != count)
+        emit q->countChanged(data.count());
+    evict();
+}
+
+QList<QSqlDatabase> TableModel::Private::connections() const
+{
+    QList<QSqlDatabase> ret;
+    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    int count = q->m_database->shards().count();
+    if (count == 0) {
+        ret.append(db);
+    }
+    for (int i = 0; i < count; i++) {
+        ret.append(q->m_database->shard(db, i));
+    }
+    return ret;
+}
+
+QSqlDatabase TableModel::Private::connection(const QVariantMap &row) const
+{
+    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    int shard = shardOf(row);
+    if (shard == noShard) return db;
+    if (shard == missingShardKey) return QSqlDatabase();
+    return q->m_database->shard(db, shard);
+}
+
+QSqlDatabase TableModel::Private::connectionOf(const QVariant &key) const
+{
+    QVariantMap row;
+    row.insert(q->m_primaryKey, key);
+    QString shardKey = q->m_shardKey;
+    if (!q->m_database->shards().isEmpty() && !shardKey.isEmpty() && shardKey != q->m_primaryKey) {
+        int i = keyColumn() < 0 ? -1 : rowOf(key);
+        int column = roleNames.key(shardKey.toUtf8(), Qt::UserRole - 1) - Qt::UserRole;
+        if (i >= 0 && column >= 0)
+            row.insert(shardKey, rowAt(i).at(column));
+    }
+    return connection(row);
+}
+
+// FNV-1a, unlike qHash() it does not change from one process to the next
+static quint32 stableHash(const QByteArray &bytes)
+{
+    quint32 ret = 2166136261u;
+    foreach (char c, bytes) {
+        ret ^= quint8(c);
+        ret *= 16777619u;
+    }
+    return ret;
+}
+
+int TableModel::Private::shardOf(const QVariantMap &row) const
+{
+    int count = q->m_database->shards().count();
+    if (count == 0) return noShard;
+
+    QString key = q->m_shardKey.isEmpty() ? q->m_primaryKey : q->m_shardKey;
+    if (row.value(key).isNull()) {
+        qCWarning(lcDatabase) << key << "is required to find the shard of" << row;
+        return missingShardKey;
+    }
+    return stableHash(row.value(key).toString().toUtf8()) % count;
+}
+
+// SQLite order: NULL first, then numbers, then text
+static int compare(const QVariant &a, const QVariant &b)
+{
+    if (a.isNull() || b.isNull())
+        return int(b.isNull()) - int(a.isNull());
+    switch (a.type()) {
+    case QVariant::Bool:
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+    case QVariant::Double: {
+        double x = a.toDouble();
+        double y = b.toDouble();
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    case QVariant::DateTime: {
+        QDateTime x = a.toDateTime();
+        QDateTime y = b.toDateTime();
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    default:
+        return a.toString().compare(b.toString());
+    }
+}
+
+// k-way merge of rows sorted by order on every shard; terms of order that are
+// not a plain column name can not be compared here and are left out
+static QList<QVariantList> merge(const QList<QList<QVariantList> > &shards, const QString &order, const QHash<int, QByteArray> &roleNames, int offset, int limit)
+{
+    QList<QPair<int, bool> > keys;
+    foreach (const QString &term, order.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        QStringList words = term.simplified().split(QLatin1Char(' '));
+        int role = roleNames.key(words.first().toUtf8(), -1);
+        if (role < 0) {
+            qCWarning(lcDatabase) << term << "can not be merged across shards.";
+            continue;
+        }
+        bool descending = words.count() > 1 && words.at(1).compare(QLatin1String("DESC"), Qt::CaseInsensitive) == 0;
+        keys.append(qMakePair(role - Qt::UserRole, descending));
+    }
+
+    QList<QVariantList> ret;
+    QVector<int> heads(shards.count(), 0);
+    int skipped = 0;
+    forever {
+        if (limit > 0 && ret.count() >= limit) break;
+        int next = -1;
+        for (int i = 0; i < shards.count(); i++) {
+            if (heads.at(i) >= shards.at(i).count()) continue;
+            if (next < 0) {
+                next = i;
+                continue;
+            }
+            const QVariantList &a = shards.at(i).at(heads.at(i));
+            const QVariantList &b = shards.at(next).at(heads.at(next));
+            for (int k = 0; k < keys.count(); k++) {
+                int c = compare(a.value(keys.at(k).first), b.value(keys.at(k).first));
+                if (keys.at(k).second) c = -c;
+                if (c < 0) next = i;
+                if (c != 0) break;
+            }
+        }
+        if (next < 0) break;
+        const QVariantList &row = shards.at(next).at(heads[next]++);
+        if (skipped < offset)
+            skipped++;
+        else
+            ret.append(row);
+    }
+    return ret;
+}
+
+// the value of role in row, lazy columns come from lazyCache
+QVariant TableModel::Private::value(int row, int role)
+{
+    recentRow = row;
+    if (!isResident(row)) {
+        reload(row);
+        evict();
+    }
+    const QVariantList &values = data.at(row);
+    QString field = QString::fromUtf8(roleNames.value(role));
+    int keyRole = roleNames.key(q->m_primaryKey.toUtf8(), -1);
+    if (blobFields.contains(field)) {
+        if (keyRole < 0) return QVariant();
+        return BlobDevice::url(q->m_database->connectionName(), q->tableName(), field, q->m_primaryKey, values.at(keyRole - Qt::UserRole));
+    }
+    int column = lazyFields.indexOf(field);
+    if (column < 0) return values.at(role - Qt::UserRole);
+
+    QString key = values.at(keyRole - Qt::UserRole).toString();
+    if (!lazyCache.contains(key))
+        fetchLazy(row);
+    QVariantList *lazyValues = lazyCache.object(key);
+    return lazyValues ? lazyValues->value(column) : QVariant();
+}
+
+// one lookup for the rows around row, views ask for neighbours next
+void TableModel::Private::fetchLazy(int row)
+{
+    TraceScope trace("sql", "TableModel::fetchLazy");
+    int first = qMax(0, row - lazyBatch / 4);
+    int last = qMin(data.count(), first + lazyBatch);
+
+    QStringList placeHolders;
+    QVariantList params;
+    for (int i = first; i < last; i++) {
+        QVariant key = keyAt(i);
+        if (i != row && lazyCache.contains(key.toString())) continue;
+        placeHolders.append(QLatin1String("?"));
+        params.append(key);
+    }
+
+    // the keys do not tell the shard when shardKey is another column, ask each
+    QString sql = QString("SELECT %1, %2 FROM %3 WHERE %1 IN (%4)").arg(q->m_primaryKey).arg(lazyFields.join(", ")).arg(q->tableName()).arg(placeHolders.join(", "));
+    QSet<QString> found;
+    foreach (const QSqlDatabase &db, connections()) {
+        QSqlQuery query(db);
+        query.setForwardOnly(true);
+        query.prepare(sql);
+        foreach (const QVariant &param, params) {
+            query.addBindValue(param);
+        }
+        if (!query.exec()) {
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+            return;
+        }
+
+        while (query.next()) {
+            QVariantList *values = new QVariantList;
+            int cost = 1;
+            for (int i = 0; i < lazyFields.count(); i++) {
+                QVariant v = query.value(i + 1);
+                QByteArray name = lazyFields.at(i).toUtf8();
+                if (name2type.contains(name) && v.type() != name2type.value(name))
+                    v.convert(name2type.value(name));
+                if (v.type() == QVariant::String)
+                    cost += v.toString().size() * sizeof(QChar);
+                else if (v.type() == QVariant::ByteArray)
+                    cost += v.toByteArray().size();
+                values->append(v);
+            }
+            QString key = query.value(0).toString();
+            found.insert(key);
+            lazyCache.insert(key, values, cost);
+        }
+    }
+    // deleted meanwhile, do not look them up again
+    foreach (const QVariant &param, params) {
+        if (!found.contains(param.toString()))
+            lazyCache.insert(param.toString(), new QVariantList);
+    }
+}
+
+int TableModel::Private::keyColumn() const
+{
+    return roleNames.key(q->m_primaryKey.toUtf8(), Qt::UserRole - 1) - Qt::UserRole;
+}
+
+bool TableModel::Private::isResident(int row) const
+{
+    return data.at(row).count() == roleNames.count();
+}
+
+QVariant TableModel::Private::keyAt(int row) const
+{
+    const QVariantList &values = data.at(row);
+    if (values.count() == roleNames.count()) {
+        int column = keyColumn();
+        return column < 0 ? QVariant() : values.at(column);
+    }
+    return values.value(0);
+}
+
+void TableModel::Private::reload(int row)
+{
+    TraceScope trace("sql", "TableModel::reload");
+    int first = qMax(0, row - evictBatch / 4);
+    int last = qMin(data.count(), first + evictBatch);
+    int column = keyColumn();
+
+    QStringList placeHolders;
+    QVariantList params;
+    QHash<QString, int> rows;
+    for (int i = first; i < last; i++) {
+        if (isResident(i)) continue;
+        placeHolders.append(QLatin1String("?"));
+        params.append(keyAt(i));
+        rows.insert(keyAt(i).toString(), i);
+    }
+
+    // a jump away from the resident rows, they are far from row now and the
+    // window has to stay one range
+    if (last < evictFront || first > evictBack) {
+        evictRows(evictFront, evictBack);
+        evictFront = first;
+        evictBack = last;
+    } else {
+        evictFront = qMin(evictFront, first);
+        evictBack = qMax(evictBack, last);
+    }
+
+    // not bounded by limit and offset, the keys are those of the rows in data
+    QString sql = selectSql(QString("%1 IN (%2)").arg(q->m_primaryKey).arg(placeHolders.join(", ")), false, false, true);
+    foreach (const QSqlDatabase &db, connections()) {
+        QSqlQuery query(db);
+        query.setForwardOnly(true);
+        query.prepare(sql);
+        foreach (const QVariant &param, params) {
+            query.addBindValue(param);
+        }
+        if (!query.exec())
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+        while (query.next()) {
+            QVariantList values;
+            for (int j = 0; j < roleNames.count(); j++) {
+                QVariant v = query.value(j);
+                QByteArray roleName = roleNames.value(j + Qt::UserRole);
+                if (name2type.contains(roleName) && v.type() != name2type.value(roleName))
+                    v.convert(name2type.value(roleName));
+                values.append(v);
+            }
+            QString key = values.at(column).toString();
+            if (!rows.contains(key)) continue;
+            int i = rows.take(key);
+            residentBytes += rowCost(values) - rowCost(data.at(i));
+            data[i] = values;
+        }
+    }
+    // deleted meanwhile, empty until the next select
+    foreach (int i, rows) {
+        QVariantList values;
+        for (int j = 0; j < roleNames.count(); j++)
+            values.append(j == column ? keyAt(i) : QVariant());
+        residentBytes += rowCost(values) - rowCost(data.at(i));
+        data[i] = values;
+    }
+}
+
+void TableModel::Private::evictRows(int first, int last)
+{
+    for (int i = first; i < last; i++) {
+        if (!isResident(i)) continue;
+        QVariant key = keyAt(i);
+        residentBytes -= rowCost(data.at(i));
+        data[i] = QVariantList() << key;
+        residentBytes += rowCost(data.at(i));
+    }
+}
+
+// the related values on screen may have changed
+void TableModel::Private::tableChanged(const QString &tableName)
+{
+    if (tableName != q->tableName() && relationTables.contains(tableName))
+        select();
+}
+
+void TableModel::Private::externalChanged(const QStringList &tableNames)
+{
+    foreach (const QString &tableName, tableNames) {
+        if (tableName.compare(q->tableName(), Qt::CaseInsensitive) == 0) {
+            refresh();
+            return;
+        }
+        if (relationTables.contains(tableName)) {
+            select();
+            return;
+        }
+    }
+}
+
+void TableModel::Private::evict()
+{
+    bool enabled = q->m_memoryBudget > 0 && keyColumn() >= 0 && roleNames.count() > 1;
+    while (enabled && residentBytes > q->m_memoryBudget) {
+        // the far end of the resident rows goes first
+        bool front = recentRow - evictFront >= evictBack - recentRow;
+        int first = front ? evictFront : qMax(evictFront, evictBack - evictBatch);
+        int last = front ? qMin(evictBack, evictFront + evictBatch) : evictBack;
+        if (first >= last) break;
+        if (front ? last > recentRow - evictWindow : first < recentRow + evictWindow) break;
+
+        evictRows(first, last);
+        if (front)
+            evictFront = last;
+        else
+            evictBack = first;
+    }
+    if (residentBytes != reportedBytes) {
+        reportedBytes = residentBytes;
+        emit q->residentBytesChanged(residentBytes);
+    }
+}
+
+static void storeFiles(const QSqlDatabase &db, const Write &write)
+{
+    if (write.files.isEmpty()) return;
+    if (!write.key.isValid()) {
+        qCWarning(lcDatabase) << "files can not be stored without a primary key.";
+        return;
+    }
+    foreach (const QString &field, write.files.keys()) {
+        BlobDevice::store(db, write.tableName, field, write.primaryKey, write.key, write.files.value(field));
+    }
+}
+
+void TableModel::Private::select()
+{
+    if (!q->m_select) return;
+    if (!q->m_database || !q->m_database->open()) return;
+
+    lazyCache.clear();
+    // the select has them all
+    coalesceTimer->stop();
+    staged.clear();
+    removedKeys.clear();
+    changedFirst = -1;
+    changedLast = -1;
+    changedRoles.clear();
+    allRolesChanged = false;
+
+    if (data.count() > 0) {
+        q->beginRemoveRows(QModelIndex(), 0, data.count() - 1);
+        data.clear();
+        q->endRemoveRows();
+    }
+    residentBytes = 0;
+    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    q->m_database->advise(selectSql(q->m_condition), q->m_params);
+    if (!q->m_database->shards().isEmpty()) {
+        // as slow as the slowest shard, they run in parallel on the pool
+        QList<QList<QVariantList> > shards;
+        foreach (const Database::Result &result, q->m_database->fanOut(db, selectSql(q->m_condition, false, true), q->m_params)) {
+            if (!result.ok)
+                qCWarning(lcDatabase) << selectSql(q->m_condition, false, true) << q->m_params << result.error;
+            if (roleNames.isEmpty())
+                roleNames = result.roleNames;
+            shards.append(result.rows);
+        }
+        data = merge(shards, q->m_order, roleNames, q->m_offset, q->m_limit);
+        for (int i = 0; i < data.count(); i++) {
+            QVariantList &row = data[i];
+            for (int j = 0; j < row.count(); j++) {
+                QByteArray roleName = roleNames.value(j + Qt::UserRole);
+                if (name2type.contains(roleName) && row.at(j).type() != name2type.value(roleName))
+                    row[j].convert(name2type.value(roleName));
+            }
+        }
+    } else if (q->m_database->native() && SqliteEngine::isAvailable(db)) {
+        // decoded straight to the property types, no QSqlQuery in between
+        QHash<int, QVariant::Type> types;
+        for (int i = 0; i < fieldNames.count(); i++) {
+            types.insert(i, name2type.value(fieldNames.at(i).toUtf8()));
+        }
+        QStringList columns;
+        QString error;
+        if (!SqliteEngine::select(db, selectSql(q->m_condition), q->m_params, types, &columns, &data, &error))
+            qCWarning(lcDatabase) << selectSql(q->m_condition) << q->m_params << error;
+        if (roleNames.isEmpty()) {
+            for (int i = 0; i < columns.count(); i++) {
+                roleNames.insert(i + Qt::UserRole, columns.at(i).toUtf8());
+            }
+        }
+    } else {
+        fetch();
+    }
+
+    foreach (const QVariantList &row, data) {
+        residentBytes += rowCost(row);
+    }
+    recentRow = 0;
+    evictFront = 0;
+    evictBack = data.count();
+    tailKey = data.isEmpty() || keyColumn() < 0 ? QVariant() : keyAt(data.count() - 1);
+    evict();
+
+    TraceScope trace("model", "TableModel::select");
+    if (data.count() > 0) {
+        q->beginInsertRows(QModelIndex(), 0, data.count() - 1);
+        q->endInsertRows();
+    }
+    emit q->countChanged(data.count());
+}
+
+void TableModel::Private::fetch()
+{
+    QueryTimes times;
+    QSqlQuery query = buildQuery(q->m_condition, q->m_params, false, false, QSqlDatabase(), &times);
+    if (roleNames.isEmpty()) {
+        QSqlRecord record = query.record();
+        for (int i = 0; i < record.count(); i++) {
+            roleNames.insert(i + Qt::UserRole, record.fieldName(i).toUtf8());
+        }
+    }
+    qint64 start = Tracing::now();
+    while (query.next()) {
+        QVariantList d;
+        for (int i = 0; i < roleNames.keys().count(); i++) {
+            QVariant v = query.value(i);
+            QByteArray roleName = roleNames.value(i + Qt::UserRole);
+            if (name2type.contains(roleName) && v.type() != name2type.value(roleName)) {
+                v.convert(name2type.value(roleName));
+            }
+            d.append(v);
+        }
+        data.append(d);
+    }
+    qint64 end = Tracing::now();
+    if (Tracing::isEnabled())
+        Tracing::record("sql", "fetch", start, end, QString("%1 rows").arg(data.count()));
+    Tracing::query(query.lastQuery(), q->m_params, times.prepare, times.exec, end - start);
+}
+
+static QString localFile(const QString &path)
+{
+    QUrl url(path);
+    if (url.isLocalFile())
+        return url.toLocalFile();
+    return path;
+}
+
+// reads one RFC 4180 record, quoted fields may span lines
+// empty unquoted fields are returned as null strings
+static bool readCsvRecord(QTextStream &stream, QStringList *fields)
+{
+    fields->clear();
+    if (stream.atEnd()) return false;
+
+    QString line = stream.readLine();
+    QString field;
+    bool quoted = false;
+    bool wasQuoted = false;
+    int i = 0;
+    forever {
+        if (i >= line.length()) {
+            if (quoted && !stream.atEnd()) {
+                field.append(QLatin1Char('\n'));
+                line = stream.readLine();
+                i = 0;
+                continue;
+            }
+            break;
+        }
+        QChar c = line.at(i++);
+        if (quoted) {
+            if (c == QLatin1Char('"')) {
+                if (i < line.length() && line.at(i) == QLatin1Char('"')) {
+                    field.append(c);
+                    i++;
+                } else {
+                    quoted = false;
+                }
+            } else {
+                field.append(c);
+            }
+        } else if (c == QLatin1Char('"')) {
+            quoted = true;
+            wasQuoted = true;
+        } else if (c == QLatin1Char(',')) {
+            fields->append(wasQuoted && field.isNull() ? QString::fromLatin1("") : field);
+            field = QString();
+            wasQuoted = false;
+        } else {
+            field.append(c);
+        }
+    }
+    fields->append(wasQuoted && field.isNull() ? QString::fromLatin1("") : field);
+    return true;
+}
+
+static QString csvField(const QVariant &value)
+{
+    if (value.isNull()) return QString();
+
+    QString ret = value.type() == QVariant::DateTime ? value.toDateTime().toString(Qt::ISODate) : value.toString();
+    if (ret.isEmpty() || ret.contains(QLatin1Char(',')) || ret.contains(QLatin1Char('"')) || ret.contains(QLatin1Char('\n')) || ret.contains(QLatin1Char('\r'))) {
+        ret.replace(QLatin1String("\""), QLatin1String("\"\""));
+        ret = QString("\"%1\"").arg(ret);
+    }
+    return ret;
+}
+
+// rows per transaction and per pool task, queries of the models get the pool in between
+static const int importChunkSize = 1000;
+// bound parameters per multi-row INSERT, SQLite before 3.32 allows 999
+static const int importMaxParameters = 999;
+
+// reads the next row of job, false at the end or on a broken line
+static bool readImportRow(Import *job, QVariantList *values, bool *ok)
+{
+    values->clear();
+    if (job->csv) {
+        QStringList fields;
+        forever {
+            if (!readCsvRecord(job->stream, &fields)) return false;
+            // skips blank lines
+            if (fields.count() != 1 || !fields.first().isNull()) break;
+        }
+        for (int j = 0; j < job->keys.count(); j++) {
+            QString field = fields.value(job->indexes.at(j));
+            QVariant value;
+            if (!field.isNull()) {
+                value = field;
+                if (job->types.at(j) != QVariant::Invalid)
+                    value.convert(job->types.at(j));
+            }
+            values->append(value);
+        }
+        return true;
+    }
+
+    if (!job->pending) {
+        QString line;
+        while (line.isEmpty()) {
+            if (job->stream.atEnd()) return false;
+            line = job->stream.readLine().trimmed();
+        }
+        QJsonParseError error;
+        job->object = QJsonDocument::fromJson(line.toUtf8(), &error).object().toVariantMap();
+        if (error.error != QJsonParseError::NoError) {
+            qCWarning(lcDatabase) << job->file.fileName() << error.errorString();
+            *ok = false;
+            return false;
+        }
+    }
+    job->pending = false;
+    foreach (const QString &key, job->keys) {
+        values->append(job->object.value(key));
+    }
+    return true;
+}
+
+// INSERT INTO table(keys) VALUES (?, ?), (?, ?), ... for rows rows
+static QString importSql(const Import *job, int rows)
+{
+    QStringList placeHolders;
+    for (int i = 0; i < job->keys.count(); i++) {
+        placeHolders.append(QLatin1String("?"));
+    }
+    QString row = QString("(%1)").arg(placeHolders.join(", "));
+    QStringList values;
+    for (int i = 0; i < rows; i++) {
+        values.append(row);
+    }
+    return QString("INSERT INTO %1(%2) VALUES %3").arg(job->tableName).arg(job->keys.join(", ")).arg(values.join(", "));
+}
+
+static bool insertRows(QSqlDatabase db, const Import *job, const QList<QVariantList> &rows)
+{
+    int perStatement = qMax(1, importMaxParameters / job->keys.count());
     QSqlQuery query(db);
-    if (!query.prepare(QString("UPDATE %1 SET %2%3").arg(tableName()).arg(sets.join(", ")).arg(where))) {
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.lastQuery() << query.lastError().text();
+    int prepared = 0;
+    bool transaction = db.transaction();
+    for (int i = 0; i < rows.count(); i += perStatement) {
+        int count = qMin(perStatement, rows.count() - i);
+        if (count != prepared) {
+            if (!query.prepare(importSql(job, count))) {
+                qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+                if (transaction)
+                    db.rollback();
+                return false;
+            }
+            prepared = count;
+        }
+        for (int j = i; j < i + count; j++) {
+            foreach (const QVariant &value, rows.at(j)) {
+                query.addBindValue(value);
+            }
+        }
+        if (!query.exec()) {
+            qCWarning(lcDatabase) << query.lastError().text() << rows.mid(i, count);
+            if (transaction)
+                db.rollback();
+            return false;
+        }
+    }
+    if (transaction && !db.commit()) {
+        qCWarning(lcDatabase) << job->tableName << db.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+// one chunk of job per task, the next one is queued behind the other tasks
+static void importChunk(const Database *database, QSharedPointer<Import> job, QSharedPointer<WriteMailbox> mailbox)
+{
+    database->pool()->submit([database, job, mailbox](QSqlDatabase db) {
+        bool ok = true;
+        bool done = false;
+        {
+            OwnWrite own(database, job->tableName);
+            QList<QVariantList> rows;
+            QVariantList values;
+            while (rows.count() < importChunkSize) {
+                if (!readImportRow(job.data(), &values, &ok)) {
+                    done = true;
+                    break;
+                }
+                rows.append(values);
+            }
+            if (ok && !rows.isEmpty())
+                ok = insertRows(db, job.data(), rows);
+            if (ok)
+                job->rows += rows.count();
+        }
+
+        QMutexLocker locker(&mailbox->mutex);
+        // nobody to import for anymore
+        if (!mailbox->receiver) return;
+        if (ok && !done) {
+            QMetaObject::invokeMethod(mailbox->receiver, "importProgressed", Qt::QueuedConnection, Q_ARG(qint64, job->file.pos()), Q_ARG(qint64, job->file.size()));
+            importChunk(database, job, mailbox);
+        } else {
+            QMetaObject::invokeMethod(mailbox->receiver, "imported", Qt::QueuedConnection, Q_ARG(bool, ok), Q_ARG(int, job->rows),
+                                      Q_ARG(qint64, ok ? job->file.size() : job->file.pos()), Q_ARG(qint64, job->file.size()));
+        }
+    }, -1);
+}
+
+bool TableModel::Private::importFrom(const QString &fileName, const QString &format)
+{
+    bool csv = format.compare(QLatin1String("csv"), Qt::CaseInsensitive) == 0;
+    bool jsonl = format.compare(QLatin1String("jsonl"), Qt::CaseInsensitive) == 0;
+    if (!csv && !jsonl) {
+        qCWarning(lcDatabase) << format << "is not supported.";
+        return false;
+    }
+    if (!q->m_database || !q->m_database->open()) return false;
+    if (!q->m_database->shards().isEmpty()) {
+        qCWarning(lcDatabase) << "importFrom is not supported for sharded databases.";
+        return false;
+    }
+
+    QSharedPointer<Import> job(new Import);
+    job->csv = csv;
+    job->tableName = q->tableName();
+    job->file.setFileName(fileName);
+    if (!job->file.open(QFile::ReadOnly | QFile::Text)) {
+        qCWarning(lcDatabase) << fileName << job->file.errorString();
+        return false;
+    }
+    job->stream.setDevice(&job->file);
+    job->stream.setCodec("UTF-8");
+
+    // the columns are taken from the csv header or the first json object
+    QStringList columns;
+    if (csv) {
+        if (!readCsvRecord(job->stream, &columns)) columns.clear();
+    } else {
+        QString line;
+        while (line.isEmpty() && !job->stream.atEnd())
+            line = job->stream.readLine().trimmed();
+        job->object = QJsonDocument::fromJson(line.toUtf8()).object().toVariantMap();
+        job->pending = true;
+        columns = job->object.keys();
+    }
+    if (columns.isEmpty()) {
+        emit q->importFinished(true, 0);
+        return true;
+    }
+
+    // the names end up in the INSERT, only real columns of the table pass
+    QSqlRecord record = QSqlDatabase::database(q->m_database->connectionName()).record(q->tableName());
+    for (int i = 0; i < columns.count(); i++) {
+        QString column = columns.at(i);
+        int field = record.indexOf(column);
+        if (field < 0) {
+            qCWarning(lcDatabase) << column << "is not a column of" << q->tableName() << "and will be ignored.";
+            continue;
+        }
+        QByteArray name = record.fieldName(field).toUtf8();
+        job->keys.append(record.fieldName(field));
+        job->indexes.append(i);
+        job->types.append(name2type.value(name, QVariant::Invalid));
+    }
+    if (job->keys.isEmpty()) return false;
+
+    importChunk(q->m_database, job, writeMailbox);
+    return true;
+}
+
+void TableModel::Private::importProgressed(qint64 bytesRead, qint64 bytesTotal)
+{
+    emit q->importProgress(bytesRead, bytesTotal);
+}
+
+void TableModel::Private::imported(bool ok, int rows, qint64 bytesRead, qint64 bytesTotal)
+{
+    emit q->importProgress(bytesRead, bytesTotal);
+    if (rows > 0 && q->m_database) {
+        emit q->m_database->tableChanged(q->tableName());
+        select();
+    }
+    emit q->importFinished(ok, rows);
+}
+
+bool TableModel::Private::exportTo(const QString &fileName, const QString &format)
+{
+    bool csv = format.compare(QLatin1String("csv"), Qt::CaseInsensitive) == 0;
+    bool jsonl = format.compare(QLatin1String("jsonl"), Qt::CaseInsensitive) == 0;
+    if (!csv && !jsonl) {
+        qCWarning(lcDatabase) << format << "is not supported.";
+        return false;
+    }
+    if (!q->m_database || !q->m_database->open()) return false;
+    if (!q->m_database->shards().isEmpty()) {
+        qCWarning(lcDatabase) << "exportTo is not supported for sharded databases.";
+        return false;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+        return false;
+    }
+    QTextStream stream(&file);
+    stream.setCodec("UTF-8");
+
+    QSqlQuery query = buildQuery(q->m_condition, q->m_params, true, true);
+    if (!query.isActive()) return false;
+
+    QSqlRecord record = query.record();
+    QStringList columns;
+    for (int i = 0; i < record.count(); i++) {
+        columns.append(record.fieldName(i));
+    }
+
+    if (csv) {
+        QStringList header;
+        foreach (const QString &column, columns) {
+            header.append(csvField(column));
+        }
+        stream << header.join(QLatin1String(",")) << QLatin1Char('\n');
+    }
+
+    qint64 rows = 0;
+    while (query.next()) {
+        if (csv) {
+            QStringList line;
+            for (int i = 0; i < columns.count(); i++) {
+                line.append(csvField(query.value(i)));
+            }
+            stream << line.join(QLatin1String(",")) << QLatin1Char('\n');
+        } else {
+            QVariantMap object;
+            for (int i = 0; i < columns.count(); i++) {
+                object.insert(columns.at(i), query.value(i));
+            }
+            stream << QString::fromUtf8(QJsonDocument(QJsonObject::fromVariantMap(object)).toJson(QJsonDocument::Compact)) << QLatin1Char('\n');
+        }
+        rows++;
+        if (rows % 1000 == 0) {
+            emit q->exportProgress(rows);
+        }
+    }
+    stream.flush();
+    emit q->exportProgress(rows);
+    return stream.status() == QTextStream::Ok;
+}
+
+Write TableModel::Private::plan(Write::Kind kind, const QVariantMap &data) const
+{
+    Write ret;
+    ret.kind = kind;
+    ret.data = data;
+    ret.tableName = q->tableName();
+    ret.primaryKey = q->m_primaryKey;
+    if (kind != Write::Insert) {
+        ret.key = data.value(q->m_primaryKey);
+        // no WHERE would touch every row
+        if (q->m_primaryKey.isEmpty() || ret.key.isNull()) {
+            qCWarning(lcDatabase) << "primary key value is required to update or remove a row.";
+            return ret;
+        }
+    }
+
+    switch (kind) {
+    case Write::Insert: {
+        QStringList keys;
+        QStringList placeHolders;
+        foreach (const QByteArray &r, roleNames.values()) {
+            QString field = QString::fromUtf8(r);
+            if (data.contains(field) && !relationFields.contains(field)) {
+                // url properties hold files, their contents are streamed after the row exists
+                if (name2type.value(r) == QVariant::Url) {
+                    ret.files.insert(field, localFile(data.value(field).toString()));
+                    continue;
+                }
+                keys.append(field);
+                placeHolders.append(QStringLiteral("?"));
+                ret.values.append(data.value(field));
+            }
+        }
+        ret.sql = QString("INSERT INTO %1(%2) VALUES(%3)").arg(q->tableName()).arg(keys.join(", ")).arg(placeHolders.join(", "));
+        if (!q->m_primaryKey.isEmpty())
+            ret.selectSql = selectSql(QString("%1=?").arg(q->m_primaryKey), false, false, true);
+        break; }
+    case Write::Update: {
+        QStringList sets;
+        QString where;
+        foreach (int i, roleNames.keys()) {
+            QString field = QString::fromUtf8(roleNames.value(i));
+            if (data.contains(field) && !relationFields.contains(field)) {
+                QVariant value = data.value(field);
+                if (relationKeys.contains(field))
+                    ret.selectSql = selectSql(QString("%1=?").arg(q->m_primaryKey), false, false, true);
+                if (name2type.value(roleNames.value(i)) == QVariant::Url) {
+                    ret.files.insert(field, localFile(value.toString()));
+                } else if (field == q->m_primaryKey) {
+                    where = QString(" WHERE %1=?").arg(field);
+                } else {
+                    sets.append(QString("%1=?").arg(field));
+                    ret.values.append(value);
+                }
+            }
+        }
+        ret.values.append(ret.key);
+        ret.sql = QString("UPDATE %1 SET %2%3").arg(q->tableName()).arg(sets.join(", ")).arg(where);
+        break; }
+    case Write::Remove:
+        ret.sql = QString("DELETE FROM %1 WHERE %2=?;").arg(q->tableName()).arg(q->m_primaryKey);
+        ret.values.append(ret.key);
+        break;
+    }
+
+    // primary keys are unique per shard only, a write goes to the shard of its row
+    int shard = shardOf(data);
+    if (shard == missingShardKey)
+        ret.sql.clear();
+    else if (shard != noShard)
+        ret.shards.append(shard);
+    return ret;
+}
+
+// runs on the thread of base
+static void run(const Database *database, const QSqlDatabase &base, Write *write)
+{
+    QList<QSqlDatabase> dbs;
+    if (write->shards.isEmpty())
+        dbs.append(base);
+    foreach (int shard, write->shards)
+        dbs.append(database->shard(base, shard));
+
+    // rejected by plan()
+    if (write->sql.isEmpty()) {
+        write->ok = false;
         return;
     }
-    foreach (const QVariant &value, values) {
-        query.addBindValue(value);
+
+    bool any = false;
+    bool all = true;
+    foreach (const QSqlDatabase &db, dbs) {
+        QSqlQuery query(db);
+        if (!query.prepare(write->sql)) {
+            qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+            write->ok = false;
+            return;
+        }
+        foreach (const QVariant &value, write->values) {
+            query.addBindValue(value);
+        }
+        if (!query.exec()) {
+            qCWarning(lcDatabase) << query.lastQuery() << query.boundValues() << query.lastError().text();
+            all = false;
+            continue;
+        }
+        any = true;
+
+        // an inserted row, or an updated one whose related values changed
+        bool readBack = write->kind == Write::Insert || (write->kind == Write::Update && query.numRowsAffected() > 0);
+        if (readBack && !write->selectSql.isEmpty()) {
+            QSqlQuery select(db);
+            select.prepare(write->selectSql);
+            select.addBindValue(write->kind == Write::Insert ? query.lastInsertId() : write->key);
+            if (select.exec() && select.first()) {
+                QSqlRecord record = select.record();
+                for (int i = 0; i < record.count(); i++) {
+                    write->row.append(select.value(i));
+                }
+                if (write->kind == Write::Insert)
+                    write->key = select.value(record.indexOf(write->primaryKey));
+            } else {
+                qCWarning(lcDatabase) << select.lastError().text() << select.lastQuery() << select.boundValues();
+            }
+        }
+        if (write->kind != Write::Remove && query.numRowsAffected() != 0)
+            storeFiles(db, *write);
     }
+    write->ok = write->kind == Write::Update ? any : all;
+}
 
-    if (!query.exec()) {
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.lastError();
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.lastQuery();
-        qWarning() << Q_FUNC_INFO << __LINE__ << query.boundValues();
-    } else {
-        for (int i = 0; i < d->data.count(); i++) {
-            if (d->data.at(i).at(keyRole - Qt::UserRole) == key) {
-                QVariantList newData = d->data.at(i);
-                QVector<int> roles;
-                foreach (int j, d->roleNames.keys()) {
-                    QString field = QString::fromUtf8(d->roleNames.value(j));
-                    if (data.contains(field)) {
-                        QVariant value = data.value(field);
-                        if (field == m_primaryKey) {
-                        } else {
-                            newData[j - Qt::UserRole] = value;
-                            roles.append(j);
-                        }
-                    }
+void TableModel::Private::apply(const Write &write)
+{
+    if (!write.ok) return;
+    emit q->m_database->tableChanged(q->tableName());
+
+    switch (write.kind) {
+    case Write::Insert:
+        if (!write.row.isEmpty())
+            appendRows(QList<QVariantList>() << write.row);
+        break;
+    case Write::Update: {
+        if (keyColumn() < 0) break;
+        int i = rowOf(write.key);
+        // reloaded with the new values on access
+        if (i < 0 || (i < data.count() && !isResident(i))) break;
+        QVariantList newData = rowAt(i);
+        QVector<int> roles;
+        foreach (int j, roleNames.keys()) {
+            QString field = QString::fromUtf8(roleNames.value(j));
+            if (write.data.contains(field) && !relationFields.contains(field)) {
+                QVariant value = write.data.value(field);
+                if (field == q->m_primaryKey) {
+                } else if (lazyFields.contains(field) || blobFields.contains(field)) {
+                    lazyCache.remove(write.key.toString());
+                    roles.append(j);
+                } else {
+                    newData[j - Qt::UserRole] = value;
+                    roles.append(j);
                 }
-                d->data[i] = newData;
-                dataChanged(index(i), index(i), roles);
-                break;
             }
         }
+        if (!write.row.isEmpty()) {
+            newData = write.row;
+            roles.clear();
+        }
+        setRow(i, newData, roles);
+        break; }
+    case Write::Remove: {
+        if (keyColumn() < 0) break;
+        int i = rowOf(write.key);
+        if (i >= 0) {
+            lazyCache.remove(write.key.toString());
+            removeRow(i);
+        }
+        break; }
     }
 }
 
-bool TableModel::remove(const QVariantMap &data)
+void TableModel::Private::enqueue(const Write &write, const QJSValue &callback)
 {
-    QSqlDatabase db = QSqlDatabase::database(m_database->connectionName());
+    writes.enqueue(write);
+    callbacks.enqueue(callback);
+    emit q->pendingWritesChanged(writes.count());
+    next();
+}
 
-    QSqlQuery query(db);
-    QString sql = QString("DELETE FROM %1 WHERE %2=?;").arg(tableName()).arg(primaryKey());
-    query.prepare(sql);
-    query.addBindValue(data.value(primaryKey()));
+void TableModel::Private::next()
+{
+    if (writing || writes.isEmpty()) return;
+    writing = true;
 
-    bool ret = query.exec();
-    if (ret) {
-        int count = rowCount();
-        int primaryKeyIndex = -1;
-        foreach (int role, d->roleNames.keys()) {
-            if (d->roleNames.value(role) == m_primaryKey.toUtf8()) {
-                primaryKeyIndex = role;
-                break;
+    const Database *database = q->m_database;
+    QSharedPointer<WriteMailbox> mailbox = writeMailbox;
+    Write write = writes.head();
+    // ahead of selects, the user waits for the result of a write
+    writeTask = database->pool()->submit([database, mailbox, write](QSqlDatabase db) mutable {
+        {
+            OwnWrite own(database, write.tableName);
+            run(database, db, &write);
+        }
+
+        QMutexLocker locker(&mailbox->mutex);
+        if (!mailbox->receiver) return;
+        mailbox->write = write;
+        mailbox->ready = true;
+        mailbox->done.wakeAll();
+        QMetaObject::invokeMethod(mailbox->receiver, "written", Qt::QueuedConnection);
+    }, 1);
+}
+
+void TableModel::Private::drain()
+{
+    while (writing) {
+        // not started yet, it runs here in order instead
+        WorkerPool::Task task;
+        if (q->m_database->pool()->take(writeTask, &task))
+            task(QSqlDatabase::database(q->m_database->connectionName()));
+        else if (!writeTask)
+            return;
+
+        {
+            QMutexLocker locker(&writeMailbox->mutex);
+            while (!writeMailbox->ready)
+                writeMailbox->done.wait(&writeMailbox->mutex);
+        }
+        // the queued call finds the mailbox empty later
+        written();
+    }
+}
+
+void TableModel::Private::written()
+{
+    Write write;
+    {
+        QMutexLocker locker(&writeMailbox->mutex);
+        if (!writeMailbox->ready) return;
+        writeMailbox->ready = false;
+        write = writeMailbox->write;
+        writeMailbox->write = Write();
+    }
+    writes.dequeue();
+    QJSValue callback = callbacks.dequeue();
+    writing = false;
+
+    apply(write);
+    if (callback.isCallable()) {
+        QQmlEngine *engine = qmlEngine(q);
+        QJSValue result = callback.call(QJSValueList() << QJSValue(write.ok) << (engine ? engine->toScriptValue(write.key) : QJSValue()));
+        if (result.isError()) {
+            qCWarning(lcDatabase) << result.toString();
+        }
+    }
+    emit q->pendingWritesChanged(writes.count());
+    next();
+}
+
+//QString TableModel::Private::toSql(const QVariant &value)
+//{
+//    switch (value.type()) {
+//    case QVariant::Int:
+//        return QString::number(value.toInt());
+//        break;
+//    case QVariant::LongLong:
+//        return QString::number(value.toLongLong());
+//        break;
+//    case QVariant::Double:
+//        return QString::number(value.toDouble());
+//        break;
+//    case QVariant::Bool:
+//        return value.toBool() ? "True" : "False";
+//        break;
+//    case QVariant::String:
+//        return QString("'%1'").arg(value.toString());
+//        break;
+//    case QVariant::DateTime:
+//        // TODO: format
+//        return value.toDateTime().toString("'yyyy-MM-dd hh:mm:ss'");
+//        break;
+//    default:
+//        qDebug() << Q_FUNC_INFO << __LINE__ << value.type() << "is not handled here.";
+//        break;
+//    }
+//    return QString();
+//}
+
+TableModel::TableModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , d(new Private(this))
+    , m_database(0)
+    , m_limit(0)
+    , m_offset(0)
+    , m_select(true)
+    , m_journal(false)
+    , m_memoryBudget(0)
+    , m_coalesce(0)
+    , m_appendOnly(false)
+    , m_maxCount(0)
+{
+}
+
+void TableModel::classBegin()
+{
+
+}
+
+void TableModel::componentComplete()
+{
+    d->init();
+}
+
+QHash<int, QByteArray> TableModel::roleNames() const
+{
+    return d->roleNames;
+}
+
+int TableModel::rowCount(const QModelIndex &parent) const
+{
+    return d->data.count();
+}
+
+QVariant TableModel::data(const QModelIndex &index, int role) const
+{
+    if (role >= Qt::UserRole) {
+        return d->value(index.row(), role);
+    }
+    return QVariant();
+}
+
+int TableModel::count() const
+{
+    return rowCount();
+}
+
+QVariantMap TableModel::get(int index) const
+{
+    QVariantMap ret;
+    for (int i = 0; i < d->roleNames.count(); i++) {
+//        qDebug() << Q_FUNC_INFO << __LINE__ << i << QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)) << list.at(i);
+        ret.insert(QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)), d->value(index, Qt::UserRole + i));
+    }
+    return ret;
+}
+
+QVariant TableModel::insert(const QVariantMap &data)
+{
+    TraceScope trace("sql", "TableModel::insert");
+    // after the writes of insertAsync() and friends
+    d->drain();
+    Write write = d->plan(Write::Insert, data);
+    run(m_database, QSqlDatabase::database(m_database->connectionName()), &write);
+    d->apply(write);
+    return write.key;
+}
+
+void TableModel::update(const QVariantMap &data)
+{
+    TraceScope trace("sql", "TableModel::update");
+    d->drain();
+    Write write = d->plan(Write::Update, data);
+    run(m_database, QSqlDatabase::database(m_database->connectionName()), &write);
+    d->apply(write);
+}
+
+bool TableModel::upsert(const QVariantMap &data)
+{
+    return upsertAll(QVariantList() << data) == 1;
+}
+
+int TableModel::upsertAll(const QVariantList &list)
+{
+    TraceScope trace("sql", "TableModel::upsert");
+    if (m_primaryKey.isEmpty()) {
+        qCWarning(lcDatabase) << "primary key is required for upsert.";
+        return -1;
+    }
+
+    QSqlQuery query;
+    QString preparedConnection;
+    QStringList preparedKeys;
+    // one transaction per shard the batch writes to
+    QList<QSqlDatabase> transactions;
+    QStringList transactionNames;
+    bool inTransaction = list.count() > 1;
+    bool ok = true;
+    int done = 0;
+
+    foreach (const QVariant &item, list) {
+        QVariantMap data = item.toMap();
+        if (!data.contains(m_primaryKey)) {
+            qCWarning(lcDatabase) << m_primaryKey << "is missing in" << data;
+            ok = false;
+            break;
+        }
+
+        QStringList keys;
+        QVariantList values;
+        Write files;
+        files.tableName = tableName();
+        files.primaryKey = m_primaryKey;
+        files.key = data.value(m_primaryKey);
+        foreach (const QByteArray &r, d->roleNames.values()) {
+            QString field = QString::fromUtf8(r);
+            if (data.contains(field) && !d->relationFields.contains(field)) {
+                // streamed into the row once it exists, as for insert and update
+                if (d->name2type.value(r) == QVariant::Url) {
+                    files.files.insert(field, localFile(data.value(field).toString()));
+                    continue;
+                }
+                keys.append(field);
+                values.append(data.value(field));
             }
         }
-        if (primaryKeyIndex > -1) {
-            for (int i = 0; i < count; i++) {
-                if (d->data.at(i).at(primaryKeyIndex - Qt::UserRole) == data.value(primaryKey())) {
-                    beginRemoveRows(QModelIndex(), i, i);
-                    d->data.removeAt(i);
-                    endRemoveRows();
-                    emit countChanged(d->data.count());
-                    break;
+
+        QSqlDatabase db = d->connection(data);
+        if (!db.isValid()) {
+            ok = false;
+            break;
+        }
+        if (db.connectionName() != preparedConnection) {
+            if (inTransaction && !transactionNames.contains(db.connectionName())) {
+                if (db.transaction()) {
+                    transactions.append(db);
+                    transactionNames.append(db.connectionName());
+                } else {
+                    inTransaction = false;
                 }
             }
+            query = QSqlQuery(db);
+            preparedConnection = db.connectionName();
+            preparedKeys.clear();
         }
-    } else {
-        qWarning() << Q_FUNC_INFO << __LINE__ << sql << query.lastError().text();
+
+        // rows of a batch usually have the same columns, prepare once for them
+        if (keys != preparedKeys) {
+            QString sql = d->upsertSql(keys);
+            if (sql.isEmpty() || !query.prepare(sql)) {
+                qCWarning(lcDatabase) << sql << query.lastError().text();
+                ok = false;
+                break;
+            }
+            preparedKeys = keys;
+        }
+        foreach (const QVariant &value, values) {
+            query.addBindValue(value);
+        }
+        if (!query.exec()) {
+            qCWarning(lcDatabase) << query.lastQuery() << query.boundValues() << query.lastError().text();
+            ok = false;
+            break;
+        }
+        storeFiles(db, files);
+        done++;
     }
-    return ret;
+
+    foreach (QSqlDatabase db, transactions) {
+        if (ok)
+            db.commit();
+        else
+            db.rollback();
+    }
+    if (!ok && inTransaction) return -1;
+    if (done == 0) return ok ? 0 : -1;
+    emit m_database->tableChanged(tableName());
+
+    // without a transaction the rows before a failure are stored already
+    for (int i = 0; i < done; i++) {
+        d->patch(list.at(i).toMap());
+    }
+    return ok ? done : -1;
+}
+
+bool TableModel::remove(const QVariantMap &data)
+{
+    TraceScope trace("sql", "TableModel::remove");
+    d->drain();
+    Write write = d->plan(Write::Remove, data);
+    run(m_database, QSqlDatabase::database(m_database->connectionName()), &write);
+    d->apply(write);
+    return write.ok;
+}
+
+void TableModel::insertAsync(const QVariantMap &data, const QJSValue &callback)
+{
+    d->enqueue(d->plan(Write::Insert, data), callback);
+}
+
+void TableModel::updateAsync(const QVariantMap &data, const QJSValue &callback)
+{
+    d->enqueue(d->plan(Write::Update, data), callback);
+}
+
+void TableModel::removeAsync(const QVariantMap &data, const QJSValue &callback)
+{
+    d->enqueue(d->plan(Write::Remove, data), callback);
+}
+
+void TableModel::refresh()
+{
+    d->refresh();
+}
+
+int TableModel::pendingWrites() const
+{
+    return d->writes.count();
+}
+
+qint64 TableModel::residentBytes() const
+{
+    return d->residentBytes;
 }
 
 int TableModel::remove()
 {
+    TraceScope trace("sql", "TableModel::remove");
     int ret = -1;
-    QSqlDatabase db = QSqlDatabase::database(m_database->connectionName());
-
-    QSqlQuery query(db);
     QString sql = QString("DELETE FROM %1").arg(tableName());
     if (!m_condition.isEmpty())
         sql += QString(" WHERE %1").arg(m_condition);
+
+    foreach (const QSqlDatabase &db, d->connections()) {
+        QSqlQuery query(db);
+        query.prepare(sql);
+        foreach (const QVariant &val, m_params) {
+            query.addBindValue(val);
+        }
+        if (query.exec()) {
+            ret = qMax(ret, 0) + query.numRowsAffected();
+        } else {
+            qCWarning(lcDatabase) << sql << query.lastError().text();
+        }
+    }
+    if (ret >= 0)
+        emit m_database->tableChanged(tableName());
+    return ret;
+}
+
+bool TableModel::storeBlob(const QVariant &key, const QString &column, const QString &path)
+{
+    if (!d->blobFields.contains(column)) {
+        qCWarning(lcDatabase) << column << "is not a blob column of" << tableName();
+        return false;
+    }
+    QSqlDatabase db = d->connectionOf(key);
+    if (!db.isValid()) return false;
+    bool ret = BlobDevice::store(db, tableName(), column, m_primaryKey, key, localFile(path));
+    if (ret) {
+        emit m_database->tableChanged(tableName());
+        int role = d->roleNames.key(column.toUtf8());
+        int row = d->keyColumn() < 0 ? -1 : d->rowOf(key);
+        if (row >= 0 && row < d->data.count())
+            d->rowChanged(row, QVector<int>() << role);
+    }
+    return ret;
+}
+
+bool TableModel::fetchBlob(const QVariant &key, const QString &column, const QString &path)
+{
+    if (!d->blobFields.contains(column)) {
+        qCWarning(lcDatabase) << column << "is not a blob column of" << tableName();
+        return false;
+    }
+    QSqlDatabase db = d->connectionOf(key);
+    if (!db.isValid()) return false;
+    return BlobDevice::fetch(db, tableName(), column, m_primaryKey, key, localFile(path));
+}
+
+QVariantList TableModel::explain() const
+{
+    if (!m_database) return QVariantList();
+    return m_database->explain(d->selectSql(m_condition), m_params);
+}
+
+QVariantList TableModel::changes(qint64 since, int limit) const
+{
+    QVariantList ret;
+    if (!d->journalSupported()) return ret;
+    QSqlQuery query(QSqlDatabase::database(m_database->connectionName()));
+    query.setForwardOnly(true);
+    QString sql = QString("SELECT seq, key, op, columns FROM %1 WHERE seq > ? ORDER BY seq").arg(d->journalName());
+    if (limit > 0)
+        sql += QString(" LIMIT %1").arg(limit);
     query.prepare(sql);
-    foreach (const QVariant &val, m_params) {
-        query.addBindValue(val);
+    query.addBindValue(since);
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << sql << query.lastError().text();
+        return ret;
     }
-    if (query.exec()) {
-        ret = query.numRowsAffected();
-    } else {
-        qWarning() << Q_FUNC_INFO << __LINE__ << sql << query.lastError().text();
+    while (query.next()) {
+        QVariantMap change;
+        change.insert(QStringLiteral("seq"), query.value(0));
+        change.insert(QStringLiteral("key"), query.value(1));
+        change.insert(QStringLiteral("op"), query.value(2));
+        change.insert(QStringLiteral("columns"), query.value(3).toString().split(QLatin1Char(','), QString::SkipEmptyParts));
+        ret.append(change);
+    }
+    return ret;
+}
+
+qint64 TableModel::replicate(Database *target, qint64 since)
+{
+    TraceScope trace("sql", "TableModel::replicate");
+    if (!target || !target->open() || !d->journalSupported()) return -1;
+    if (!target->shards().isEmpty()) {
+        qCWarning(lcDatabase) << "can not replicate to the sharded database" << target->connectionName();
+        return -1;
+    }
+    QSqlDatabase db = QSqlDatabase::database(m_database->connectionName());
+    QSqlDatabase to = QSqlDatabase::database(target->connectionName());
+    if (!hasTable(to, tableName()))
+        d->create(to);
+
+    // only the last state of each changed row matters
+    QSqlQuery changes(db);
+    changes.setForwardOnly(true);
+    changes.prepare(QString("SELECT key, MAX(seq) FROM %1 WHERE seq > ? GROUP BY key ORDER BY 2").arg(d->journalName()));
+    changes.addBindValue(since);
+    if (!changes.exec()) {
+        qCWarning(lcDatabase) << changes.lastQuery() << changes.lastError().text();
+        return -1;
+    }
+
+    // the roles include those of relations, only real columns are copied
+    QStringList columns;
+    QSqlRecord source = db.record(tableName());
+    QSqlRecord destination = to.record(tableName());
+    for (int i = 0; i < source.count(); i++) {
+        if (destination.contains(source.fieldName(i)))
+            columns.append(source.fieldName(i));
+    }
+    QSqlQuery row(db);
+    row.setForwardOnly(true);
+    row.prepare(QString("SELECT %1 FROM %2 WHERE %3=?").arg(columns.join(", ")).arg(tableName()).arg(m_primaryKey));
+    QSqlQuery upsert(to);
+    upsert.prepare(d->upsertSql(columns, to.driverName()));
+    QSqlQuery remove(to);
+    remove.prepare(QString("DELETE FROM %1 WHERE %2=?").arg(tableName()).arg(m_primaryKey));
+
+    bool inTransaction = to.transaction();
+    qint64 ret = since;
+    int count = 0;
+    while (changes.next()) {
+        QVariant key = changes.value(0);
+        row.addBindValue(key);
+        bool ok = row.exec();
+        if (ok && row.next()) {
+            for (int i = 0; i < columns.count(); i++) {
+                upsert.addBindValue(row.value(i));
+            }
+            ok = upsert.exec();
+            if (!ok)
+                qCWarning(lcDatabase) << upsert.lastQuery() << upsert.lastError().text();
+        } else if (ok) {
+            remove.addBindValue(key);
+            ok = remove.exec();
+            if (!ok)
+                qCWarning(lcDatabase) << remove.lastQuery() << remove.lastError().text();
+        } else {
+            qCWarning(lcDatabase) << row.lastQuery() << row.lastError().text();
+        }
+        row.finish();
+        if (!ok) {
+            if (inTransaction)
+                to.rollback();
+            return -1;
+        }
+        ret = changes.value(1).toLongLong();
+        count++;
     }
+    if (inTransaction)
+        to.commit();
+    if (count > 0)
+        emit target->tableChanged(tableName());
     return ret;
 }
 
+int TableModel::trimJournal(qint64 upTo)
+{
+    if (!d->journalSupported()) return -1;
+    QSqlQuery query(QSqlDatabase::database(m_database->connectionName()));
+    query.prepare(QString("DELETE FROM %1 WHERE seq <= ?").arg(d->journalName()));
+    query.addBindValue(upTo);
+    if (!query.exec()) {
+        qCWarning(lcDatabase) << query.lastQuery() << query.lastError().text();
+        return -1;
+    }
+    return query.numRowsAffected();
+}
+
+bool TableModel::importFrom(const QString &path, const QString &format)
+{
+    return d->importFrom(localFile(path), format);
+}
+
+bool TableModel::exportTo(const QString &path, const QString &format)
+{
+    return d->exportTo(localFile(path), format);
+}
+
 #include "tablemodel.moc"
@@ -28,7 +28,9 @@
 #define TABLEMODEL_H
 
 #include <QtCore/QAbstractListModel>
+#include <QtCore/QStringList>
 
+#include <QtQml/QJSValue>
 #include <QtQml/QQmlParserStatus>
 
 class Database;
@@ -46,7 +48,34 @@ class TableModel : public QAbstractListModel, public QQmlParserStatus
     Q_PROPERTY(int offset READ offset WRITE offset NOTIFY offsetChanged)
     Q_PROPERTY(QVariantList params READ params WRITE params NOTIFY paramsChanged)
     Q_PROPERTY(int count READ count NOTIFY countChanged)
+    Q_PROPERTY(int pendingWrites READ pendingWrites NOTIFY pendingWritesChanged)
     Q_PROPERTY(bool select READ select WRITE select NOTIFY selectChanged)
+    Q_PROPERTY(QStringList lazy READ lazy WRITE lazy NOTIFY lazyChanged)
+    // the column choosing the shard of a row, primaryKey when empty. every write
+    // needs its value, and as AUTOINCREMENT counts per shard the primary key has
+    // to be assigned by the application (e.g. a UUID) and be the shard key
+    Q_PROPERTY(QString shardKey READ shardKey WRITE shardKey NOTIFY shardKeyChanged)
+    Q_PROPERTY(bool journal READ journal WRITE journal NOTIFY journalChanged)
+    // "column", "a, b" or {columns: "a, b", unique: true, where: "a IS NOT NULL", name: "..."}
+    Q_PROPERTY(QVariantList indexes READ indexes WRITE indexes NOTIFY indexesChanged)
+    // column: SQL expression filling a column added to an existing table, e.g. {slug: "lower(title)"}
+    Q_PROPERTY(QVariantMap backfill READ backfill WRITE backfill NOTIFY backfillChanged)
+    // [{model: users, key: "userId", columns: ["name"]}] adds the read only role users_name,
+    // "table", "foreignKey" (default: primaryKey of model or "id") and "as" (default: table) are optional
+    Q_PROPERTY(QVariantList relations READ relations WRITE relations NOTIFY relationsChanged)
+    // bytes of rows kept in memory, 0 for no limit. the rows far from the last
+    // accessed one are dropped and reloaded by primary key when needed again.
+    // an AggregateModel on the model reads every row at each reset, that
+    // reloads the dropped ones in batches and evicts the others meanwhile
+    Q_PROPERTY(qint64 memoryBudget READ memoryBudget WRITE memoryBudget NOTIFY memoryBudgetChanged)
+    Q_PROPERTY(qint64 residentBytes READ residentBytes NOTIFY residentBytesChanged)
+    // msecs to collect row changes for, then one dataChanged, remove and insert
+    // range each is emitted. 0 notifies every change, 16 is about one frame
+    Q_PROPERTY(int coalesce READ coalesce WRITE coalesce NOTIFY coalesceChanged)
+    // rows only ever get appended with growing primary keys: the rows are in key
+    // order, refresh() fetches the new ones only and at most maxCount are kept
+    Q_PROPERTY(bool appendOnly READ appendOnly WRITE appendOnly NOTIFY appendOnlyChanged)
+    Q_PROPERTY(int maxCount READ maxCount WRITE maxCount NOTIFY maxCountChanged)
 
     Q_INTERFACES(QQmlParserStatus)
 public:
@@ -54,10 +83,33 @@ public:
 
     int count() const;
     Q_INVOKABLE QVariantMap get(int index) const;
+    // the plan of the current select, see Database::explain()
+    Q_INVOKABLE QVariantList explain() const;
     Q_INVOKABLE QVariant insert(const QVariantMap &data);
     Q_INVOKABLE void update(const QVariantMap &data);
+    Q_INVOKABLE bool upsert(const QVariantMap &data);
+    Q_INVOKABLE int upsertAll(const QVariantList &list);
     Q_INVOKABLE bool remove(const QVariantMap &data);
     Q_INVOKABLE int remove();
+    // run on the worker pool one after another, then callback(ok, key) is called.
+    // the blocking methods above finish the queued writes before their own.
+    Q_INVOKABLE void insertAsync(const QVariantMap &data, const QJSValue &callback = QJSValue());
+    Q_INVOKABLE void updateAsync(const QVariantMap &data, const QJSValue &callback = QJSValue());
+    Q_INVOKABLE void removeAsync(const QVariantMap &data, const QJSValue &callback = QJSValue());
+    int pendingWrites() const;
+    qint64 residentBytes() const;
+    // streams a file into or out of a blob column of the row with the primary key
+    Q_INVOKABLE bool storeBlob(const QVariant &key, const QString &column, const QString &path);
+    Q_INVOKABLE bool fetchBlob(const QVariant &key, const QString &column, const QString &path);
+    // entries of <tableName>__journal after sequence number since
+    Q_INVOKABLE QVariantList changes(qint64 since, int limit = 0) const;
+    // copies the rows changed after since to target, returns the last sequence number applied
+    Q_INVOKABLE qint64 replicate(Database *target, qint64 since);
+    Q_INVOKABLE int trimJournal(qint64 upTo);
+    // runs on the pool, false when it could not start; see importFinished
+    Q_INVOKABLE bool importFrom(const QString &path, const QString &format = QLatin1String("csv"));
+    Q_INVOKABLE bool exportTo(const QString &path, const QString &format = QLatin1String("csv"));
+    Q_INVOKABLE void refresh();
 //    void clear();
 
     virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
@@ -77,7 +129,24 @@ signals:
     void limitChanged(int limit);
     void paramsChanged(const QVariantList &params);
     void countChanged(int count);
+    void pendingWritesChanged(int pendingWrites);
     void selectChanged(bool select);
+    void lazyChanged(const QStringList &lazy);
+    void shardKeyChanged(const QString &shardKey);
+    void journalChanged(bool journal);
+    void indexesChanged(const QVariantList &indexes);
+    void indexReady(const QString &name, int msecs);
+    void backfillChanged(const QVariantMap &backfill);
+    void backfillFinished(const QString &column, int rows);
+    void relationsChanged(const QVariantList &relations);
+    void memoryBudgetChanged(qint64 memoryBudget);
+    void residentBytesChanged(qint64 residentBytes);
+    void coalesceChanged(int coalesce);
+    void appendOnlyChanged(bool appendOnly);
+    void maxCountChanged(int maxCount);
+    void importProgress(qint64 bytesRead, qint64 bytesTotal);
+    void importFinished(bool ok, int rows);
+    void exportProgress(qint64 rows);
 
 private:
     class Private;
@@ -103,6 +172,16 @@ private: \
     ADD_PROPERTY(int, offset, int)
     ADD_PROPERTY(const QVariantList &, params, QVariantList)
     ADD_PROPERTY(bool, select, bool)
+    ADD_PROPERTY(const QStringList &, lazy, QStringList)
+    ADD_PROPERTY(const QString &, shardKey, QString)
+    ADD_PROPERTY(bool, journal, bool)
+    ADD_PROPERTY(const QVariantList &, indexes, QVariantList)
+    ADD_PROPERTY(const QVariantMap &, backfill, QVariantMap)
+    ADD_PROPERTY(const QVariantList &, relations, QVariantList)
+    ADD_PROPERTY(qint64, memoryBudget, qint64)
+    ADD_PROPERTY(int, coalesce, int)
+    ADD_PROPERTY(bool, appendOnly, bool)
+    ADD_PROPERTY(int, maxCount, int)
 
 #undef ADD_PROPERTY
 };
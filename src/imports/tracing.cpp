@@ -0,0 +1,161 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tracing.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QThread>
+
+Q_LOGGING_CATEGORY(lcDatabase, "me.qtquick.database")
+Q_LOGGING_CATEGORY(lcTrace, "me.qtquick.database.trace", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcSlowQuery, "me.qtquick.database.slow")
+
+namespace {
+
+struct Event {
+    // odd while a writer fills the slot
+    QAtomicInt sequence;
+    const char *category;
+    const char *name;
+    quintptr thread;
+    qint64 start;
+    qint64 end;
+    char detail[128];
+};
+
+const int ringSize = 8192;
+Event ring[ringSize];
+QAtomicInt head;
+
+int initialThreshold()
+{
+    bool ok = false;
+    int ret = qgetenv("QTQUICK_DATABASE_SLOW_QUERY").toInt(&ok);
+    return ok ? ret : 0;
+}
+
+QAtomicInt threshold(initialThreshold());
+
+}
+
+qint64 Tracing::now()
+{
+    static QElapsedTimer timer;
+    static bool started = (timer.start(), true);
+    Q_UNUSED(started)
+    return timer.nsecsElapsed();
+}
+
+void Tracing::record(const char *category, const char *name, qint64 start, qint64 end, const QString &detail)
+{
+    QByteArray text = detail.toUtf8();
+    // writers only collide on a slot after the ring wrapped around. the one
+    // turning the sequence from even to odd owns the slot, a late one drops its
+    // event; dump() skips the slots with an odd or changed sequence
+    Event &event = ring[uint(head.fetchAndAddRelaxed(1)) % ringSize];
+    int sequence = event.sequence.load();
+    if (sequence & 1 || !event.sequence.testAndSetAcquire(sequence, sequence + 1)) return;
+    event.category = category;
+    event.name = name;
+    event.thread = reinterpret_cast<quintptr>(QThread::currentThreadId());
+    event.start = start;
+    event.end = end;
+    qstrncpy(event.detail, text.constData(), sizeof(event.detail));
+    event.sequence.storeRelease(sequence + 2);
+}
+
+void Tracing::query(const QString &sql, const QVariantList &params, qint64 prepare, qint64 exec, qint64 fetch)
+{
+    int msecs = threshold.load();
+    if (msecs <= 0) return;
+    if ((prepare + exec + fetch) / 1000000 < msecs) return;
+
+    qCWarning(lcSlowQuery).nospace() << "slow query (prepare " << prepare / 1000 << "us, exec "
+                                     << exec / 1000 << "us, fetch " << fetch / 1000 << "us): "
+                                     << sql << " " << params;
+}
+
+int Tracing::slowQueryThreshold()
+{
+    return threshold.load();
+}
+
+void Tracing::setSlowQueryThreshold(int msecs)
+{
+    threshold.store(msecs);
+}
+
+bool Tracing::dump(const QString &fileName)
+{
+    QJsonArray events;
+    qint64 pid = QCoreApplication::applicationPid();
+    for (int i = 0; i < ringSize; i++) {
+        Event &slot = ring[i];
+        int sequence = slot.sequence.loadAcquire();
+        if (sequence == 0 || sequence & 1) continue;
+
+        const char *category = slot.category;
+        const char *name = slot.name;
+        quintptr thread = slot.thread;
+        qint64 start = slot.start;
+        qint64 end = slot.end;
+        char detail[sizeof(slot.detail)];
+        memcpy(detail, slot.detail, sizeof(detail));
+        detail[sizeof(detail) - 1] = '\0';
+        if (slot.sequence.loadAcquire() != sequence) continue;
+
+        QJsonObject event;
+        event.insert(QStringLiteral("cat"), QString::fromLatin1(category));
+        event.insert(QStringLiteral("name"), QString::fromLatin1(name));
+        event.insert(QStringLiteral("ph"), QStringLiteral("X"));
+        event.insert(QStringLiteral("pid"), pid);
+        event.insert(QStringLiteral("tid"), QString::number(thread));
+        event.insert(QStringLiteral("ts"), start / 1000.0);
+        event.insert(QStringLiteral("dur"), (end - start) / 1000.0);
+        if (detail[0]) {
+            QJsonObject args;
+            args.insert(QStringLiteral("detail"), QString::fromUtf8(detail));
+            event.insert(QStringLiteral("args"), args);
+        }
+        events.append(event);
+    }
+
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qCWarning(lcDatabase) << fileName << file.errorString();
+        return false;
+    }
+    QJsonObject root;
+    root.insert(QStringLiteral("traceEvents"), events);
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    return true;
+}
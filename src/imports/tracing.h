@@ -0,0 +1,79 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QVariant>
+
+// errors and warnings of the plugin
+Q_DECLARE_LOGGING_CATEGORY(lcDatabase)
+// enable debug output of this category to record trace events,
+// e.g. QT_LOGGING_RULES="me.qtquick.database.trace.debug=true"
+Q_DECLARE_LOGGING_CATEGORY(lcTrace)
+// queries slower than Tracing::slowQueryThreshold()
+Q_DECLARE_LOGGING_CATEGORY(lcSlowQuery)
+
+namespace Tracing {
+
+// nanoseconds since the first call, the clock used for all events
+qint64 now();
+
+inline bool isEnabled() { return lcTrace().isDebugEnabled(); }
+
+// stores an event in a fixed size ring buffer, safe to call from any thread
+void record(const char *category, const char *name, qint64 start, qint64 end, const QString &detail = QString());
+
+// logs to lcSlowQuery when prepare + exec + fetch exceeds the threshold
+void query(const QString &sql, const QVariantList &params, qint64 prepare, qint64 exec, qint64 fetch);
+
+// milliseconds, 0 disables; defaults to $QTQUICK_DATABASE_SLOW_QUERY
+int slowQueryThreshold();
+void setSlowQueryThreshold(int msecs);
+
+// writes the ring buffer in Chrome trace event format (chrome://tracing)
+bool dump(const QString &fileName);
+
+}
+
+class TraceScope
+{
+public:
+    TraceScope(const char *category, const char *name)
+        : m_category(category), m_name(name), m_start(Tracing::isEnabled() ? Tracing::now() : -1) {}
+    ~TraceScope() {
+        if (m_start >= 0)
+            Tracing::record(m_category, m_name, m_start, Tracing::now());
+    }
+
+private:
+    const char *m_category;
+    const char *m_name;
+    qint64 m_start;
+};
+
+#endif // TRACING_H
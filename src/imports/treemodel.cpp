@@ -0,0 +1,658 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "treemodel.h"
+#include "database.h"
+#include "tracing.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QPointer>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlQuery>
+
+// placeholders per IN (...) lookup, below the SQLite default limit of 999
+static const int batchSize = 500;
+
+// groups rows by parent, NULL and '' are different parents
+static QString parentId(const QVariant &key)
+{
+    return key.isNull() ? QString() : QLatin1Char('=') + key.toString();
+}
+
+struct Node
+{
+    Node(Node *parent) : parent(parent), row(0), fetched(false), hasChildren(-1) {}
+    ~Node() { qDeleteAll(children); }
+
+    Node *parent;
+    // in parent->children, see renumber()
+    int row;
+    QVariant key;
+    QVariantList values;
+    QList<Node *> children;
+    // children are loaded
+    bool fetched;
+    // -1 unknown until looked up with the siblings
+    int hasChildren;
+};
+
+class TreeModel::Private : public QObject
+{
+    Q_OBJECT
+public:
+    Private(TreeModel *parent);
+    ~Private();
+    void init();
+
+    Node *node(const QModelIndex &index) const;
+    QModelIndex index(Node *node) const;
+    QString orderBy() const;
+    Database::Result execute(const QString &sql, const QVariantList &params) const;
+    QList<Node *> nodes(Node *parent, const QList<QVariantList> &rows) const;
+    void lookupChildren(const QList<Node *> &nodes);
+    void fetch(Node *node);
+    void fetchSubtree(Node *node);
+    void setRoleNames(const QHash<int, QByteArray> &names);
+    // WITH RECURSIVE is there, not for MySQL before 8.0 and MariaDB before 10.2
+    bool hasRecursive();
+    // the children of parents by parentId(), in order
+    QHash<QString, QList<QVariantList> > childRows(const QVariantList &parents, bool *ok);
+    // applies the reloaded children to node and the fetched nodes below it
+    void update(Node *node, const QHash<QString, QList<QVariantList> > &rows, QList<Node *> *collapsed);
+    // the rows of the children from first on after they moved
+    void renumber(Node *node, int first);
+    // registers tableName with database for pollInterval
+    void observe(Database *database);
+
+private slots:
+    void databaseChanged(Database *database);
+    void openChanged(bool open);
+    void tableChanged(const QString &tableName);
+    void externalChanged(const QStringList &tableNames);
+    void reset();
+    // reloads the fetched levels, expanded nodes stay expanded
+    void refresh();
+
+private:
+    TreeModel *q;
+    QPointer<Database> database;
+
+public:
+    Node *root;
+    QHash<int, QByteArray> roleNames;
+    int keyColumn;
+    int parentColumn;
+    // -1 until hasRecursive() asked the server
+    int recursive;
+    QPointer<Database> observing;
+    QString observedTable;
+};
+
+TreeModel::Private::Private(TreeModel *parent)
+    : QObject(parent)
+    , q(parent)
+    , root(new Node(0))
+    , keyColumn(-1)
+    , parentColumn(-1)
+    , recursive(-1)
+{
+}
+
+TreeModel::Private::~Private()
+{
+    if (observing)
+        observing->unobserve(QStringList() << observedTable);
+    delete root;
+}
+
+void TreeModel::Private::init()
+{
+    connect(q, SIGNAL(databaseChanged(Database*)), this, SLOT(databaseChanged(Database*)));
+    connect(q, SIGNAL(tableNameChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(primaryKeyChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(parentKeyChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(rootKeyChanged(QVariant)), this, SLOT(reset()));
+    connect(q, SIGNAL(orderChanged(QString)), this, SLOT(reset()));
+    connect(q, SIGNAL(prefetchChanged(bool)), this, SLOT(reset()));
+
+    if (!q->m_database) {
+        q->database(qobject_cast<Database *>(q->QObject::parent()));
+    } else {
+        databaseChanged(q->m_database);
+    }
+}
+
+void TreeModel::Private::databaseChanged(Database *database)
+{
+    if (this->database) {
+        disconnect(this->database, 0, this, 0);
+    }
+    this->database = database;
+    if (database) {
+        connect(database, SIGNAL(openChanged(bool)), this, SLOT(openChanged(bool)));
+        connect(database, SIGNAL(tableChanged(QString)), this, SLOT(tableChanged(QString)));
+        connect(database, SIGNAL(externalChanged(QStringList)), this, SLOT(externalChanged(QStringList)));
+        openChanged(database->open());
+    }
+}
+
+void TreeModel::Private::openChanged(bool open)
+{
+    if (open) {
+        if (q->m_tableName.isEmpty() || q->m_parentKey.isEmpty()) {
+            qCWarning(lcDatabase) << "tableName and parentKey are required.";
+            return;
+        }
+        reset();
+    }
+}
+
+void TreeModel::Private::tableChanged(const QString &tableName)
+{
+    if (tableName.compare(q->m_tableName, Qt::CaseInsensitive) == 0)
+        refresh();
+}
+
+void TreeModel::Private::externalChanged(const QStringList &tableNames)
+{
+    foreach (const QString &tableName, tableNames) {
+        if (tableName.compare(q->m_tableName, Qt::CaseInsensitive) == 0) {
+            refresh();
+            return;
+        }
+    }
+}
+
+void TreeModel::Private::observe(Database *database)
+{
+    if (observing.data() == database && observedTable == q->m_tableName) return;
+    if (observing)
+        observing->unobserve(QStringList() << observedTable);
+    observing = database;
+    observedTable = q->m_tableName;
+    if (database)
+        database->observe(QStringList() << observedTable);
+}
+
+Node *TreeModel::Private::node(const QModelIndex &index) const
+{
+    return index.isValid() ? static_cast<Node *>(index.internalPointer()) : root;
+}
+
+QModelIndex TreeModel::Private::index(Node *node) const
+{
+    if (!node || node == root) return QModelIndex();
+    return q->createIndex(node->row, 0, node);
+}
+
+QString TreeModel::Private::orderBy() const
+{
+    return q->m_order.isEmpty() ? QString() : QString(" ORDER BY %1").arg(q->m_order);
+}
+
+Database::Result TreeModel::Private::execute(const QString &sql, const QVariantList &params) const
+{
+    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    Database::Result ret = Database::execute(db, sql, params, q->m_database->native());
+    if (!ret.ok)
+        qCWarning(lcDatabase) << sql << params << ret.error;
+    return ret;
+}
+
+QList<Node *> TreeModel::Private::nodes(Node *parent, const QList<QVariantList> &rows) const
+{
+    QList<Node *> ret;
+    foreach (const QVariantList &row, rows) {
+        Node *node = new Node(parent);
+        node->row = ret.count();
+        node->values = row;
+        node->key = row.value(keyColumn);
+        ret.append(node);
+    }
+    return ret;
+}
+
+// one query per batch of siblings instead of one per node
+void TreeModel::Private::lookupChildren(const QList<Node *> &nodes)
+{
+    for (int i = 0; i < nodes.count(); i += batchSize) {
+        QList<Node *> batch = nodes.mid(i, batchSize);
+        QStringList placeHolders;
+        QVariantList params;
+        foreach (Node *node, batch) {
+            if (node->hasChildren >= 0) continue;
+            placeHolders.append(QLatin1String("?"));
+            params.append(node->key);
+        }
+        if (params.isEmpty()) continue;
+
+        QString sql = QString("SELECT DISTINCT %1 FROM %2 WHERE %1 IN (%3)").arg(q->m_parentKey).arg(q->m_tableName).arg(placeHolders.join(", "));
+        Database::Result result = execute(sql, params);
+        QSet<QString> parents;
+        foreach (const QVariantList &row, result.rows) {
+            parents.insert(row.value(0).toString());
+        }
+        foreach (Node *node, batch) {
+            if (node->hasChildren < 0)
+                node->hasChildren = parents.contains(node->key.toString()) ? 1 : 0;
+        }
+    }
+}
+
+void TreeModel::Private::fetch(Node *node)
+{
+    if (node->fetched) return;
+    TraceScope trace("sql", "TreeModel::fetch");
+    node->fetched = true;
+
+    QString sql = QString("SELECT * FROM %1 WHERE ").arg(q->m_tableName);
+    QVariantList params;
+    QVariant key = node == root ? q->m_rootKey : node->key;
+    if (key.isNull()) {
+        sql += QString("%1 IS NULL").arg(q->m_parentKey);
+    } else {
+        sql += QString("%1=?").arg(q->m_parentKey);
+        params.append(key);
+    }
+    sql += orderBy();
+
+    Database::Result result = execute(sql, params);
+    setRoleNames(result.roleNames);
+    if (result.rows.isEmpty()) {
+        node->hasChildren = 0;
+        return;
+    }
+
+    QList<Node *> children = nodes(node, result.rows);
+    lookupChildren(children);
+    q->beginInsertRows(index(node), 0, children.count() - 1);
+    node->children = children;
+    q->endInsertRows();
+}
+
+void TreeModel::Private::setRoleNames(const QHash<int, QByteArray> &names)
+{
+    if (!roleNames.isEmpty() || names.isEmpty()) return;
+    roleNames = names;
+    keyColumn = roleNames.key(q->m_primaryKey.toUtf8(), -1) - Qt::UserRole;
+    if (keyColumn < 0)
+        qCWarning(lcDatabase) << q->m_primaryKey << "is not a column of" << q->m_tableName;
+    parentColumn = roleNames.key(q->m_parentKey.toUtf8(), -1) - Qt::UserRole;
+}
+
+bool TreeModel::Private::hasRecursive()
+{
+    if (recursive >= 0) return recursive;
+    QSqlDatabase db = QSqlDatabase::database(q->m_database->connectionName());
+    QString type = db.driverName();
+    if (type == QLatin1String("QSQLITE") || type == QLatin1String("QPSQL")) {
+        recursive = 1;
+    } else if (type == QLatin1String("QMYSQL")) {
+        QSqlQuery query(db);
+        QString version = query.exec(QStringLiteral("SELECT VERSION()")) && query.next() ? query.value(0).toString() : QString();
+        int major = version.section(QLatin1Char('.'), 0, 0).toInt();
+        int minor = version.section(QLatin1Char('.'), 1, 1).toInt();
+        if (version.contains(QLatin1String("MariaDB"), Qt::CaseInsensitive))
+            recursive = major > 10 || (major == 10 && minor >= 2);
+        else
+            recursive = major >= 8;
+    } else {
+        recursive = 0;
+    }
+    return recursive;
+}
+
+QHash<QString, QList<QVariantList> > TreeModel::Private::childRows(const QVariantList &parents, bool *ok)
+{
+    QHash<QString, QList<QVariantList> > ret;
+    *ok = true;
+    QVariantList keys;
+    bool null = false;
+    foreach (const QVariant &key, parents) {
+        if (key.isNull())
+            null = true;
+        else
+            keys.append(key);
+    }
+
+    QList<QPair<QString, QVariantList> > queries;
+    if (null)
+        queries.append(qMakePair(QString("%1 IS NULL").arg(q->m_parentKey), QVariantList()));
+    for (int i = 0; i < keys.count(); i += batchSize) {
+        QVariantList batch = keys.mid(i, batchSize);
+        QStringList placeHolders;
+        for (int j = 0; j < batch.count(); j++) {
+            placeHolders.append(QLatin1String("?"));
+        }
+        queries.append(qMakePair(QString("%1 IN (%2)").arg(q->m_parentKey).arg(placeHolders.join(", ")), batch));
+    }
+
+    for (int i = 0; i < queries.count(); i++) {
+        QString sql = QString("SELECT * FROM %1 WHERE %2%3").arg(q->m_tableName).arg(queries.at(i).first).arg(orderBy());
+        Database::Result result = execute(sql, queries.at(i).second);
+        if (!result.ok) {
+            *ok = false;
+            return ret;
+        }
+        setRoleNames(result.roleNames);
+        foreach (const QVariantList &row, result.rows) {
+            ret[parentId(row.value(parentColumn))].append(row);
+        }
+    }
+    return ret;
+}
+
+void TreeModel::Private::fetchSubtree(Node *node)
+{
+    TraceScope trace("sql", "TreeModel::fetchSubtree");
+    QVariant key = node == root ? q->m_rootKey : node->key;
+    QHash<QString, QList<QVariantList> > byParent;
+
+    if (hasRecursive()) {
+        QString start = key.isNull() ? QString("%1 IS NULL").arg(q->m_parentKey) : QString("%1=?").arg(q->m_parentKey);
+        QVariantList params;
+        if (!key.isNull())
+            params.append(key);
+
+        // every descendant in one query, grouped by parent below. UNION drops the
+        // rows seen already, a cycle in the data ends the recursion
+        QString sql = QString("WITH RECURSIVE subtree AS (SELECT * FROM %1 WHERE %2 UNION SELECT %1.* FROM %1 JOIN subtree ON %1.%3 = subtree.%4) SELECT * FROM subtree%5")
+                .arg(q->m_tableName).arg(start).arg(q->m_parentKey).arg(q->m_primaryKey).arg(orderBy());
+        Database::Result result = execute(sql, params);
+        if (!result.ok) return;
+        setRoleNames(result.roleNames);
+        foreach (const QVariantList &row, result.rows) {
+            byParent[parentId(row.value(parentColumn))].append(row);
+        }
+    } else {
+        // a query per level, the keys seen already are not asked for again
+        QSet<QString> seen;
+        QVariantList level;
+        level.append(key);
+        while (!level.isEmpty()) {
+            bool ok = true;
+            QHash<QString, QList<QVariantList> > rows = childRows(level, &ok);
+            if (!ok) return;
+            level.clear();
+            foreach (const QString &parent, rows.keys()) {
+                foreach (const QVariantList &row, rows.value(parent)) {
+                    QString id = parentId(row.value(keyColumn));
+                    if (seen.contains(id)) continue;
+                    seen.insert(id);
+                    byParent[parent].append(row);
+                    level.append(row.value(keyColumn));
+                }
+            }
+        }
+    }
+
+    // breadth first, each level is inserted below an already visible parent
+    QList<Node *> level;
+    level.append(node);
+    while (!level.isEmpty()) {
+        QList<Node *> next;
+        foreach (Node *parent, level) {
+            QList<QVariantList> rows = byParent.take(parentId(parent == root ? key : parent->key));
+            if (parent->fetched) {
+                next.append(parent->children);
+                continue;
+            }
+            parent->fetched = true;
+            parent->hasChildren = rows.isEmpty() ? 0 : 1;
+            if (rows.isEmpty()) continue;
+            QList<Node *> children = nodes(parent, rows);
+            q->beginInsertRows(index(parent), 0, children.count() - 1);
+            parent->children = children;
+            q->endInsertRows();
+            next.append(children);
+        }
+        level = next;
+    }
+}
+
+void TreeModel::Private::refresh()
+{
+    if (!q->m_database || !q->m_database->open()) return;
+    if (roleNames.isEmpty() || keyColumn < 0) {
+        reset();
+        return;
+    }
+    TraceScope trace("sql", "TreeModel::refresh");
+
+    QVariantList parents;
+    QList<Node *> level;
+    level.append(root);
+    while (!level.isEmpty()) {
+        QList<Node *> next;
+        foreach (Node *node, level) {
+            if (!node->fetched) continue;
+            parents.append(node == root ? q->m_rootKey : node->key);
+            next.append(node->children);
+        }
+        level = next;
+    }
+    if (parents.isEmpty()) return;
+
+    bool ok = true;
+    QHash<QString, QList<QVariantList> > rows = childRows(parents, &ok);
+    if (!ok) return;
+
+    QList<Node *> collapsed;
+    update(root, rows, &collapsed);
+
+    // children may have been added below or taken from the collapsed ones
+    QList<int> before;
+    foreach (Node *node, collapsed) {
+        before.append(node->hasChildren);
+        node->hasChildren = -1;
+    }
+    lookupChildren(collapsed);
+    for (int i = 0; i < collapsed.count(); i++) {
+        if (before.at(i) >= 0 && before.at(i) != collapsed.at(i)->hasChildren) {
+            QModelIndex changed = index(collapsed.at(i));
+            emit q->dataChanged(changed, changed);
+        }
+    }
+}
+
+void TreeModel::Private::update(Node *node, const QHash<QString, QList<QVariantList> > &rows, QList<Node *> *collapsed)
+{
+    QList<QVariantList> children = rows.value(parentId(node == root ? q->m_rootKey : node->key));
+    QModelIndex parent = index(node);
+
+    QSet<QString> keys;
+    foreach (const QVariantList &row, children) {
+        keys.insert(parentId(row.value(keyColumn)));
+    }
+    for (int i = node->children.count() - 1; i >= 0; i--) {
+        if (keys.contains(parentId(node->children.at(i)->key))) continue;
+        q->beginRemoveRows(parent, i, i);
+        delete node->children.takeAt(i);
+        renumber(node, i);
+        q->endRemoveRows();
+    }
+
+    // the rows before i are in place, the kept nodes move with their subtrees
+    for (int i = 0; i < children.count(); i++) {
+        const QVariantList &row = children.at(i);
+        QString key = parentId(row.value(keyColumn));
+        int j = i;
+        while (j < node->children.count() && parentId(node->children.at(j)->key) != key)
+            j++;
+        if (j == node->children.count()) {
+            Node *child = nodes(node, QList<QVariantList>() << row).first();
+            q->beginInsertRows(parent, i, i);
+            node->children.insert(i, child);
+            renumber(node, i);
+            q->endInsertRows();
+            continue;
+        }
+        if (j != i) {
+            q->beginMoveRows(parent, j, j, parent, i);
+            node->children.move(j, i);
+            renumber(node, i);
+            q->endMoveRows();
+        }
+        Node *child = node->children.at(i);
+        if (child->values != row) {
+            child->values = row;
+            QModelIndex changed = q->createIndex(i, 0, child);
+            emit q->dataChanged(changed, changed);
+        }
+    }
+    node->hasChildren = node->children.isEmpty() ? 0 : 1;
+
+    foreach (Node *child, node->children) {
+        if (child->fetched)
+            update(child, rows, collapsed);
+        else
+            collapsed->append(child);
+    }
+}
+
+void TreeModel::Private::renumber(Node *node, int first)
+{
+    for (int i = first; i < node->children.count(); i++)
+        node->children.at(i)->row = i;
+}
+
+void TreeModel::Private::reset()
+{
+    if (!q->m_database || !q->m_database->open()) return;
+    if (q->m_tableName.isEmpty() || q->m_parentKey.isEmpty()) return;
+    observe(q->m_database);
+
+    q->beginResetModel();
+    delete root;
+    root = new Node(0);
+    roleNames.clear();
+    keyColumn = -1;
+    parentColumn = -1;
+    q->endResetModel();
+
+    if (q->m_prefetch)
+        fetchSubtree(root);
+    else
+        fetch(root);
+}
+
+TreeModel::TreeModel(QObject *parent)
+    : QAbstractItemModel(parent)
+    , d(new Private(this))
+    , m_database(0)
+    , m_primaryKey(QStringLiteral("id"))
+    , m_prefetch(false)
+{
+}
+
+TreeModel::~TreeModel()
+{
+}
+
+void TreeModel::classBegin()
+{
+}
+
+void TreeModel::componentComplete()
+{
+    d->init();
+}
+
+QModelIndex TreeModel::index(int row, int column, const QModelIndex &parent) const
+{
+    Node *node = d->node(parent);
+    if (column != 0 || row < 0 || row >= node->children.count()) return QModelIndex();
+    return createIndex(row, column, node->children.at(row));
+}
+
+QModelIndex TreeModel::parent(const QModelIndex &index) const
+{
+    if (!index.isValid()) return QModelIndex();
+    return d->index(d->node(index)->parent);
+}
+
+int TreeModel::rowCount(const QModelIndex &parent) const
+{
+    return d->node(parent)->children.count();
+}
+
+int TreeModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent)
+    return 1;
+}
+
+bool TreeModel::hasChildren(const QModelIndex &parent) const
+{
+    Node *node = d->node(parent);
+    if (node->fetched) return !node->children.isEmpty();
+    return node == d->root || node->hasChildren != 0;
+}
+
+bool TreeModel::canFetchMore(const QModelIndex &parent) const
+{
+    Node *node = d->node(parent);
+    return !node->fetched && node->hasChildren != 0;
+}
+
+void TreeModel::fetchMore(const QModelIndex &parent)
+{
+    if (!m_database || !m_database->open()) return;
+    d->fetch(d->node(parent));
+}
+
+void TreeModel::fetchSubtree(const QModelIndex &index)
+{
+    if (!m_database || !m_database->open()) return;
+    d->fetchSubtree(d->node(index));
+}
+
+QVariant TreeModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || role < Qt::UserRole) return QVariant();
+    return d->node(index)->values.value(role - Qt::UserRole);
+}
+
+QHash<int, QByteArray> TreeModel::roleNames() const
+{
+    return d->roleNames;
+}
+
+QVariantMap TreeModel::get(const QModelIndex &index) const
+{
+    QVariantMap ret;
+    if (!index.isValid()) return ret;
+    const QVariantList &values = d->node(index)->values;
+    for (int i = 0; i < values.count(); i++) {
+        ret.insert(QString::fromUtf8(d->roleNames.value(Qt::UserRole + i)), values.at(i));
+    }
+    return ret;
+}
+
+#include "treemodel.moc"
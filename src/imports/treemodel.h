@@ -0,0 +1,106 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TREEMODEL_H
+#define TREEMODEL_H
+
+#include <QtCore/QAbstractItemModel>
+
+#include <QtQml/QQmlParserStatus>
+
+class Database;
+
+class TreeModel : public QAbstractItemModel, public QQmlParserStatus
+{
+    Q_OBJECT
+
+    Q_PROPERTY(Database *database READ database WRITE database NOTIFY databaseChanged)
+    Q_PROPERTY(QString tableName READ tableName WRITE tableName NOTIFY tableNameChanged)
+    Q_PROPERTY(QString primaryKey READ primaryKey WRITE primaryKey NOTIFY primaryKeyChanged)
+    Q_PROPERTY(QString parentKey READ parentKey WRITE parentKey NOTIFY parentKeyChanged)
+    Q_PROPERTY(QVariant rootKey READ rootKey WRITE rootKey NOTIFY rootKeyChanged)
+    Q_PROPERTY(QString order READ order WRITE order NOTIFY orderChanged)
+    Q_PROPERTY(bool prefetch READ prefetch WRITE prefetch NOTIFY prefetchChanged)
+
+    Q_INTERFACES(QQmlParserStatus)
+public:
+    explicit TreeModel(QObject *parent = 0);
+    ~TreeModel();
+
+    Q_INVOKABLE QVariantMap get(const QModelIndex &index) const;
+    // loads every level below index with one recursive query, one query per
+    // level where the server has no WITH RECURSIVE (MySQL before 8.0)
+    Q_INVOKABLE void fetchSubtree(const QModelIndex &index = QModelIndex());
+
+    virtual QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const;
+    virtual QModelIndex parent(const QModelIndex &index) const;
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual bool hasChildren(const QModelIndex &parent = QModelIndex()) const;
+    virtual bool canFetchMore(const QModelIndex &parent) const;
+    virtual void fetchMore(const QModelIndex &parent);
+    virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    virtual QHash<int, QByteArray> roleNames() const;
+
+    virtual void classBegin();
+    virtual void componentComplete();
+
+signals:
+    void databaseChanged(Database *database);
+    void tableNameChanged(const QString &tableName);
+    void primaryKeyChanged(const QString &primaryKey);
+    void parentKeyChanged(const QString &parentKey);
+    void rootKeyChanged(const QVariant &rootKey);
+    void orderChanged(const QString &order);
+    void prefetchChanged(bool prefetch);
+
+private:
+    class Private;
+    Private *d;
+
+#define ADD_PROPERTY(type, name, type2) \
+public: \
+    type name() const { return m_##name; } \
+    void name(type name) { \
+        if (m_##name == name) return; \
+        m_##name = name; \
+        emit name##Changed(name); \
+    } \
+private: \
+    type2 m_##name;
+
+    ADD_PROPERTY(Database *, database, Database *)
+    ADD_PROPERTY(const QString &, tableName, QString)
+    ADD_PROPERTY(const QString &, primaryKey, QString)
+    ADD_PROPERTY(const QString &, parentKey, QString)
+    ADD_PROPERTY(const QVariant &, rootKey, QVariant)
+    ADD_PROPERTY(const QString &, order, QString)
+    ADD_PROPERTY(bool, prefetch, bool)
+
+#undef ADD_PROPERTY
+};
+
+#endif // TREEMODEL_H
@@ -0,0 +1,376 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "workerpool.h"
+#include "database.h"
+#include "sqlitehandle.h"
+#include "tracing.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QPair>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+#include <QtSql/QSqlQuery>
+
+class WorkerPool::Private
+{
+public:
+    Private(WorkerPool *parent, Database *database);
+
+    bool take(Task *task, quint64 *id);
+    void startWorker();
+
+    WorkerPool *q;
+    Database *database;
+    // a copy would not see the same data, run tasks in the thread of database
+    bool inlineMode;
+    int maxThreads;
+
+    // everything below is guarded by mutex
+    QMutex mutex;
+    QWaitCondition wake;
+    // (-priority, id), so the first entry is the oldest of the highest priority
+    QMap<QPair<int, quint64>, Task> queue;
+    QHash<quint64, int> priorities;
+    QHash<quint64, Dropped> dropped;
+    QList<Worker *> workers;
+    // workers whose statement the server is asked to cancel, they take no
+    // other task until it is done so that the cancel can not hit that one
+    QList<Worker *> cancels;
+    QWaitCondition cancelWake;
+    QWaitCondition cancelled;
+    Canceller *canceller;
+    quint64 serial;
+    int idle;
+    bool stopping;
+};
+
+class WorkerPool::Worker : public QThread
+{
+public:
+    Worker(WorkerPool::Private *pool, int index)
+        : pool(pool)
+        , connectionName(QString("%1/worker%2").arg(pool->database->connectionName()).arg(index))
+        , current(0)
+        , api(0)
+        , handle(0)
+        , backendId(0)
+        , cancelling(false)
+    {}
+
+    // called with pool->mutex held, SQLite is interrupted right away, a
+    // server is asked by the canceller thread
+    void interrupt();
+
+protected:
+    void run();
+
+public:
+    WorkerPool::Private *pool;
+    QString connectionName;
+    // guarded by pool->mutex
+    quint64 current;
+    const SqliteApi *api;
+    sqlite3 *handle;
+    int backendId;
+    // guarded by pool->mutex, a cancel is on its way to the server
+    bool cancelling;
+};
+
+// sends the cancels to the server from a connection of its own, they are a
+// round trip that should hold up neither the gui thread nor the workers
+class WorkerPool::Canceller : public QThread
+{
+public:
+    Canceller(WorkerPool::Private *pool)
+        : pool(pool)
+        , connectionName(QString("%1/canceller").arg(pool->database->connectionName()))
+    {}
+
+protected:
+    void run();
+
+private:
+    WorkerPool::Private *pool;
+    QString connectionName;
+};
+
+WorkerPool::Private::Private(WorkerPool *parent, Database *database)
+    : q(parent)
+    , database(database)
+    , inlineMode(!database->canClone())
+    , maxThreads(qMax(1, QThread::idealThreadCount()))
+    , canceller(0)
+    , serial(0)
+    , idle(0)
+    , stopping(false)
+{
+}
+
+bool WorkerPool::Private::take(Task *task, quint64 *id)
+{
+    if (queue.isEmpty()) return false;
+    QMap<QPair<int, quint64>, Task>::iterator first = queue.begin();
+    *id = first.key().second;
+    *task = first.value();
+    queue.erase(first);
+    priorities.remove(*id);
+    dropped.remove(*id);
+    return true;
+}
+
+void WorkerPool::Private::startWorker()
+{
+    Worker *worker = new Worker(this, workers.count());
+    workers.append(worker);
+    worker->start();
+}
+
+void WorkerPool::Worker::run()
+{
+    QSqlDatabase db = pool->database->clone(connectionName);
+    {
+        QMutexLocker locker(&pool->mutex);
+        api = SqliteApi::get(db);
+        handle = api ? sqliteHandle(db) : 0;
+    }
+    QSqlQuery query(db);
+    if (db.driverName() == QLatin1String("QPSQL")) {
+        if (query.exec(QLatin1String("SELECT pg_backend_pid()")) && query.next())
+            backendId = query.value(0).toInt();
+    } else if (db.driverName() == QLatin1String("QMYSQL")) {
+        if (query.exec(QLatin1String("SELECT CONNECTION_ID()")) && query.next())
+            backendId = query.value(0).toInt();
+    }
+    query = QSqlQuery();
+
+    QMutexLocker locker(&pool->mutex);
+    forever {
+        Task task;
+        quint64 id = 0;
+        while (!pool->stopping && !pool->take(&task, &id)) {
+            pool->idle++;
+            pool->wake.wait(&pool->mutex);
+            pool->idle--;
+        }
+        if (pool->stopping) break;
+
+        current = id;
+        locker.unlock();
+        task(db);
+        locker.relock();
+        current = 0;
+        while (cancelling)
+            pool->cancelled.wait(&pool->mutex);
+    }
+    handle = 0;
+    locker.unlock();
+
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+    // connections tasks opened for this worker, e.g. Database::shard()
+    foreach (const QString &name, QSqlDatabase::connectionNames()) {
+        if (name.startsWith(connectionName + QLatin1Char('/'))) {
+            QSqlDatabase::database(name, false).close();
+            QSqlDatabase::removeDatabase(name);
+        }
+    }
+}
+
+void WorkerPool::Worker::interrupt()
+{
+    // the handle is closed only after the worker cleared it under the mutex
+    if (handle) {
+        api->interrupt(handle);
+        return;
+    }
+    if (backendId <= 0 || cancelling) return;
+    cancelling = true;
+    pool->cancels.append(this);
+    if (!pool->canceller) {
+        pool->canceller = new Canceller(pool);
+        pool->canceller->start();
+    }
+    pool->cancelWake.wakeOne();
+}
+
+void WorkerPool::Canceller::run()
+{
+    QSqlDatabase db = pool->database->clone(connectionName);
+    QMutexLocker locker(&pool->mutex);
+    forever {
+        while (!pool->stopping && pool->cancels.isEmpty())
+            pool->cancelWake.wait(&pool->mutex);
+        if (pool->cancels.isEmpty()) break;
+
+        Worker *worker = pool->cancels.takeFirst();
+        int backendId = worker->backendId;
+        locker.unlock();
+        // the worker is still on the task or waits for us, nothing else runs there
+        QSqlQuery query(db);
+        if (db.driverName() == QLatin1String("QPSQL")) {
+            query.exec(QString("SELECT pg_cancel_backend(%1)").arg(backendId));
+        } else if (db.driverName() == QLatin1String("QMYSQL")) {
+            query.exec(QString("KILL QUERY %1").arg(backendId));
+        }
+        query = QSqlQuery();
+        locker.relock();
+        worker->cancelling = false;
+        pool->cancelled.wakeAll();
+    }
+    locker.unlock();
+
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+WorkerPool::WorkerPool(Database *database)
+    : QObject(database)
+    , d(new Private(this, database))
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    QList<Dropped> dropped;
+    {
+        QMutexLocker locker(&d->mutex);
+        d->stopping = true;
+        d->queue.clear();
+        d->priorities.clear();
+        dropped = d->dropped.values();
+        d->dropped.clear();
+        foreach (Worker *worker, d->workers) {
+            if (worker->current)
+                worker->interrupt();
+        }
+        d->wake.wakeAll();
+        d->cancelWake.wakeAll();
+    }
+    // e.g. Database::fanOut() waits for them
+    foreach (const Dropped &callback, dropped) {
+        callback();
+    }
+    foreach (Worker *worker, d->workers) {
+        worker->wait();
+        delete worker;
+    }
+    // done with the cancels of the workers above
+    if (d->canceller) {
+        d->canceller->wait();
+        delete d->canceller;
+    }
+    delete d;
+}
+
+int WorkerPool::maxThreadCount() const
+{
+    return d->inlineMode ? 0 : d->maxThreads;
+}
+
+int WorkerPool::threadCount() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->workers.count();
+}
+
+quint64 WorkerPool::submit(const Task &task, int priority, const Dropped &dropped)
+{
+    QMutexLocker locker(&d->mutex);
+    // a task queueing a follow-up while the pool shuts down
+    if (d->stopping) return 0;
+    quint64 id = ++d->serial;
+    d->queue.insert(qMakePair(-priority, id), task);
+    d->priorities.insert(id, priority);
+    if (dropped)
+        d->dropped.insert(id, dropped);
+
+    if (d->inlineMode) {
+        QMetaObject::invokeMethod(this, "runInline", Qt::QueuedConnection);
+    } else {
+        // idle workers pick tasks from the shared queue, so a task never
+        // waits behind a busy worker while another one is free
+        if (d->idle == 0 && d->workers.count() < d->maxThreads)
+            d->startWorker();
+        d->wake.wakeOne();
+    }
+    return id;
+}
+
+void WorkerPool::setPriority(quint64 id, int priority)
+{
+    QMutexLocker locker(&d->mutex);
+    if (!d->priorities.contains(id)) return;
+    QPair<int, quint64> key = qMakePair(-d->priorities.value(id), id);
+    Task task = d->queue.take(key);
+    d->queue.insert(qMakePair(-priority, id), task);
+    d->priorities.insert(id, priority);
+}
+
+void WorkerPool::cancel(quint64 id)
+{
+    QMutexLocker locker(&d->mutex);
+    if (d->priorities.contains(id)) {
+        d->queue.remove(qMakePair(-d->priorities.take(id), id));
+        Dropped dropped = d->dropped.take(id);
+        locker.unlock();
+        if (dropped)
+            dropped();
+        return;
+    }
+    foreach (Worker *worker, d->workers) {
+        if (worker->current == id) {
+            worker->interrupt();
+            break;
+        }
+    }
+}
+
+bool WorkerPool::take(quint64 id, Task *task)
+{
+    QMutexLocker locker(&d->mutex);
+    if (!d->priorities.contains(id)) return false;
+    *task = d->queue.take(qMakePair(-d->priorities.take(id), id));
+    d->dropped.remove(id);
+    return true;
+}
+
+void WorkerPool::runInline()
+{
+    Task task;
+    quint64 id = 0;
+    {
+        QMutexLocker locker(&d->mutex);
+        if (!d->take(&task, &id)) return;
+    }
+    TraceScope trace("pool", "WorkerPool::runInline");
+    task(QSqlDatabase::database(d->database->connectionName()));
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QtCore/QObject>
+#include <QtSql/QSqlDatabase>
+
+#include <functional>
+
+class Database;
+
+// a bounded set of threads, each with its own connection to the database,
+// running queued tasks highest priority first
+class WorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::function<void(QSqlDatabase)> Task;
+    // called instead of a queued task that will never run
+    typedef std::function<void()> Dropped;
+
+    explicit WorkerPool(Database *database);
+    ~WorkerPool();
+
+    int maxThreadCount() const;
+    int threadCount() const;
+
+    // 0 when the pool is shutting down, the task does not run then
+    quint64 submit(const Task &task, int priority = 0, const Dropped &dropped = Dropped());
+    void setPriority(quint64 id, int priority);
+    // drops a queued task or interrupts the statement of a running one
+    void cancel(quint64 id);
+    // removes a task nobody has started yet, for the caller to run it instead
+    bool take(quint64 id, Task *task);
+
+private slots:
+    void runInline();
+
+private:
+    class Worker;
+    class Canceller;
+    class Private;
+    Private *d;
+};
+
+#endif // WORKERPOOL_H
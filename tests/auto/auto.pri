@@ -0,0 +1,32 @@
+# the plugin sources without the plugin, the tests create the types themselves
+QT = core sql qml testlib
+
+IMPORTS = $$PWD/../../src/imports
+INCLUDEPATH += $$IMPORTS
+
+HEADERS += \
+    $$IMPORTS/database.h \
+    $$IMPORTS/tablemodel.h \
+    $$IMPORTS/sqlmodel.h \
+    $$IMPORTS/aggregatemodel.h \
+    $$IMPORTS/treemodel.h \
+    $$IMPORTS/blob.h \
+    $$IMPORTS/sqlitehandle.h \
+    $$IMPORTS/sqliteengine.h \
+    $$IMPORTS/tracing.h \
+    $$IMPORTS/workerpool.h
+
+SOURCES += \
+    $$IMPORTS/database.cpp \
+    $$IMPORTS/tablemodel.cpp \
+    $$IMPORTS/sqlmodel.cpp \
+    $$IMPORTS/aggregatemodel.cpp \
+    $$IMPORTS/treemodel.cpp \
+    $$IMPORTS/blob.cpp \
+    $$IMPORTS/sqlitehandle.cpp \
+    $$IMPORTS/sqliteengine.cpp \
+    $$IMPORTS/tracing.cpp \
+    $$IMPORTS/workerpool.cpp
+
+# as in imports.pro
+unix: LIBS += $$QMAKE_LIBS_DYNLOAD
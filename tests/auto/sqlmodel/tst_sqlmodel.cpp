@@ -0,0 +1,263 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "database.h"
+#include "sqlmodel.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QSemaphore>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QThread>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+#include <QtTest/QtTest>
+
+#include <functional>
+
+// runs a function on a thread of its own
+class Runner : public QThread
+{
+public:
+    explicit Runner(const std::function<void()> &function) : function(function) {}
+
+protected:
+    void run() { function(); }
+
+private:
+    std::function<void()> function;
+};
+
+class tst_SqlModel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void cache();
+    void cacheUnchanged();
+    void sharedResult();
+    void sharedInvalidated();
+    void sharedJoined();
+
+private:
+    SqlModel *model(const QString &query, bool cache);
+
+    QTemporaryDir dir;
+    Database *database;
+};
+
+static const QString connectionName = QStringLiteral("tst_sqlmodel");
+
+void tst_SqlModel::initTestCase()
+{
+    // the cache files go to a location of their own, left over ones are dropped
+    QStandardPaths::setTestModeEnabled(true);
+    QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/sqlmodel")).removeRecursively();
+
+    QVERIFY(dir.isValid());
+    database = new Database(this);
+    database->connectionName(connectionName);
+    database->type(QStringLiteral("QSQLITE"));
+    database->databaseName(dir.path() + QStringLiteral("/tst_sqlmodel.db"));
+    QVERIFY(database->open());
+
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    QVERIFY2(query.exec(QStringLiteral("CREATE TABLE reports (id INTEGER PRIMARY KEY, name TEXT)")), qPrintable(query.lastError().text()));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO reports (name) VALUES ('a'), ('b'), ('c')")));
+}
+
+void tst_SqlModel::cleanupTestCase()
+{
+    delete database;
+    database = 0;
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+SqlModel *tst_SqlModel::model(const QString &query, bool cache)
+{
+    SqlModel *ret = new SqlModel;
+    ret->database(database);
+    ret->query(query);
+    ret->cache(cache);
+    ret->componentComplete();
+    return ret;
+}
+
+// the rows of the last run show up before the query runs again
+void tst_SqlModel::cache()
+{
+    QString sql = QStringLiteral("SELECT id, name FROM reports ORDER BY id");
+    QScopedPointer<SqlModel> first(model(sql, true));
+    QTRY_COMPARE(first->count(), 3);
+    first.reset();
+
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    QVERIFY(query.exec(QStringLiteral("DELETE FROM reports WHERE id = 3")));
+
+    QScopedPointer<SqlModel> second(model(sql, true));
+    QCOMPARE(second->count(), 3);
+    QCOMPARE(second->get(2).value(QStringLiteral("name")).toString(), QStringLiteral("c"));
+    QTRY_COMPARE(second->count(), 2);
+    QCOMPARE(second->get(1).value(QStringLiteral("name")).toString(), QStringLiteral("b"));
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO reports (id, name) VALUES (3, 'c')")));
+}
+
+// a live result equal to the cached one leaves the rows alone
+void tst_SqlModel::cacheUnchanged()
+{
+    QString sql = QStringLiteral("SELECT name FROM reports ORDER BY id");
+    QScopedPointer<SqlModel> first(model(sql, true));
+    QTRY_COMPARE(first->count(), 3);
+    first.reset();
+
+    SqlModel second;
+    second.database(database);
+    second.query(sql);
+    second.cache(true);
+    QSignalSpy timer(&second, SIGNAL(timerChanged(int)));
+    QSignalSpy inserted(&second, SIGNAL(rowsInserted(QModelIndex,int,int)));
+    second.componentComplete();
+    QCOMPARE(second.count(), 3);
+    QCOMPARE(inserted.count(), 1);
+
+    QTRY_COMPARE(timer.count(), 1);
+    QCOMPARE(inserted.count(), 1);
+    QCOMPARE(second.count(), 3);
+}
+
+static Database::Result result(int rows)
+{
+    Database::Result ret;
+    ret.ok = true;
+    for (int i = 0; i < rows; i++)
+        ret.rows.append(QVariantList() << i);
+    return ret;
+}
+
+// identical queries run once, the params are part of the key
+void tst_SqlModel::sharedResult()
+{
+    QString sql = QStringLiteral("SELECT COUNT(*) FROM reports WHERE name = ?");
+    int runs = 0;
+    std::function<Database::Result()> exec = [&]() { runs++; return result(1); };
+
+    quint64 first = 0;
+    quint64 second = 0;
+    quint64 other = 0;
+    QVERIFY(Database::sharedResult(connectionName, sql, QVariantList() << "a", exec, &first).ok);
+    // the whitespace does not count
+    QVERIFY(Database::sharedResult(connectionName, sql + QStringLiteral("  "), QVariantList() << "a", exec, &second).ok);
+    QCOMPARE(runs, 1);
+    QCOMPARE(second, first);
+
+    QVERIFY(Database::sharedResult(connectionName, sql, QVariantList() << "b", exec, &other).ok);
+    QCOMPARE(runs, 2);
+    QVERIFY(other != first);
+
+    Database::releaseResult(first);
+    Database::releaseResult(second);
+    Database::releaseResult(other);
+
+    // nobody holds it anymore
+    QVERIFY(Database::sharedResult(connectionName, sql, QVariantList() << "a", exec, &first).ok);
+    QCOMPARE(runs, 3);
+    Database::releaseResult(first);
+}
+
+// a write to a table the query reads drops the entry, the holders keep their copy
+void tst_SqlModel::sharedInvalidated()
+{
+    QString sql = QStringLiteral("SELECT name FROM reports");
+    int runs = 0;
+    std::function<Database::Result()> exec = [&]() { runs++; return result(runs); };
+
+    quint64 first = 0;
+    quint64 second = 0;
+    QCOMPARE(Database::sharedResult(connectionName, sql, QVariantList(), exec, &first).rows.count(), 1);
+
+    Database::invalidateResults(connectionName, QStringLiteral("other"));
+    Database::invalidateResults(QStringLiteral("tst_sqlmodel_other"), QStringLiteral("reports"));
+    QCOMPARE(Database::sharedResult(connectionName, sql, QVariantList(), exec, &second).rows.count(), 1);
+    QCOMPARE(runs, 1);
+    Database::releaseResult(second);
+
+    Database::invalidateResults(connectionName, QStringLiteral("Reports"));
+    QCOMPARE(Database::sharedResult(connectionName, sql, QVariantList(), exec, &second).rows.count(), 2);
+    QCOMPARE(runs, 2);
+    QVERIFY(second != first);
+
+    Database::releaseResult(first);
+    Database::releaseResult(second);
+}
+
+// a caller that must not block joins the query in flight and gets the result later
+void tst_SqlModel::sharedJoined()
+{
+    QString sql = QStringLiteral("SELECT id FROM reports");
+    QSemaphore started;
+    QSemaphore proceed;
+    quint64 running = 0;
+    Runner runner([&]() {
+        Database::sharedResult(connectionName, sql, QVariantList(), [&]() {
+            started.release();
+            proceed.acquire();
+            return result(3);
+        }, &running);
+    });
+    runner.start();
+    started.acquire();
+
+    quint64 ticket = 0;
+    bool pending = false;
+    quint64 joinedTicket = 0;
+    int joinedRows = -1;
+    Database::Result ret = Database::sharedResult(connectionName, sql, QVariantList(), []() { return Database::Result(); }, &ticket,
+                                                  [&](quint64 id, const Database::Result &shared) {
+        joinedTicket = id;
+        joinedRows = shared.rows.count();
+    }, &pending);
+    QVERIFY(pending);
+    QVERIFY(!ret.ok);
+
+    proceed.release();
+    QVERIFY(runner.wait(5000));
+    QCOMPARE(joinedTicket, ticket);
+    QCOMPARE(joinedTicket, running);
+    QCOMPARE(joinedRows, 3);
+
+    Database::releaseResult(running);
+    Database::releaseResult(ticket);
+}
+
+QTEST_MAIN(tst_SqlModel)
+
+#include "tst_sqlmodel.moc"
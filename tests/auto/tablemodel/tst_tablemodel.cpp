@@ -0,0 +1,305 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "database.h"
+#include "tablemodel.h"
+
+#include <QtCore/QTemporaryDir>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+#include <QtSql/QSqlRecord>
+
+#include <QtTest/QtTest>
+
+// the columns are the properties added to TableModel, as in QML
+class Item : public TableModel
+{
+    Q_OBJECT
+    Q_PROPERTY(int id MEMBER m_id)
+    Q_PROPERTY(QString title MEMBER m_title)
+    Q_PROPERTY(QString slug MEMBER m_slug)
+public:
+    Item() : m_id(0) {}
+
+private:
+    int m_id;
+    QString m_title;
+    QString m_slug;
+};
+
+class RankedItem : public Item
+{
+    Q_OBJECT
+    Q_PROPERTY(int rank MEMBER m_rank)
+public:
+    RankedItem() : m_rank(5) {}
+
+private:
+    int m_rank;
+};
+
+class tst_TableModel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void cleanup();
+    void migrate();
+    void resumeBackfill();
+    void evict();
+    void coalesce();
+
+private:
+    bool exec(const QString &sql);
+    QVariantList column(const QString &name);
+    void setUp(TableModel *model);
+
+    QTemporaryDir dir;
+    Database *database;
+};
+
+static const QString connectionName = QStringLiteral("tst_tablemodel");
+
+void tst_TableModel::initTestCase()
+{
+    QVERIFY(dir.isValid());
+    database = new Database(this);
+    database->connectionName(connectionName);
+    database->type(QStringLiteral("QSQLITE"));
+    database->databaseName(dir.path() + QStringLiteral("/tst_tablemodel.db"));
+    QVERIFY(database->open());
+}
+
+void tst_TableModel::cleanupTestCase()
+{
+    delete database;
+    database = 0;
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+void tst_TableModel::cleanup()
+{
+    QVERIFY(exec(QStringLiteral("DROP TABLE IF EXISTS items")));
+    QVERIFY(exec(QStringLiteral("DROP TABLE IF EXISTS __database_backfill")));
+}
+
+bool tst_TableModel::exec(const QString &sql)
+{
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    if (!query.exec(sql)) {
+        qWarning() << sql << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+// the values of a column of items by id
+QVariantList tst_TableModel::column(const QString &name)
+{
+    QVariantList ret;
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    if (!query.exec(QString("SELECT %1 FROM items ORDER BY id").arg(name)))
+        qWarning() << query.lastQuery() << query.lastError().text();
+    while (query.next())
+        ret.append(query.value(0));
+    return ret;
+}
+
+void tst_TableModel::setUp(TableModel *model)
+{
+    model->database(database);
+    model->tableName(QStringLiteral("items"));
+    model->primaryKey(QStringLiteral("id"));
+    model->order(QStringLiteral("id"));
+}
+
+// the declared columns missing from an existing table are added, the existing
+// rows get the default and then the backfilled value
+void tst_TableModel::migrate()
+{
+    QVERIFY(exec(QStringLiteral("CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, title TEXT)")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO items (title) VALUES ('Alpha'), ('Beta'), (NULL)")));
+
+    RankedItem model;
+    setUp(&model);
+    QVariantMap backfill;
+    backfill.insert(QStringLiteral("slug"), QStringLiteral("lower(title)"));
+    model.backfill(backfill);
+    QSignalSpy finished(&model, SIGNAL(backfillFinished(QString,int)));
+    model.componentComplete();
+
+    QSqlRecord record = QSqlDatabase::database(connectionName).record(QStringLiteral("items"));
+    QVERIFY(record.contains(QStringLiteral("slug")));
+    QVERIFY(record.contains(QStringLiteral("rank")));
+    QCOMPARE(column(QStringLiteral("rank")), QVariantList() << 5 << 5 << 5);
+    QCOMPARE(model.count(), 3);
+
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.at(0).at(0).toString(), QStringLiteral("slug"));
+    QCOMPARE(finished.at(0).at(1).toInt(), 3);
+    QVariantList slugs = column(QStringLiteral("slug"));
+    QCOMPARE(slugs.value(0).toString(), QStringLiteral("alpha"));
+    QCOMPARE(slugs.value(1).toString(), QStringLiteral("beta"));
+    QVERIFY(slugs.value(2).isNull());
+
+    // the rows on screen were selected again
+    QCOMPARE(model.get(0).value(QStringLiteral("slug")).toString(), QStringLiteral("alpha"));
+
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM __database_backfill")));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+}
+
+// a backfill cut short by the end of the process goes on after the last key it committed
+void tst_TableModel::resumeBackfill()
+{
+    QVERIFY(exec(QStringLiteral("CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, title TEXT, slug TEXT)")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO items (title) VALUES ('A'), ('B'), ('C'), ('D')")));
+    QVERIFY(exec(QStringLiteral("CREATE TABLE __database_backfill (tableName VARCHAR(255), columnName VARCHAR(255), expression TEXT, doneKey TEXT, lastKey TEXT, "
+                                "PRIMARY KEY(tableName, columnName))")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO __database_backfill VALUES ('items', 'slug', 'lower(title)', '2', '3')")));
+
+    Item model;
+    setUp(&model);
+    QSignalSpy finished(&model, SIGNAL(backfillFinished(QString,int)));
+    model.componentComplete();
+
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(finished.at(0).at(1).toInt(), 1);
+    // done before, done now and inserted after it started
+    QVariantList slugs = column(QStringLiteral("slug"));
+    QVERIFY(slugs.value(0).isNull());
+    QVERIFY(slugs.value(1).isNull());
+    QCOMPARE(slugs.value(2).toString(), QStringLiteral("c"));
+    QVERIFY(slugs.value(3).isNull());
+}
+
+// rows far from the last accessed one keep their key only and come back on access
+void tst_TableModel::evict()
+{
+    QVERIFY(exec(QStringLiteral("CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, title TEXT, slug TEXT)")));
+    QSqlDatabase db = QSqlDatabase::database(connectionName);
+    QVERIFY(db.transaction());
+    QSqlQuery query(db);
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO items (id, title, slug) VALUES (?, ?, ?)")));
+    for (int i = 0; i < 3000; i++) {
+        query.addBindValue(i);
+        query.addBindValue(QString("item %1").arg(i));
+        // wide rows, a key alone takes a fraction of one
+        query.addBindValue(QString("%1 %2").arg(i).arg(QString(200, QLatin1Char('x'))));
+        QVERIFY(query.exec());
+    }
+    QVERIFY(db.commit());
+
+    Item all;
+    setUp(&all);
+    all.componentComplete();
+    QCOMPARE(all.count(), 3000);
+
+    Item bounded;
+    setUp(&bounded);
+    bounded.memoryBudget(1);
+    bounded.componentComplete();
+    QCOMPARE(bounded.count(), 3000);
+    QVERIFY(bounded.residentBytes() < all.residentBytes() / 2);
+
+    // a jump away, then back
+    QCOMPARE(bounded.get(2500).value(QStringLiteral("title")).toString(), QStringLiteral("item 2500"));
+    QVERIFY(bounded.get(2501).value(QStringLiteral("slug")).toString().startsWith(QLatin1String("2501 ")));
+    QVERIFY(bounded.residentBytes() < all.residentBytes() / 2);
+    QCOMPARE(bounded.get(0).value(QStringLiteral("title")).toString(), QStringLiteral("item 0"));
+    QCOMPARE(bounded.get(1500).value(QStringLiteral("id")).toInt(), 1500);
+    QVERIFY(bounded.residentBytes() < all.residentBytes() / 2);
+
+    // a reselect starts over
+    bounded.refresh();
+    QCOMPARE(bounded.count(), 3000);
+    QCOMPARE(bounded.get(2999).value(QStringLiteral("title")).toString(), QStringLiteral("item 2999"));
+}
+
+static QVariantMap row(const QVariant &id, const QString &title)
+{
+    QVariantMap ret;
+    if (id.isValid())
+        ret.insert(QStringLiteral("id"), id);
+    ret.insert(QStringLiteral("title"), title);
+    return ret;
+}
+
+// a burst of writes is announced as one range per kind once the interval is over,
+// the values read in between are those of the writes already
+void tst_TableModel::coalesce()
+{
+    QVERIFY(exec(QStringLiteral("CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, title TEXT, slug TEXT)")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO items (title) VALUES ('a'), ('b'), ('c')")));
+
+    Item model;
+    setUp(&model);
+    model.coalesce(50);
+    model.componentComplete();
+    QCOMPARE(model.count(), 3);
+
+    QSignalSpy changed(&model, SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)));
+    QSignalSpy inserted(&model, SIGNAL(rowsInserted(QModelIndex,int,int)));
+    QSignalSpy removed(&model, SIGNAL(rowsRemoved(QModelIndex,int,int)));
+
+    model.update(row(1, QStringLiteral("x")));
+    model.update(row(3, QStringLiteral("z")));
+    QCOMPARE(changed.count(), 0);
+    QCOMPARE(model.get(0).value(QStringLiteral("title")).toString(), QStringLiteral("x"));
+    QTRY_COMPARE(changed.count(), 1);
+    QCOMPARE(changed.at(0).at(0).value<QModelIndex>().row(), 0);
+    QCOMPARE(changed.at(0).at(1).value<QModelIndex>().row(), 2);
+
+    for (int i = 0; i < 3; i++)
+        QVERIFY(model.insert(row(QVariant(), QString("new %1").arg(i))).isValid());
+    QCOMPARE(inserted.count(), 0);
+    QCOMPARE(model.count(), 3);
+    QTRY_COMPARE(inserted.count(), 1);
+    QCOMPARE(inserted.at(0).at(1).toInt(), 3);
+    QCOMPARE(inserted.at(0).at(2).toInt(), 5);
+    QCOMPARE(model.count(), 6);
+    QCOMPARE(model.get(5).value(QStringLiteral("title")).toString(), QStringLiteral("new 2"));
+
+    QVERIFY(model.remove(row(2, QString())));
+    QVERIFY(model.remove(row(3, QString())));
+    QCOMPARE(removed.count(), 0);
+    QCOMPARE(model.count(), 6);
+    QTRY_COMPARE(removed.count(), 1);
+    QCOMPARE(removed.at(0).at(1).toInt(), 1);
+    QCOMPARE(removed.at(0).at(2).toInt(), 2);
+    QCOMPARE(model.count(), 4);
+    QCOMPARE(changed.count(), 1);
+}
+
+QTEST_MAIN(tst_TableModel)
+
+#include "tst_tablemodel.moc"
@@ -0,0 +1,7 @@
+CONFIG += testcase c++11
+
+TARGET = tst_treemodel
+
+include(../auto.pri)
+
+SOURCES += tst_treemodel.cpp
@@ -0,0 +1,184 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "database.h"
+#include "treemodel.h"
+
+#include <QtCore/QTemporaryDir>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+#include <QtTest/QtTest>
+
+class tst_TreeModel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void init();
+    void cleanup();
+    void fetch();
+    void refresh();
+
+private:
+    bool exec(const QString &sql);
+    QString name(const QModelIndex &index) const;
+
+    QTemporaryDir dir;
+    Database *database;
+    TreeModel *model;
+};
+
+static const QString connectionName = QStringLiteral("tst_treemodel");
+
+void tst_TreeModel::initTestCase()
+{
+    QVERIFY(dir.isValid());
+    database = new Database(this);
+    database->connectionName(connectionName);
+    database->type(QStringLiteral("QSQLITE"));
+    database->databaseName(dir.path() + QStringLiteral("/tst_treemodel.db"));
+    QVERIFY(database->open());
+}
+
+void tst_TreeModel::cleanupTestCase()
+{
+    delete database;
+    database = 0;
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+// a (a1, a2 (a2c)), b (b1)
+void tst_TreeModel::init()
+{
+    QVERIFY(exec(QStringLiteral("CREATE TABLE folders (id INTEGER PRIMARY KEY, parent_id INTEGER, name TEXT, position INTEGER)")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO folders VALUES (1, NULL, 'a', 1), (2, NULL, 'b', 2), (3, 1, 'a1', 1), (4, 1, 'a2', 2), (5, 2, 'b1', 1), (6, 4, 'a2c', 1)")));
+
+    model = new TreeModel;
+    model->database(database);
+    model->tableName(QStringLiteral("folders"));
+    model->parentKey(QStringLiteral("parent_id"));
+    model->order(QStringLiteral("position"));
+    model->componentComplete();
+}
+
+void tst_TreeModel::cleanup()
+{
+    delete model;
+    model = 0;
+    QVERIFY(exec(QStringLiteral("DROP TABLE folders")));
+}
+
+bool tst_TreeModel::exec(const QString &sql)
+{
+    QSqlQuery query(QSqlDatabase::database(connectionName));
+    if (!query.exec(sql)) {
+        qWarning() << sql << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+QString tst_TreeModel::name(const QModelIndex &index) const
+{
+    return model->get(index).value(QStringLiteral("name")).toString();
+}
+
+// the top level at once, the levels below when expanded
+void tst_TreeModel::fetch()
+{
+    QCOMPARE(model->rowCount(), 2);
+    QModelIndex a = model->index(0, 0);
+    QModelIndex b = model->index(1, 0);
+    QCOMPARE(name(a), QStringLiteral("a"));
+    QCOMPARE(name(b), QStringLiteral("b"));
+
+    QCOMPARE(model->rowCount(a), 0);
+    QVERIFY(model->hasChildren(a));
+    QVERIFY(model->canFetchMore(a));
+    model->fetchMore(a);
+    QVERIFY(!model->canFetchMore(a));
+    QCOMPARE(model->rowCount(a), 2);
+
+    QModelIndex a1 = model->index(0, 0, a);
+    QModelIndex a2 = model->index(1, 0, a);
+    QCOMPARE(name(a1), QStringLiteral("a1"));
+    QCOMPARE(model->parent(a2), a);
+    QVERIFY(!model->hasChildren(a1));
+    QVERIFY(model->hasChildren(a2));
+    QCOMPARE(model->rowCount(b), 0);
+}
+
+// a write keeps the expanded nodes and moves the rows instead of a reset
+void tst_TreeModel::refresh()
+{
+    QModelIndex a = model->index(0, 0);
+    model->fetchMore(a);
+    QPersistentModelIndex a2 = model->index(1, 0, a);
+    model->fetchMore(a2);
+    QCOMPARE(model->rowCount(a2), 1);
+    QModelIndex b = model->index(1, 0);
+
+    QVERIFY(exec(QStringLiteral("UPDATE folders SET name = 'a1x' WHERE id = 3")));
+    QVERIFY(exec(QStringLiteral("UPDATE folders SET position = 0 WHERE id = 4")));
+    QVERIFY(exec(QStringLiteral("INSERT INTO folders VALUES (7, 1, 'a3', 3)")));
+    QVERIFY(exec(QStringLiteral("DELETE FROM folders WHERE id = 5")));
+
+    QSignalSpy reset(model, SIGNAL(modelReset()));
+    QSignalSpy moved(model, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    QSignalSpy changed(model, SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)));
+    emit database->tableChanged(QStringLiteral("folders"));
+
+    QCOMPARE(reset.count(), 0);
+    QCOMPARE(moved.count(), 1);
+    QCOMPARE(model->rowCount(a), 3);
+    QVERIFY(a2.isValid());
+    QCOMPARE(a2.row(), 0);
+    QCOMPARE(name(model->index(1, 0, a)), QStringLiteral("a1x"));
+    QCOMPARE(name(model->index(2, 0, a)), QStringLiteral("a3"));
+
+    // expanded before, still expanded and the parent row of its children moved along
+    QCOMPARE(model->rowCount(a2), 1);
+    QModelIndex a2c = model->index(0, 0, a2);
+    QCOMPARE(name(a2c), QStringLiteral("a2c"));
+    QCOMPARE(model->parent(a2c).row(), 0);
+    QCOMPARE(model->parent(model->index(2, 0, a)).row(), 0);
+
+    // collapsed, told that it has no children anymore
+    QVERIFY(!model->hasChildren(b));
+    bool found = false;
+    for (int i = 0; i < changed.count(); i++)
+        found = found || changed.at(i).at(0).value<QModelIndex>() == b;
+    QVERIFY(found);
+}
+
+QTEST_MAIN(tst_TreeModel)
+
+#include "tst_treemodel.moc"
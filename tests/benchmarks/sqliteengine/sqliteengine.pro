@@ -0,0 +1,22 @@
+CONFIG += testcase benchmark c++11
+
+QT = core sql testlib
+
+TARGET = tst_bench_sqliteengine
+
+IMPORTS = $$PWD/../../../src/imports
+INCLUDEPATH += $$IMPORTS
+
+HEADERS += \
+    $$IMPORTS/sqliteengine.h \
+    $$IMPORTS/sqlitehandle.h \
+    $$IMPORTS/tracing.h
+
+SOURCES += \
+    tst_bench_sqliteengine.cpp \
+    $$IMPORTS/sqlitehandle.cpp \
+    $$IMPORTS/sqliteengine.cpp \
+    $$IMPORTS/tracing.cpp
+
+# as in imports.pro
+unix: LIBS += $$QMAKE_LIBS_DYNLOAD
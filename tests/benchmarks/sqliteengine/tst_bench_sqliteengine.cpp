@@ -0,0 +1,138 @@
+/* Copyright (c) 2012 Silk Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Silk nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL SILK BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sqliteengine.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QVariant>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+#include <QtSql/QSqlRecord>
+
+#include <QtTest/QtTest>
+
+// rows/sec of a model SELECT through QSqlQuery and through SqliteEngine, e.g.
+// ./tst_bench_sqliteengine -iterations 10 select or make benchmark; the native
+// row is skipped when the QSQLITE driver does not export the sqlite3 API
+class tst_Bench_SqliteEngine : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void select_data();
+    void select();
+
+private:
+    QSqlDatabase db;
+};
+
+static const QString connectionName = QStringLiteral("tst_bench_sqliteengine");
+static const char *query = "SELECT id, value, price, created FROM items";
+
+void tst_Bench_SqliteEngine::initTestCase()
+{
+    db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), connectionName);
+    db.setDatabaseName(QStringLiteral(":memory:"));
+    QVERIFY2(db.open(), qPrintable(db.lastError().text()));
+
+    QSqlQuery q(db);
+    QVERIFY(q.exec(QStringLiteral("CREATE TABLE items (id INTEGER PRIMARY KEY AUTOINCREMENT, value TEXT, price DOUBLE, created INTEGER)")));
+    QVERIFY(db.transaction());
+    QVERIFY(q.prepare(QStringLiteral("INSERT INTO items (value, price, created) VALUES (?, ?, ?)")));
+    for (int i = 0; i < 100000; i++) {
+        q.addBindValue(QString("item %1").arg(i));
+        q.addBindValue(i * 0.25);
+        q.addBindValue(1500000000 + i);
+        QVERIFY(q.exec());
+    }
+    QVERIFY(db.commit());
+}
+
+void tst_Bench_SqliteEngine::cleanupTestCase()
+{
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+void tst_Bench_SqliteEngine::select_data()
+{
+    QTest::addColumn<bool>("native");
+    QTest::newRow("qtsql") << false;
+    QTest::newRow("native") << true;
+}
+
+void tst_Bench_SqliteEngine::select()
+{
+    QFETCH(bool, native);
+    if (native && !SqliteEngine::isAvailable(db))
+        QSKIP("the QSQLITE driver does not export the sqlite3 API");
+
+    // the property types TableModel passes
+    QHash<int, QVariant::Type> types;
+    types.insert(0, QVariant::LongLong);
+    types.insert(1, QVariant::String);
+    types.insert(2, QVariant::Double);
+    types.insert(3, QVariant::LongLong);
+
+    int count = 0;
+    QBENCHMARK {
+        QList<QVariantList> rows;
+        if (native) {
+            QStringList columns;
+            QString error;
+            QVERIFY2(SqliteEngine::select(db, QLatin1String(query), QVariantList(), types, &columns, &rows, &error), qPrintable(error));
+        } else {
+            // what Database::execute() does on the QtSql path
+            QSqlQuery q(db);
+            q.setForwardOnly(true);
+            QVERIFY(q.exec(QLatin1String(query)));
+            int columns = q.record().count();
+            while (q.next()) {
+                QVariantList row;
+                row.reserve(columns);
+                for (int i = 0; i < columns; i++) {
+                    QVariant value = q.value(i);
+                    if (types.contains(i))
+                        value.convert(types.value(i));
+                    row.append(value);
+                }
+                rows.append(row);
+            }
+        }
+        count = rows.count();
+    }
+    QCOMPARE(count, 100000);
+}
+
+QTEST_MAIN(tst_Bench_SqliteEngine)
+
+#include "tst_bench_sqliteengine.moc"